@@ -0,0 +1,84 @@
+#!/bin/sh
+# Time ls, cp, mv2 and rm on synthetic images made with "fat mkimage".
+# usage: bench/bench.sh [work-dir]
+# For every image profile (size, files, file sizes, fragmentation) it reports
+# ops/s and MB/s for each command, run once per process and once through a
+# single batch script, plus syscall counts when strace is installed.
+
+FAT="${FAT:-./fat}"
+WORK="${1:-$(mktemp -d)}"
+case "$FAT" in /*) ;; *) FAT="$(pwd)/$FAT" ;; esac
+[ -z "$1" ] && trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$WORK"
+cd "$WORK" || exit 1
+
+now() { date +%s%N; }
+
+# report <label> <ops> <bytes> <start-ns> <end-ns>
+report() {
+    awk -v l="$1" -v ops="$2" -v b="$3" -v s="$4" -v e="$5" 'BEGIN {
+        t = (e - s) / 1e9; if (t <= 0) t = 1e-9
+        printf "  %-14s %6d ops %9.3f s %10.1f ops/s %9.1f MB/s\n", l, ops, t, ops / t, b / t / 1048576
+    }'
+}
+
+# syscalls <label> <command...>
+syscalls() {
+    label="$1"; shift
+    if command -v strace >/dev/null 2>&1; then
+        n=$(strace -c -f "$@" 2>&1 >/dev/null | awk '$NF == "total" { print $(NF-2) }')
+        printf "  %-14s %6s syscalls\n" "$label" "${n:-?}"
+    fi
+}
+
+# bench <name> <mkimage options...>
+bench() {
+    name="$1"; shift
+    img="$WORK/$name.img"
+    "$FAT" mkimage "$@" "$img" 2>/dev/null || { echo "$name: mkimage failed" >&2; return; }
+    files=$("$FAT" ls "$img" | head -n 50)
+    n=$(echo "$files" | wc -l)
+    bytes=$(ls -l "$img" | awk '{ print $5 }')
+    echo "$name ($*)"
+
+    s=$(now)
+    i=0; while [ $i -lt 20 ]; do "$FAT" ls "$img" >/dev/null; i=$((i + 1)); done
+    report "ls" 20 0 "$s" "$(now)"
+    syscalls "ls" "$FAT" ls "$img"
+
+    # ls prints the padded names, cp wants NAME.EXT
+    names=$(echo "$files" | sed 's/^\(.\{8\}\)\(.*\)$/\1.\2/; s/ *\././; s/ *$//; s/\.$//')
+    # untimed pass: warms the page cache and counts the bytes copied
+    total=0
+    for f in $names; do
+        "$FAT" cp "$f" "$WORK/out" "$img" 2>/dev/null && total=$((total + $(stat -c %s "$WORK/out")))
+    done
+    s=$(now)
+    for f in $names; do "$FAT" cp "$f" "$WORK/out" "$img" 2>/dev/null; done
+    report "cp" "$n" "$total" "$s" "$(now)"
+    syscalls "cp" "$FAT" cp "$(echo "$names" | head -n 1)" "$WORK/out" "$img"
+
+    for f in $names; do echo "cp $f $WORK/out"; done > "$WORK/cp.batch"
+    s=$(now)
+    "$FAT" batch "$WORK/cp.batch" "$img" 2>/dev/null
+    report "cp (batch)" "$n" "$total" "$s" "$(now)"
+
+    cp "$img" "$WORK/rw.img"
+    i=0; while [ $i -lt 20 ]; do head -c 65536 /dev/urandom > "$WORK/NEW$i.BIN"; i=$((i + 1)); done
+    s=$(now)
+    i=0; while [ $i -lt 20 ]; do "$FAT" mv2 "$WORK/NEW$i.BIN" "$WORK/rw.img" >/dev/null 2>&1; i=$((i + 1)); done
+    report "mv2" 20 $((20 * 65536)) "$s" "$(now)"
+
+    s=$(now)
+    for f in $names; do "$FAT" rm "$f" "$WORK/rw.img" >/dev/null 2>&1; done
+    report "rm" "$n" 0 "$s" "$(now)"
+
+    rm -f "$img" "$WORK/rw.img" "$WORK/out" "$WORK/cp.batch"
+}
+
+command -v strace >/dev/null 2>&1 || echo "strace not found: syscall counts skipped"
+
+bench small     -s 8M   -c 1 -n 100 -f 512:8K
+bench medium    -s 64M  -c 4 -n 400 -f 4K:256K -d log
+bench fragmented -s 64M -c 4 -n 400 -f 4K:256K -d log -F 30
+bench large     -s 256M -c 8 -n 200 -f 64K:1M
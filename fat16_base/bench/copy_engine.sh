@@ -0,0 +1,58 @@
+#!/bin/sh
+# Compare put and cp of large files with and without the async copy engine.
+# usage: bench/copy_engine.sh [file-size-MiB] [work-dir]
+# Each mode puts the same random file into an empty image and copies it back
+# out, reporting MB/s; the engine is run with io_uring and with threads at
+# several queue depths and buffer sizes. When the page cache can be dropped
+# (root) every run starts cold, which is where overlapping reads pays off.
+
+FAT="${FAT:-./fat}"
+MIB="${1:-256}"
+WORK="${2:-$(mktemp -d)}"
+case "$FAT" in /*) ;; *) FAT="$(pwd)/$FAT" ;; esac
+[ -z "$2" ] && trap 'rm -rf "$WORK"' EXIT
+mkdir -p "$WORK"
+cd "$WORK" || exit 1
+
+now() { date +%s%N; }
+
+drop() {
+    sync
+    [ -w /proc/sys/vm/drop_caches ] && echo 3 > /proc/sys/vm/drop_caches
+}
+
+# report <label> <op> <bytes> <start-ns> <end-ns>
+report() {
+    awk -v l="$1" -v op="$2" -v b="$3" -v s="$4" -v e="$5" 'BEGIN {
+        t = (e - s) / 1e9; if (t <= 0) t = 1e-9
+        printf "  %-34s %-3s %9.3f s %9.1f MB/s\n", l, op, t, b / t / 1048576
+    }'
+}
+
+# run <label> <global options...>
+run() {
+    label="$1"; shift
+    rm -f img out
+    "$FAT" mkfs -s $((MIB * 2 + 64))M img >/dev/null 2>&1 || { echo "mkfs failed" >&2; exit 1; }
+    drop
+    s=$(now); "$FAT" "$@" put src BIG img >/dev/null || return; e=$(now)
+    report "$label" put "$bytes" "$s" "$e"
+    drop
+    s=$(now); "$FAT" "$@" cp /BIG out img 2>/dev/null || return; e=$(now)
+    report "$label" cp "$bytes" "$s" "$e"
+    cmp -s src out || echo "  $label: copy differs" >&2
+}
+
+head -c $((MIB * 1048576)) /dev/urandom > src
+bytes=$((MIB * 1048576))
+[ -w /proc/sys/vm/drop_caches ] && echo "cold page cache" || echo "warm page cache (not root)"
+
+# the default is --io=mmap, with copy_file_range out of the image
+run "plain" --io=stdio
+run "plain mmap"
+for d in 1 4 16; do
+    run "io_uring depth $d" --aio=uring --aio-depth=$d
+    run "threads depth $d" --aio=threads --aio-depth=$d
+done
+run "io_uring depth 8, 256K buffers" --aio=uring --aio-buffer=256K
+run "io_uring depth 8, 4M buffers" --aio=uring --aio-buffer=4M
@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compare extract-all with 1, 2, 4 ... N worker threads on one image.
+# usage: bench/extract_threads.sh <fat16-img> [max-threads]
+# Each run extracts into a fresh temporary directory; the page cache is
+# warmed by a first untimed run so every thread count reads the same way.
+
+IMG="$1"
+MAX="${2:-$(nproc)}"
+FAT="${FAT:-./fat}"
+
+if [ -z "$IMG" ]; then
+    echo "usage: $0 <fat16-img> [max-threads]" >&2
+    exit 1
+fi
+
+OUT=$(mktemp -d)
+trap 'rm -rf "$OUT"' EXIT
+
+"$FAT" extract-all -j 1 "$OUT/warm" "$IMG" 2>/dev/null
+
+j=1
+while [ "$j" -le "$MAX" ]; do
+    rm -rf "$OUT/run"
+    "$FAT" extract-all -j "$j" "$OUT/run" "$IMG" 2>&1 | tail -n 1
+    j=$((j * 2))
+done
@@ -0,0 +1,462 @@
+#define _GNU_SOURCE
+#include "aio.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* one buffer and the operation it is part of */
+struct aio_op {
+    uint8_t *buf;
+    struct iovec iov; /* what io_uring reads into or writes from */
+    int fd; /* descriptor of the operation in flight */
+    int write; /* 0 while the buffer is being filled, 1 while it is written */
+    uint64_t src;
+    uint64_t dst;
+    uint32_t len;
+    uint32_t done; /* bytes of the current step moved so far */
+    ssize_t res; /* result of the thread ring, -errno on failure */
+};
+
+/* the rings shared with the kernel */
+struct aio_uring {
+    int fd;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_len;
+    size_t cq_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; /* entries queued but not submitted yet */
+};
+
+/* worker threads taking operations from a queue and posting them back */
+struct aio_threads {
+    pthread_t *workers;
+    int n_workers;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    int *sq; /* slots to run, in order */
+    int sq_head, sq_n;
+    int *cq; /* slots that completed */
+    int cq_head, cq_n;
+    int stop;
+};
+
+struct aio_engine {
+    int backend; /* AIO_URING or AIO_THREADS */
+    int depth;
+    uint32_t buffer_size;
+    uint8_t *buffers; /* depth buffers in one aligned block */
+    struct aio_op *ops;
+    pthread_mutex_t busy; /* held for the whole of a copy */
+    int broken; /* operations were lost in flight: the buffers can't be reused */
+    struct aio_uring ring;
+    struct aio_threads th;
+};
+
+/* set up an io_uring with room for depth entries and map its rings
+ * returns -1 if the kernel doesn't offer io_uring or mapping failed
+ */
+static int uring_open(struct aio_uring *r, int depth){
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    /* recent kernels map both rings with a single mmap */
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED)
+        goto fail_fd;
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)){
+        r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED)
+            goto fail_sq;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail_cq;
+
+    r->sq_tail = (unsigned *) ((uint8_t *) r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *) ((uint8_t *) r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *) ((uint8_t *) r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *) ((uint8_t *) r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((uint8_t *) r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *) ((uint8_t *) r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((uint8_t *) r->cq_ring + p.cq_off.cqes);
+    r->pending = 0;
+    return 0;
+
+fail_cq:
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_len);
+fail_sq:
+    munmap(r->sq_ring, r->sq_len);
+fail_fd:
+    close(r->fd);
+    return -1;
+}
+
+static void uring_close(struct aio_uring *r){
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_len);
+    munmap(r->sq_ring, r->sq_len);
+    close(r->fd);
+}
+
+/* queue the operation of a slot; it reaches the kernel on the next wait
+ * readv/writev with one vector are used as they are the oldest opcodes
+ */
+static void uring_queue(struct aio_uring *r, struct aio_op *op, int slot, uint64_t off){
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = op->fd;
+    sqe->off = off;
+    sqe->addr = (uint64_t) (uintptr_t) &op->iov;
+    sqe->len = 1;
+    sqe->user_data = slot;
+    r->sq_array[idx] = idx;
+    /* the entry must be visible before the kernel sees the new tail */
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->pending++;
+}
+
+/* submit what is queued and wait for one completion
+ * returns -1 if io_uring_enter failed
+ */
+static int uring_wait(struct aio_uring *r, int *slot, ssize_t *res){
+    unsigned head;
+    int n;
+
+    for (;;){
+        head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *slot = (int) cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        n = syscall(__NR_io_uring_enter, r->fd, r->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (n < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        r->pending -= n;
+    }
+}
+
+/* run queued operations until the engine is destroyed */
+static void *worker(void *arg){
+    struct aio_engine *e = arg;
+    struct aio_threads *t = &e->th;
+    struct aio_op *op;
+    ssize_t n;
+    int slot;
+
+    pthread_mutex_lock(&t->lock);
+    for (;;){
+        while (!t->stop && t->sq_n == 0)
+            pthread_cond_wait(&t->work, &t->lock);
+        if (t->stop)
+            break;
+        slot = t->sq[t->sq_head];
+        t->sq_head = (t->sq_head + 1) % e->depth;
+        t->sq_n--;
+        pthread_mutex_unlock(&t->lock);
+
+        op = &e->ops[slot];
+        if (op->write)
+            n = pwrite(op->fd, op->iov.iov_base, op->iov.iov_len, op->dst + op->done);
+        else
+            n = pread(op->fd, op->iov.iov_base, op->iov.iov_len, op->src + op->done);
+
+        pthread_mutex_lock(&t->lock);
+        op->res = n < 0 ? -errno : n;
+        t->cq[(t->cq_head + t->cq_n) % e->depth] = slot;
+        t->cq_n++;
+        pthread_cond_signal(&t->done);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* start one worker per slot
+ * returns -1 if the queues or the threads could not be created
+ */
+static int threads_open(struct aio_engine *e){
+    struct aio_threads *t = &e->th;
+
+    memset(t, 0, sizeof(*t));
+    t->sq = malloc(e->depth * sizeof(int));
+    t->cq = malloc(e->depth * sizeof(int));
+    t->workers = malloc(e->depth * sizeof(pthread_t));
+    if (!t->sq || !t->cq || !t->workers){
+        free(t->sq);
+        free(t->cq);
+        free(t->workers);
+        return -1;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->work, NULL);
+    pthread_cond_init(&t->done, NULL);
+
+    for (t->n_workers = 0; t->n_workers < e->depth; t->n_workers++){
+        if (pthread_create(&t->workers[t->n_workers], NULL, worker, e) != 0)
+            break;
+    }
+    /* fewer workers only means less parallelism, none means no engine */
+    return t->n_workers > 0 ? 0 : -1;
+}
+
+static void threads_close(struct aio_engine *e){
+    struct aio_threads *t = &e->th;
+    int i;
+
+    pthread_mutex_lock(&t->lock);
+    t->stop = 1;
+    pthread_cond_broadcast(&t->work);
+    pthread_mutex_unlock(&t->lock);
+    for (i = 0; i < t->n_workers; i++)
+        pthread_join(t->workers[i], NULL);
+
+    pthread_cond_destroy(&t->done);
+    pthread_cond_destroy(&t->work);
+    pthread_mutex_destroy(&t->lock);
+    free(t->workers);
+    free(t->sq);
+    free(t->cq);
+}
+
+static void threads_queue(struct aio_engine *e, int slot){
+    struct aio_threads *t = &e->th;
+
+    pthread_mutex_lock(&t->lock);
+    t->sq[(t->sq_head + t->sq_n) % e->depth] = slot;
+    t->sq_n++;
+    pthread_cond_signal(&t->work);
+    pthread_mutex_unlock(&t->lock);
+}
+
+static void threads_wait(struct aio_engine *e, int *slot, ssize_t *res){
+    struct aio_threads *t = &e->th;
+
+    pthread_mutex_lock(&t->lock);
+    while (t->cq_n == 0)
+        pthread_cond_wait(&t->done, &t->lock);
+    *slot = t->cq[t->cq_head];
+    t->cq_head = (t->cq_head + 1) % e->depth;
+    t->cq_n--;
+    *res = e->ops[*slot].res;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/* start the next step of a slot: the rest of its read or of its write */
+static void issue(struct aio_engine *e, int slot){
+    struct aio_op *op = &e->ops[slot];
+
+    op->iov.iov_base = op->buf + op->done;
+    op->iov.iov_len = op->len - op->done;
+    if (e->backend == AIO_URING)
+        uring_queue(&e->ring, op, slot, (op->write ? op->dst : op->src) + op->done);
+    else
+        threads_queue(e, slot);
+}
+
+struct aio_engine *aio_create(int backend, int depth, uint32_t buffer_size){
+    struct aio_engine *e;
+    int i;
+
+    buffer_size = (buffer_size + AIO_ALIGN - 1) / AIO_ALIGN * AIO_ALIGN;
+    if (depth < 1 || depth > AIO_MAX_DEPTH || buffer_size == 0 || buffer_size > AIO_MAX_BUFFER){
+        fprintf(stderr, "Profundidade de 1 a %d e buffers de até %d MiB\n",
+                AIO_MAX_DEPTH, AIO_MAX_BUFFER >> 20);
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e)
+        return NULL;
+    e->depth = depth;
+    e->buffer_size = buffer_size;
+    e->ops = calloc(depth, sizeof(*e->ops));
+    if (!e->ops || posix_memalign((void **) &e->buffers, AIO_ALIGN, (size_t) depth * buffer_size) != 0){
+        fprintf(stderr, "Erro ao alocar os buffers de cópia\n");
+        free(e->ops);
+        free(e);
+        return NULL;
+    }
+    for (i = 0; i < depth; i++)
+        e->ops[i].buf = e->buffers + (size_t) i * buffer_size;
+
+    if (backend != AIO_THREADS && uring_open(&e->ring, depth) == 0){
+        e->backend = AIO_URING;
+    } else if (backend == AIO_URING){
+        perror("io_uring indisponível");
+    } else if (threads_open(e) == 0){
+        e->backend = AIO_THREADS;
+    } else {
+        fprintf(stderr, "Erro ao criar as threads de cópia\n");
+    }
+    if (!e->backend){
+        free(e->buffers);
+        free(e->ops);
+        free(e);
+        return NULL;
+    }
+    pthread_mutex_init(&e->busy, NULL);
+    return e;
+}
+
+/* the copy keeps every buffer busy: a free buffer takes the next chunk of
+ * the ranges and is read, a filled buffer is written, and a written buffer
+ * is free again; short reads and writes are resumed where they stopped
+ * after a failure nothing new is started and what is in flight is drained
+ */
+int aio_copy(struct aio_engine *e, int src_fd, int dst_fd, const struct aio_range *ranges, int n){
+    int *free_slots;
+    int n_free, inflight = 0, next = 0, err = 0, slot;
+    uint32_t pos = 0;
+    ssize_t res;
+
+    if (pthread_mutex_trylock(&e->busy) != 0)
+        return 1;
+    /* a broken ring only rules out the engine, not the copy */
+    if (e->broken){
+        pthread_mutex_unlock(&e->busy);
+        return 1;
+    }
+    free_slots = malloc(e->depth * sizeof(int));
+    if (!free_slots){
+        pthread_mutex_unlock(&e->busy);
+        errno = ENOMEM;
+        return -1;
+    }
+    for (n_free = 0; n_free < e->depth; n_free++)
+        free_slots[n_free] = e->depth - 1 - n_free;
+
+    for (;;){
+        while (!err && n_free > 0 && next < n){
+            struct aio_op *op;
+            uint32_t len = ranges[next].len - pos;
+
+            if (len == 0){
+                next++;
+                pos = 0;
+                continue;
+            }
+            if (len > e->buffer_size)
+                len = e->buffer_size;
+            slot = free_slots[--n_free];
+            op = &e->ops[slot];
+            op->fd = src_fd;
+            op->write = 0;
+            op->src = ranges[next].src + pos;
+            op->dst = ranges[next].dst + pos;
+            op->len = len;
+            op->done = 0;
+            issue(e, slot);
+            inflight++;
+
+            pos += len;
+            if (pos == ranges[next].len){
+                next++;
+                pos = 0;
+            }
+        }
+        if (inflight == 0)
+            break;
+
+        if (e->backend == AIO_URING){
+            if (uring_wait(&e->ring, &slot, &res) != 0){
+                /* the ring is unusable: the operations in flight can't be reaped */
+                err = errno;
+                e->broken = 1;
+                break;
+            }
+        } else {
+            threads_wait(e, &slot, &res);
+        }
+        inflight--;
+
+        struct aio_op *op = &e->ops[slot];
+        if (!err && res <= 0)
+            err = res < 0 ? -res : EIO; /* nothing read: the source is shorter */
+        if (err){
+            free_slots[n_free++] = slot;
+            continue;
+        }
+        op->done += res;
+        if (op->done == op->len && !op->write){
+            /* filled: write it out while the other buffers keep reading */
+            op->fd = dst_fd;
+            op->write = 1;
+            op->done = 0;
+        } else if (op->done == op->len){
+            free_slots[n_free++] = slot;
+            continue;
+        }
+        issue(e, slot);
+        inflight++;
+    }
+
+    free(free_slots);
+    pthread_mutex_unlock(&e->busy);
+    if (err){
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+const char *aio_name(struct aio_engine *e){
+    return e->backend == AIO_URING ? "io_uring" : "threads";
+}
+
+void aio_destroy(struct aio_engine *e){
+    if (!e)
+        return;
+    if (e->backend == AIO_URING)
+        uring_close(&e->ring);
+    else
+        threads_close(e);
+    pthread_mutex_destroy(&e->busy);
+    free(e->buffers);
+    free(e->ops);
+    free(e);
+}
@@ -0,0 +1,57 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdint.h>
+
+#define AIO_AUTO 0 /* io_uring, the thread ring where the kernel refuses it */
+#define AIO_URING 1 /* io_uring only */
+#define AIO_THREADS 2 /* worker threads doing pread/pwrite */
+
+#define AIO_DEPTH 8 /* reads and writes in flight by default */
+#define AIO_MAX_DEPTH 256
+#define AIO_BUFFER (1 << 20) /* default size of each buffer */
+#define AIO_MAX_BUFFER (64 << 20)
+#define AIO_ALIGN 4096 /* buffers are aligned for O_DIRECT descriptors */
+
+/* included after fat16.h, whose packing would change the layout */
+#pragma pack(push, 8)
+
+/* len bytes to move from offset src of one descriptor to dst of another */
+struct aio_range {
+    uint64_t src;
+    uint64_t dst;
+    uint32_t len;
+};
+
+#pragma pack(pop)
+
+/* An asynchronous copy engine.
+ * Owns depth aligned buffers of buffer_size bytes, reused by every copy.
+ * Each buffer is read from the source and written to the destination, and
+ * the reads of later buffers are in flight while earlier ones are written.
+ * The operations go through io_uring, or a ring of worker threads where
+ * io_uring isn't available. An engine runs one copy at a time.
+ */
+struct aio_engine;
+
+/* create an engine with the given backend, queue depth and buffer size
+ * (rounded up to AIO_ALIGN)
+ * returns NULL if the values are out of range or nothing could be set up
+ */
+struct aio_engine *aio_create(int, int, uint32_t);
+
+/* copy n ranges from one descriptor to another, both read and written at
+ * explicit offsets, so their file positions are left alone
+ * returns 0 if everything was copied, -1 if a read or write failed (with
+ * errno set), and 1 without copying anything if the engine is in use or
+ * broken by an earlier failure of its ring
+ */
+int aio_copy(struct aio_engine *, int, int, const struct aio_range *, int);
+
+/* name of the backend actually used, "io_uring" or "threads" */
+const char *aio_name(struct aio_engine *);
+
+/* wait for the workers and release the buffers and the ring */
+void aio_destroy(struct aio_engine *);
+
+#endif
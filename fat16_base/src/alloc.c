@@ -0,0 +1,205 @@
+#include "alloc.h"
+#include <stdlib.h>
+
+#define IS_FREE(fat, c) (((fat)->free_map[(c) / 64] >> ((c) % 64)) & 1)
+
+/* build the free-cluster bitmap from the cached FAT
+ * returns -1 if memory could not be allocated
+ */
+int fat_alloc_init(struct fat_cache *fat){
+    uint32_t i;
+
+    free(fat->free_map);
+    fat->free_map = calloc((fat->n_entries + 63) / 64, sizeof(uint64_t));
+    if (!fat->free_map){
+        fprintf(stderr, "Erro ao alocar o mapa de clusters livres\n");
+        return -1;
+    }
+
+    fat->n_free = 0;
+    for (i = 2; i < fat->n_entries; i++){
+        if (fat->entries[i] == 0x0000){
+            fat->free_map[i / 64] |= (uint64_t) 1 << (i % 64);
+            fat->n_free++;
+        }
+    }
+    fat->cursor = 2;
+    return 0;
+}
+
+/* first free cluster in [from, limit), or limit if there is none
+ * whole bitmap words without a free cluster are skipped at once
+ */
+static uint32_t next_free(struct fat_cache *fat, uint32_t from, uint32_t limit){
+    while (from < limit){
+        uint64_t word = fat->free_map[from / 64] >> (from % 64);
+        if (word){
+            from += __builtin_ctzll(word);
+            return from < limit ? from : limit;
+        }
+        from = (from / 64 + 1) * 64;
+    }
+    return limit;
+}
+
+/* length of the free run starting at a cluster, stopping at max */
+static uint32_t run_length(struct fat_cache *fat, uint32_t from, uint32_t limit, uint32_t max){
+    uint32_t len = 0;
+
+    while (from + len < limit && len < max && IS_FREE(fat, from + len))
+        len++;
+    return len;
+}
+
+/* link [start, start + len) as a chain and move the cursor past it */
+static void take_run(struct fat_cache *fat, uint32_t start, uint32_t len){
+    uint32_t i;
+
+    for (i = 0; i + 1 < len; i++)
+        fat_cache_set(fat, start + i, start + i + 1);
+    fat_cache_set(fat, start + len - 1, FAT_EOF);
+
+    fat->cursor = start + len;
+    if (fat->cursor >= fat->n_entries)
+        fat->cursor = 2;
+}
+
+/* move the next-fit cursor, so the next search starts at a cluster */
+void fat_alloc_hint(struct fat_cache *fat, uint32_t cluster){
+    if (cluster >= 2 && cluster < fat->n_entries)
+        fat->cursor = cluster;
+}
+
+/* take one free cluster, marking it as end of chain */
+uint32_t fat_alloc_one(struct fat_cache *fat){
+    uint32_t got;
+    return fat_alloc_run(fat, 1, &got);
+}
+
+/* take a run of up to n contiguous free clusters, linked as a chain
+ * the search goes from the cursor to the end of the table and then wraps
+ * around; it stops at the first run of n clusters
+ */
+uint32_t fat_alloc_run(struct fat_cache *fat, uint32_t n, uint32_t *got){
+    uint32_t best = 0, best_len = 0;
+    uint32_t pass, from, limit, len;
+
+    *got = 0;
+    if (n == 0 || fat->n_free == 0)
+        return 0;
+
+    for (pass = 0; pass < 2; pass++){
+        from = pass == 0 ? fat->cursor : 2;
+        limit = pass == 0 ? fat->n_entries : fat->cursor;
+
+        while ((from = next_free(fat, from, limit)) < limit){
+            len = run_length(fat, from, limit, n);
+            if (len == n){
+                take_run(fat, from, len);
+                *got = len;
+                return from;
+            }
+            if (len > best_len){
+                best = from;
+                best_len = len;
+            }
+            from += len;
+        }
+    }
+
+    if (best_len == 0)
+        return 0;
+    take_run(fat, best, best_len);
+    *got = best_len;
+    return best;
+}
+
+/* take the lowest run of exactly n free clusters inside [from, limit)
+ * used to place data at a chosen part of the volume; the cursor is left
+ * after the run, as with the other allocations
+ */
+uint32_t fat_alloc_in(struct fat_cache *fat, uint32_t n, uint32_t from, uint32_t limit){
+    uint32_t len;
+
+    if (n == 0 || n > fat->n_free)
+        return 0;
+    if (from < 2)
+        from = 2;
+    if (limit > fat->n_entries)
+        limit = fat->n_entries;
+
+    while ((from = next_free(fat, from, limit)) < limit){
+        len = run_length(fat, from, limit, n);
+        if (len == n){
+            take_run(fat, from, len);
+            return from;
+        }
+        from += len;
+    }
+    return 0;
+}
+
+/* remember a freed cluster, kept out of the bitmap until released
+ * if the list can't grow the cluster is simply lost until the next mount,
+ * which is safe
+ */
+void fat_alloc_hold(struct fat_cache *fat, uint32_t cluster){
+    if (fat->n_held == fat->held_cap){
+        uint32_t cap = fat->held_cap ? fat->held_cap * 2 : 256;
+        uint32_t *tmp = realloc(fat->held, cap * sizeof(*tmp));
+        if (!tmp)
+            return;
+        fat->held = tmp;
+        fat->held_cap = cap;
+    }
+    fat->held[fat->n_held++] = cluster;
+}
+
+/* put the clusters held since the last release back in the bitmap
+ * a cluster taken back in the meantime is in use again and skipped
+ */
+void fat_alloc_release(struct fat_cache *fat){
+    uint32_t i, c;
+
+    if (!fat->free_map){
+        fat->n_held = 0;
+        return;
+    }
+    for (i = 0; i < fat->n_held; i++){
+        c = fat->held[i];
+        if (fat->entries[c] == 0x0000 && !IS_FREE(fat, c)){
+            fat->free_map[c / 64] |= (uint64_t) 1 << (c % 64);
+            fat->n_free++;
+        }
+    }
+    fat->n_held = 0;
+}
+
+/* take n clusters linked as a single chain, using as few runs as possible */
+uint32_t fat_alloc_chain(struct fat_cache *fat, uint32_t n){
+    uint32_t first = 0, tail = 0;
+    uint32_t start, got;
+
+    if (n > fat->n_free)
+        return 0;
+
+    while (n > 0){
+        start = fat_alloc_run(fat, n, &got);
+        if (got == 0){
+            /* clusters taken by this call were never in use, so they go
+             * straight back even when frees are held */
+            int hold = fat->hold;
+            fat->hold = 0;
+            fat_cache_free_chain(fat, first);
+            fat->hold = hold;
+            return 0;
+        }
+        if (tail)
+            fat_cache_set(fat, tail, start);
+        else
+            first = start;
+        tail = start + got - 1;
+        n -= got;
+    }
+    return first;
+}
@@ -0,0 +1,52 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include "fatcache.h"
+
+/* Cluster allocator.
+ * Works on a free-cluster bitmap built from the cached FAT at mount time and
+ * kept in step by fat_cache_set(). Searches start at a next-fit cursor, so
+ * consecutive allocations continue where the previous one stopped instead of
+ * rescanning the table from the start.
+ */
+
+/* With hold set, a cluster freed by fat_cache_set() stays out of the bitmap
+ * until fat_alloc_release(): under a journal, clusters the last committed
+ * state still uses must not receive new data before the transaction that
+ * frees them commits.
+ */
+
+/* build the free-cluster bitmap from the cached FAT */
+int fat_alloc_init(struct fat_cache *);
+
+/* move the next-fit cursor, so the next search starts at a cluster */
+void fat_alloc_hint(struct fat_cache *, uint32_t);
+
+/* take one free cluster, marking it as end of chain
+ * returns 0 if the volume is full
+ */
+uint32_t fat_alloc_one(struct fat_cache *);
+
+/* take a run of up to n contiguous free clusters, linked as a chain
+ * a run of exactly n is preferred; otherwise the longest run is taken
+ * returns the first cluster and stores the run length in the last argument
+ */
+uint32_t fat_alloc_run(struct fat_cache *, uint32_t, uint32_t *);
+
+/* take the lowest run of exactly n free clusters inside [from, limit)
+ * returns the first cluster, or 0 if there is no such run
+ */
+uint32_t fat_alloc_in(struct fat_cache *, uint32_t, uint32_t, uint32_t);
+
+/* remember a freed cluster, kept out of the bitmap until released */
+void fat_alloc_hold(struct fat_cache *, uint32_t);
+
+/* put the clusters held since the last release back in the bitmap */
+void fat_alloc_release(struct fat_cache *);
+
+/* take n clusters linked as a single chain, using as few runs as possible
+ * returns the first cluster, or 0 (with nothing allocated) if there is no room
+ */
+uint32_t fat_alloc_chain(struct fat_cache *, uint32_t);
+
+#endif
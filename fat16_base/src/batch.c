@@ -0,0 +1,96 @@
+#include "batch.h"
+#include "commands.h"
+#include "support.h"
+#include <ctype.h>
+#include <string.h>
+
+#define BATCH_MAX_LINE 4096
+#define BATCH_MAX_ARGS 8
+
+/* split a script line into words, in place
+ * words are separated by blanks; double quotes keep blanks inside a word
+ * (padded 8.3 names such as "TESTE   TXT")
+ */
+static int split_line(char *line, char **argv, int max){
+    int argc = 0;
+    char *p = line;
+
+    while (*p && argc < max){
+        while (isspace((unsigned char) *p))
+            p++;
+        if (*p == '\0' || *p == '#')
+            break;
+
+        if (*p == '"'){
+            argv[argc++] = ++p;
+            while (*p && *p != '"')
+                p++;
+        } else {
+            argv[argc++] = p;
+            while (*p && !isspace((unsigned char) *p))
+                p++;
+        }
+        if (*p)
+            *p++ = '\0';
+    }
+    return argc;
+}
+
+/* run the script at the given path ("-" for stdin)
+ * every operation reports its status and time on stderr, followed by a
+ * summary with the total time, including the final flush, and the block
+ * cache counters when the cache backend is used
+ */
+int batch(struct fat_volume *vol, const char *path){
+    char line[BATCH_MAX_LINE];
+    char *argv[BATCH_MAX_ARGS];
+    int argc, lineno = 0, ops = 0, failed = 0;
+    double start, op_start, flush_start, end;
+
+    FILE *script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!script){
+        fprintf(stderr, "Erro ao abrir o script '%s'\n", path);
+        return -1;
+    }
+
+    start = now_ms();
+    while (fgets(line, sizeof(line), script)){
+        lineno++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        argc = split_line(line, argv, BATCH_MAX_ARGS);
+        if (argc == 0)
+            continue;
+
+        op_start = now_ms();
+        int ret = run_command(vol, argc, argv);
+        ops++;
+        if (ret != 0)
+            failed++;
+
+        fprintf(stderr, "[%d] %s: %s (%.3f ms)\n", lineno, argv[0],
+                ret == 0 ? "ok" : "FAILED", now_ms() - op_start);
+    }
+
+    if (script != stdin)
+        fclose(script);
+
+    flush_start = now_ms();
+    if (vol_sync(vol) != 0){
+        fprintf(stderr, "Erro ao gravar a imagem\n");
+        failed++;
+    }
+    end = now_ms();
+
+    fprintf(stderr, "%d operation(s), %d failed, %.3f ms total (%.3f ms flush)\n",
+            ops, failed, end - start, end - flush_start);
+    if (vol->cache){
+        struct bcache_stats *st = &vol->cache->st;
+        fprintf(stderr, "cache: %llu hit(s), %llu miss(es), %llu block(s) read ahead, "
+                "%llu read(s) and %llu write(s) to the image\n",
+                (unsigned long long) st->hits, (unsigned long long) st->misses,
+                (unsigned long long) st->readahead, (unsigned long long) st->reads,
+                (unsigned long long) st->writes);
+    }
+    return failed;
+}
@@ -0,0 +1,22 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "volume.h"
+
+/* Batch mode.
+ * Runs a script of commands, one per line, against a single mounted volume:
+ * the FAT, the root directory and the allocator stay in memory between
+ * operations and are flushed (and fsync'ed) once at the end.
+ *
+ *     # comment
+ *     cp TESTE.TXT /tmp/teste.txt
+ *     rm "TEXTO2  TXT"
+ *     mv2 novo.txt
+ */
+
+/* run the script at the given path ("-" for stdin)
+ * returns the number of operations that failed, or -1 if it couldn't run
+ */
+int batch(struct fat_volume *, const char *);
+
+#endif
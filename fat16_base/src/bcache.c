@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include "bcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#define BCACHE_IOV 64 /* blocks moved by one request at most */
+
+static uint32_t bucket(struct bcache *c, uint64_t block){
+    return (uint32_t) ((block * 11400714819323198485ull) >> 32) & c->hmask;
+}
+
+/* buffer holding a block, or -1 */
+static int32_t lookup(struct bcache *c, uint64_t block){
+    int32_t i;
+
+    for (i = c->hash[bucket(c, block)]; i >= 0; i = c->bufs[i].hnext){
+        if (c->bufs[i].block == block)
+            return i;
+    }
+    return -1;
+}
+
+static void hash_add(struct bcache *c, int32_t i, uint64_t block){
+    uint32_t b = bucket(c, block);
+
+    c->bufs[i].block = block;
+    c->bufs[i].valid = 1;
+    c->bufs[i].dirty = 0;
+    c->bufs[i].hnext = c->hash[b];
+    c->hash[b] = i;
+}
+
+static void hash_del(struct bcache *c, int32_t i){
+    int32_t *p = &c->hash[bucket(c, c->bufs[i].block)];
+
+    while (*p != i)
+        p = &c->bufs[*p].hnext;
+    *p = c->bufs[i].hnext;
+    c->bufs[i].valid = 0;
+    c->bufs[i].dirty = 0;
+}
+
+static void lru_unlink(struct bcache *c, int32_t i){
+    struct bcache_buf *b = &c->bufs[i];
+
+    if (b->prev >= 0)
+        c->bufs[b->prev].next = b->next;
+    else
+        c->head = b->next;
+    if (b->next >= 0)
+        c->bufs[b->next].prev = b->prev;
+    else
+        c->tail = b->prev;
+}
+
+/* make a buffer the most recently used one */
+static void lru_touch(struct bcache *c, int32_t i){
+    lru_unlink(c, i);
+    c->bufs[i].prev = -1;
+    c->bufs[i].next = c->head;
+    if (c->head >= 0)
+        c->bufs[c->head].prev = i;
+    c->head = i;
+    if (c->tail < 0)
+        c->tail = i;
+}
+
+/* make a buffer the first one to be reused */
+static void lru_drop(struct bcache *c, int32_t i){
+    lru_unlink(c, i);
+    c->bufs[i].next = -1;
+    c->bufs[i].prev = c->tail;
+    if (c->tail >= 0)
+        c->bufs[c->tail].next = i;
+    c->tail = i;
+    if (c->head < 0)
+        c->head = i;
+}
+
+/* bytes of a block that lie inside the image */
+static uint32_t block_len(struct bcache *c, uint64_t block){
+    uint64_t off = block * BCACHE_BLOCK;
+
+    if (off >= c->size)
+        return 0;
+    return c->size - off < BCACHE_BLOCK ? c->size - off : BCACHE_BLOCK;
+}
+
+/* write count buffers holding consecutive blocks with one request */
+static int write_run(struct bcache *c, int32_t *idx, int count){
+    struct iovec iov[BCACHE_IOV];
+    uint64_t first = c->bufs[idx[0]].block;
+    size_t total = 0;
+    int k;
+
+    for (k = 0; k < count; k++){
+        iov[k].iov_base = c->bufs[idx[k]].data;
+        iov[k].iov_len = block_len(c, first + k);
+        total += iov[k].iov_len;
+    }
+    if (total > 0 && pwritev(c->fd, iov, count, first * BCACHE_BLOCK) != (ssize_t) total){
+        perror("Erro ao gravar blocos da imagem");
+        return -1;
+    }
+    for (k = 0; k < count; k++)
+        c->bufs[idx[k]].dirty = 0;
+    c->st.writes++;
+    c->st.bytes_written += total;
+    return 0;
+}
+
+/* write back a dirty buffer together with the dirty cached blocks right
+ * before and after it
+ */
+static int flush_around(struct bcache *c, int32_t i){
+    int32_t idx[BCACHE_IOV];
+    uint64_t first = c->bufs[i].block, last = first;
+    int32_t j;
+    int n = 0;
+
+    while (first > 0 && last - first + 1 < BCACHE_IOV &&
+            (j = lookup(c, first - 1)) >= 0 && c->bufs[j].dirty)
+        first--;
+    while (last - first + 1 < BCACHE_IOV && (j = lookup(c, last + 1)) >= 0 && c->bufs[j].dirty)
+        last++;
+    for (; first <= last; first++)
+        idx[n++] = lookup(c, first);
+    return write_run(c, idx, n);
+}
+
+/* a buffer for a new block: the least recently used one, written back
+ * first if it is dirty
+ * returns -1 if the write back failed
+ */
+static int32_t take_buf(struct bcache *c, uint64_t block){
+    int32_t i = c->tail;
+
+    if (c->bufs[i].dirty && flush_around(c, i) != 0)
+        return -1;
+    if (c->bufs[i].valid)
+        hash_del(c, i);
+    hash_add(c, i, block);
+    lru_touch(c, i);
+    return i;
+}
+
+/* read count consecutive blocks into new buffers with one request
+ * what lies past the end of the image reads as zeros
+ */
+static int load_run(struct bcache *c, uint64_t first, int count){
+    struct iovec iov[BCACHE_IOV];
+    int32_t idx[BCACHE_IOV];
+    ssize_t n;
+    int k;
+
+    for (k = 0; k < count; k++){
+        if ((idx[k] = take_buf(c, first + k)) < 0){
+            while (k-- > 0)
+                hash_del(c, idx[k]);
+            return -1;
+        }
+        iov[k].iov_base = c->bufs[idx[k]].data;
+        iov[k].iov_len = BCACHE_BLOCK;
+    }
+
+    n = preadv(c->fd, iov, count, first * BCACHE_BLOCK);
+    if (n < 0){
+        perror("Erro ao ler blocos da imagem");
+        for (k = 0; k < count; k++){
+            hash_del(c, idx[k]);
+            lru_drop(c, idx[k]);
+        }
+        return -1;
+    }
+    for (k = n / BCACHE_BLOCK; k < count; k++){
+        uint32_t from = (uint64_t) k * BCACHE_BLOCK < (uint64_t) n ? n % BCACHE_BLOCK : 0;
+        memset(c->bufs[idx[k]].data + from, 0, BCACHE_BLOCK - from);
+    }
+    c->st.reads++;
+    c->st.bytes_read += n;
+    return 0;
+}
+
+/* set up a cache of n blocks over an open image
+ * with direct, fd must have been opened with O_DIRECT
+ * returns -1 if memory could not be allocated
+ */
+int bcache_init(struct bcache *c, int fd, uint64_t size, uint32_t n, int direct){
+    uint32_t i, hsize = 16;
+
+    memset(c, 0, sizeof(*c));
+    while (hsize < n * 2)
+        hsize <<= 1;
+
+    c->fd = fd;
+    c->direct = direct;
+    c->size = size;
+    c->n = n;
+    c->hmask = hsize - 1;
+    c->bufs = calloc(n, sizeof(*c->bufs));
+    c->hash = malloc(hsize * sizeof(int32_t));
+    if (!c->bufs || !c->hash || posix_memalign((void **) &c->mem, BCACHE_BLOCK, (size_t) n * BCACHE_BLOCK) != 0){
+        fprintf(stderr, "Erro ao alocar o cache de blocos\n");
+        free(c->bufs);
+        free(c->hash);
+        return -1;
+    }
+    memset(c->hash, 0xff, hsize * sizeof(int32_t));
+
+    for (i = 0; i < n; i++){
+        c->bufs[i].data = c->mem + (size_t) i * BCACHE_BLOCK;
+        c->bufs[i].prev = i - 1;
+        c->bufs[i].next = i + 1 < n ? (int32_t) i + 1 : -1;
+    }
+    c->head = 0;
+    c->tail = n - 1;
+    c->last = (uint64_t) -2;
+    pthread_mutex_init(&c->lock, NULL);
+    return 0;
+}
+
+/* read len bytes at an image offset through the cache
+ * consecutive missing blocks are read with one request; a miss right
+ * after the previous one also reads ahead, the window doubling up to
+ * BCACHE_RA_MAX while the access stays sequential
+ * returns -1 if reading failed
+ */
+int bcache_read(struct bcache *c, uint64_t offset, void *buff, uint32_t len){
+    uint64_t b, end = (offset + len - 1) / BCACHE_BLOCK;
+    uint8_t *dst = buff;
+    int count, req, skip = 0, ret = 0;
+    int32_t i;
+
+    if (len == 0)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    for (b = offset / BCACHE_BLOCK; b <= end; b++){
+        if ((i = lookup(c, b)) < 0){
+            for (req = 1; b + req <= end && req < BCACHE_IOV && lookup(c, b + req) < 0; req++)
+                ;
+            c->ra = b == c->last + 1 ? (c->ra ? c->ra * 2 : BCACHE_RA_MIN) : 0;
+            if (c->ra > BCACHE_RA_MAX)
+                c->ra = BCACHE_RA_MAX;
+            for (count = req; count < req + (int) c->ra && count < BCACHE_IOV &&
+                    block_len(c, b + count) > 0 && lookup(c, b + count) < 0; count++)
+                ;
+            if (load_run(c, b, count) != 0){
+                ret = -1;
+                break;
+            }
+            c->st.misses += req;
+            c->st.readahead += count - req;
+            c->last = b + count - 1;
+            skip = req - 1;
+            i = lookup(c, b);
+        } else if (skip > 0){
+            skip--;
+            lru_touch(c, i);
+        } else {
+            c->st.hits++;
+            lru_touch(c, i);
+        }
+
+        uint32_t at = b == offset / BCACHE_BLOCK ? offset % BCACHE_BLOCK : 0;
+        uint32_t chunk = BCACHE_BLOCK - at < len ? BCACHE_BLOCK - at : len;
+        memcpy(dst, c->bufs[i].data + at, chunk);
+        dst += chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* write len bytes at an image offset into the cache
+ * a block only partly written is read first; whole blocks are not
+ * returns -1 if a block could not be read or a dirty one written back
+ */
+int bcache_write(struct bcache *c, uint64_t offset, const void *buff, uint32_t len){
+    uint64_t b, end = (offset + len - 1) / BCACHE_BLOCK;
+    const uint8_t *src = buff;
+    int ret = 0;
+    int32_t i;
+
+    if (len == 0)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    for (b = offset / BCACHE_BLOCK; b <= end; b++){
+        uint32_t at = b == offset / BCACHE_BLOCK ? offset % BCACHE_BLOCK : 0;
+        uint32_t chunk = BCACHE_BLOCK - at < len ? BCACHE_BLOCK - at : len;
+
+        if ((i = lookup(c, b)) >= 0){
+            c->st.hits++;
+            lru_touch(c, i);
+        } else if (at == 0 && chunk >= block_len(c, b)){
+            if ((i = take_buf(c, b)) < 0){
+                ret = -1;
+                break;
+            }
+            memset(c->bufs[i].data + chunk, 0, BCACHE_BLOCK - chunk);
+        } else {
+            if (load_run(c, b, 1) != 0){
+                ret = -1;
+                break;
+            }
+            c->st.misses++;
+            i = lookup(c, b);
+        }
+
+        memcpy(c->bufs[i].data + at, src, chunk);
+        c->bufs[i].dirty = 1;
+        src += chunk;
+        len -= chunk;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+static int cmp_block(const void *a, const void *b, void *arg){
+    struct bcache *c = arg;
+    uint64_t x = c->bufs[*(const int32_t *) a].block, y = c->bufs[*(const int32_t *) b].block;
+    return x < y ? -1 : x > y;
+}
+
+/* write every dirty block back to the image, in block order, one request
+ * per run of consecutive blocks
+ * returns -1 if writing failed
+ */
+int bcache_flush(struct bcache *c){
+    int32_t *idx;
+    uint32_t i, n = 0, start;
+    int ret = 0;
+
+    pthread_mutex_lock(&c->lock);
+    idx = malloc(c->n * sizeof(int32_t));
+    if (!idx){
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+    for (i = 0; i < c->n; i++){
+        if (c->bufs[i].dirty)
+            idx[n++] = i;
+    }
+    qsort_r(idx, n, sizeof(int32_t), cmp_block, c);
+
+    for (start = 0, i = 1; ret == 0 && start < n; i++){
+        if (i < n && i - start < BCACHE_IOV &&
+                c->bufs[idx[i]].block == c->bufs[idx[i - 1]].block + 1)
+            continue;
+        ret = write_run(c, idx + start, i - start);
+        start = i;
+    }
+    free(idx);
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* forget the cached blocks of a range, dirty or not
+ * blocks the range only partly covers are written back first, so the rest
+ * of them is not lost; if that fails the block stays cached and dirty, and
+ * the blocks after it are left alone
+ * returns -1 if a partly covered block could not be written
+ */
+int bcache_invalidate(struct bcache *c, uint64_t offset, uint64_t len){
+    uint64_t b, end = (offset + len - 1) / BCACHE_BLOCK;
+    int32_t i;
+    int ret = 0;
+
+    if (len == 0)
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    for (b = offset / BCACHE_BLOCK; b <= end; b++){
+        if ((i = lookup(c, b)) < 0)
+            continue;
+        int partial = b * BCACHE_BLOCK < offset || (b + 1) * BCACHE_BLOCK > offset + len;
+        if (partial && c->bufs[i].dirty && write_run(c, &i, 1) != 0){
+            ret = -1;
+            break;
+        }
+        hash_del(c, i);
+        lru_drop(c, i);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* write back and release the cache
+ * returns -1 if the dirty blocks could not be written
+ */
+int bcache_destroy(struct bcache *c){
+    int ret = 0;
+
+    if (!c->bufs)
+        return 0;
+    ret = bcache_flush(c);
+    pthread_mutex_destroy(&c->lock);
+    free(c->bufs);
+    free(c->hash);
+    free(c->mem);
+    c->bufs = NULL;
+    return ret;
+}
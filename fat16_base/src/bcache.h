@@ -0,0 +1,74 @@
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "fat16.h"
+#include <pthread.h>
+
+#define BCACHE_BLOCK 4096 /* bytes per block, a multiple of every sector size */
+#define BCACHE_BLOCKS 1024 /* blocks kept in memory (4 MiB) */
+#define BCACHE_RA_MIN 4 /* read-ahead window after the first sequential miss */
+#define BCACHE_RA_MAX 64 /* largest read-ahead window, in blocks */
+
+/* Block cache.
+ * The image is read and written in aligned blocks kept in an LRU cache.
+ * Misses on consecutive blocks are read with one request, and a run of
+ * sequential misses (a chain walk, a file copy) grows a read-ahead window.
+ * Writes only dirty the cached blocks; dirty blocks that are next to each
+ * other on disk go out with one request, when they are evicted or flushed.
+ * With direct I/O the image is opened with O_DIRECT and the buffers are
+ * aligned for it, so nothing is cached twice.
+ */
+struct bcache_buf {
+    uint64_t block;
+    uint8_t *data;
+    int32_t prev, next; /* LRU list, most recently used at the head */
+    int32_t hnext; /* next buffer in the same hash bucket */
+    uint8_t valid; /* holds the block */
+    uint8_t dirty; /* differs from the image */
+};
+
+struct bcache_stats {
+    uint64_t hits, misses; /* blocks found or not found in the cache */
+    uint64_t readahead; /* blocks read before they were asked for */
+    uint64_t reads, writes; /* requests made to the image */
+    uint64_t bytes_read, bytes_written;
+};
+
+struct bcache {
+    int fd;
+    int direct; /* fd was opened with O_DIRECT */
+    uint64_t size; /* image size, blocks past it read as zeros */
+    uint32_t n; /* number of buffers */
+    struct bcache_buf *bufs;
+    uint8_t *mem; /* the buffers' data, aligned */
+    int32_t *hash; /* buffer of a block, -1 if none */
+    uint32_t hmask;
+    int32_t head, tail;
+    uint64_t last; /* last block missed, for sequential detection */
+    uint32_t ra; /* current read-ahead window */
+    pthread_mutex_t lock;
+    struct bcache_stats st;
+};
+
+/* set up a cache of n blocks over an open image */
+int bcache_init(struct bcache *, int, uint64_t, uint32_t, int);
+
+/* read len bytes at an image offset through the cache */
+int bcache_read(struct bcache *, uint64_t, void *, uint32_t);
+
+/* write len bytes at an image offset into the cache */
+int bcache_write(struct bcache *, uint64_t, const void *, uint32_t);
+
+/* write every dirty block back to the image */
+int bcache_flush(struct bcache *);
+
+/* forget the cached blocks of a range, dirty or not
+ * returns -1 if a block the range only partly covers could not be written
+ * back, in which case it is kept
+ */
+int bcache_invalidate(struct bcache *, uint64_t, uint64_t);
+
+/* write back and release the cache */
+int bcache_destroy(struct bcache *);
+
+#endif
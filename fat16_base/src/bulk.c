@@ -0,0 +1,297 @@
+#include "bulk.h"
+#include "volume.h"
+#include "check.h"
+#include "commands.h"
+#include "dirscan.h"
+#include "extract.h"
+#include "output.h"
+#include "pool.h"
+#include "support.h"
+#include <glob.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define BULK_LS 0
+#define BULK_CHECK 1
+#define BULK_EXTRACT 2
+#define BULK_MAX_LINE 4096
+
+/* one image to process; filled in by the worker */
+struct bulk_image {
+    char *path;
+    char *outname; /* directory extract-all writes it into, under outdir */
+    int dup; /* another image has the same name */
+    int status; /* -1 if it failed, the problems found by check otherwise */
+    uint64_t size; /* bytes of the image */
+    uint64_t bytes; /* bytes extracted */
+};
+
+struct bulk_ctx {
+    int op;
+    int recursive; /* ls -R */
+    int flags; /* for vol_open */
+    const char *outdir;
+    struct bulk_image *imgs;
+    int n, cap;
+    pthread_mutex_t lock; /* one image's results are printed at a time */
+};
+
+static int add_image(struct bulk_ctx *ctx, const char *path){
+    if (ctx->n == ctx->cap){
+        int cap = ctx->cap ? ctx->cap * 2 : 64;
+        struct bulk_image *tmp = realloc(ctx->imgs, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        ctx->imgs = tmp;
+        ctx->cap = cap;
+    }
+    memset(&ctx->imgs[ctx->n], 0, sizeof(*ctx->imgs));
+    if (!(ctx->imgs[ctx->n].path = strdup(path)))
+        return -1;
+    ctx->n++;
+    return 0;
+}
+
+/* add the images an argument names: a pattern is expanded (for when the
+ * shell didn't), anything else is taken as a path
+ */
+static int add_arg(struct bulk_ctx *ctx, const char *arg){
+    glob_t g;
+    size_t i;
+    int ret = 0;
+
+    if (!strpbrk(arg, "*?["))
+        return add_image(ctx, arg);
+    switch (glob(arg, 0, NULL, &g)){
+    case 0:
+        break;
+    case GLOB_NOMATCH:
+        fprintf(stderr, "Nenhuma imagem encontrada para '%s'\n", arg);
+        return 0;
+    default:
+        return -1;
+    }
+    for (i = 0; ret == 0 && i < g.gl_pathc; i++)
+        ret = add_image(ctx, g.gl_pathv[i]);
+    globfree(&g);
+    return ret;
+}
+
+/* add the images listed in a file, one per line ("-" for stdin) */
+static int add_list(struct bulk_ctx *ctx, const char *path){
+    char line[BULK_MAX_LINE];
+    int ret = 0;
+
+    FILE *list = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (!list){
+        fprintf(stderr, "Erro ao abrir a lista '%s'\n", path);
+        return -1;
+    }
+    while (ret == 0 && fgets(line, sizeof(line), list)){
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+            ret = add_arg(ctx, line);
+    }
+    if (list != stdin)
+        fclose(list);
+    return ret;
+}
+
+static int outname_cmp(const void *a, const void *b){
+    return strcmp((*(struct bulk_image **) a)->outname, (*(struct bulk_image **) b)->outname);
+}
+
+/* name the output directory of every image after the image; images that
+ * share a name (disk.img in many directories) get their position in the
+ * list appended, so they never extract over each other
+ * returns -1 if two images would still share a directory
+ */
+static int name_outdirs(struct bulk_ctx *ctx){
+    struct bulk_image **sorted = malloc(ctx->n * sizeof(*sorted));
+    char name[4096];
+    int i, ret = 0;
+
+    if (!sorted)
+        return -1;
+    for (i = 0; i < ctx->n; i++){
+        const char *base = strrchr(ctx->imgs[i].path, '/');
+        if (!(ctx->imgs[i].outname = strdup(base ? base + 1 : ctx->imgs[i].path))){
+            free(sorted);
+            return -1;
+        }
+        sorted[i] = &ctx->imgs[i];
+    }
+
+    qsort(sorted, ctx->n, sizeof(*sorted), outname_cmp);
+    for (i = 0; i < ctx->n; i++){
+        sorted[i]->dup = (i > 0 && strcmp(sorted[i]->outname, sorted[i - 1]->outname) == 0) ||
+                (i + 1 < ctx->n && strcmp(sorted[i]->outname, sorted[i + 1]->outname) == 0);
+    }
+    for (i = 0; i < ctx->n; i++){
+        if (!ctx->imgs[i].dup)
+            continue;
+        snprintf(name, sizeof(name), "%s.%d", ctx->imgs[i].outname, i + 1);
+        free(ctx->imgs[i].outname);
+        if (!(ctx->imgs[i].outname = strdup(name))){
+            free(sorted);
+            return -1;
+        }
+    }
+
+    /* a numbered name can still be the name of another image */
+    qsort(sorted, ctx->n, sizeof(*sorted), outname_cmp);
+    for (i = 1; i < ctx->n; i++){
+        if (strcmp(sorted[i]->outname, sorted[i - 1]->outname) == 0){
+            fprintf(stderr, "'%s' e '%s' seriam extraídas no mesmo diretório '%s'\n",
+                    sorted[i - 1]->path, sorted[i]->path, sorted[i]->outname);
+            ret = -1;
+            break;
+        }
+    }
+    free(sorted);
+    return ret;
+}
+
+/* worker: open one image, run the operation on it and print its results
+ * the volume, and everything loaded for it, belongs to this worker alone
+ */
+static void bulk_one(void *arg, int i){
+    struct bulk_ctx *ctx = arg;
+    struct bulk_image *img = &ctx->imgs[i];
+    struct fat_volume vol;
+    char dir[4096];
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+
+    if (!out){
+        img->status = -1;
+        return;
+    }
+    if (vol_open(&vol, img->path, ctx->flags) != 0){
+        img->status = -1;
+    } else {
+        vol.out = out;
+        img->size = vol.size;
+        switch (ctx->op){
+        case BULK_LS:
+            if (ctx->recursive)
+                img->status = ls_recursive(&vol, 0, "/", vol.out);
+            else
+                img->status = dir_scan_root(&vol, show_file, out) < 0 ? -1 : 0;
+            break;
+        case BULK_CHECK:
+            img->status = check(&vol, 1, 0);
+            break;
+        case BULK_EXTRACT:
+            /* each image gets a directory of its own, named after it */
+            snprintf(dir, sizeof(dir), "%s/%s", ctx->outdir, img->outname);
+            img->status = extract_all(&vol, dir, 1, &img->bytes) == 0 ? 0 : -1;
+            break;
+        }
+        if (vol_close(&vol) != 0)
+            img->status = -1;
+    }
+    fclose(out);
+
+    pthread_mutex_lock(&ctx->lock);
+    fprintf(stdout, "==> %s <==%s\n%s", img->path, img->status < 0 ? " FAILED" : "", text);
+    fflush(stdout);
+    pthread_mutex_unlock(&ctx->lock);
+    free(text);
+}
+
+static void bulk_usage(void){
+    fprintf(stderr, "Uso: bulk [-j threads] [-l lista] ls [-R] | check | extract-all <dir> [imagem | padrão] ...\n");
+}
+
+/* run the bulk command line (argv[0] is "bulk") with the given vol_open flags */
+int bulk(int argc, char **argv, int flags){
+    struct bulk_ctx ctx;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1, failed = 0, problems = 0;
+    uint64_t size = 0, bytes = 0;
+    double start, end;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.flags = flags;
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    for (; i < argc && argv[i][0] == '-'; i++){
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+            threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc){
+            if (add_list(&ctx, argv[++i]) != 0)
+                return -1;
+        } else {
+            bulk_usage();
+            return -1;
+        }
+    }
+
+    if (i < argc && strcmp(argv[i], "ls") == 0){
+        ctx.op = BULK_LS;
+        if (++i < argc && strcmp(argv[i], "-R") == 0){
+            ctx.recursive = 1;
+            i++;
+        }
+    } else if (i < argc && strcmp(argv[i], "check") == 0){
+        ctx.op = BULK_CHECK;
+        i++;
+    } else if (i + 1 < argc && strcmp(argv[i], "extract-all") == 0){
+        ctx.op = BULK_EXTRACT;
+        ctx.outdir = argv[i + 1];
+        i += 2;
+        if (mkdir(ctx.outdir, 0755) != 0 && access(ctx.outdir, W_OK) != 0){
+            perror(ctx.outdir);
+            return -1;
+        }
+    } else {
+        bulk_usage();
+        return -1;
+    }
+
+    for (; i < argc; i++){
+        if (add_arg(&ctx, argv[i]) != 0)
+            return -1;
+    }
+    if (ctx.n == 0){
+        fprintf(stderr, "Nenhuma imagem para processar\n");
+        return -1;
+    }
+    if (ctx.op == BULK_EXTRACT && name_outdirs(&ctx) != 0)
+        return -1;
+    if (threads < 1)
+        threads = 1;
+    if (threads > ctx.n)
+        threads = ctx.n;
+
+    start = now_ms();
+    pool_run(threads, ctx.n, bulk_one, &ctx);
+    end = now_ms();
+
+    for (i = 0; i < ctx.n; i++){
+        if (ctx.imgs[i].status < 0)
+            failed++;
+        else if (ctx.imgs[i].status > 0)
+            problems++;
+        size += ctx.imgs[i].size;
+        bytes += ctx.imgs[i].bytes;
+        free(ctx.imgs[i].path);
+        free(ctx.imgs[i].outname);
+    }
+    free(ctx.imgs);
+    pthread_mutex_destroy(&ctx.lock);
+
+    fprintf(stderr, "%d image(s), %d failed, %d with problems, %d thread(s): %.3f ms, "
+            "%.1f images/s, %.1f MB/s of images", ctx.n, failed, problems, threads,
+            end - start, end > start ? ctx.n / ((end - start) / 1000.0) : 0.0,
+            end > start ? size / 1048576.0 / ((end - start) / 1000.0) : 0.0);
+    if (ctx.op == BULK_EXTRACT)
+        fprintf(stderr, ", %llu bytes extracted", (unsigned long long) bytes);
+    fprintf(stderr, "\n");
+    return failed + problems;
+}
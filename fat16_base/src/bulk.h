@@ -0,0 +1,18 @@
+#ifndef BULK_H
+#define BULK_H
+
+/* Bulk mode.
+ * Runs one operation (ls, check or extract-all) over many images within a
+ * single process. The images are handed out to a pool of threads; each
+ * worker opens its own volume, so no state is shared between images. The
+ * results of an image are collected in memory and printed as one block,
+ * headed by its path, when it is done, and a summary of the throughput and
+ * the errors ends the run.
+ */
+
+/* run the bulk command line (argv[0] is "bulk") with the given vol_open flags
+ * returns the number of images that failed or had problems
+ */
+int bulk(int, char **, int);
+
+#endif
@@ -0,0 +1,374 @@
+#include "check.h"
+#include "pool.h"
+#include "support.h"
+#include "lfn.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK_MAX_DEPTH 64
+#define CHECK_PATH_MAX 1024
+#define CHECK_CHUNK (1 << 20) /* bytes of a FAT copy compared at a time */
+
+#define CHAIN_OK 0
+#define CHAIN_LOOP 1 /* the chain comes back to one of its own clusters */
+#define CHAIN_CROSS 2 /* the chain runs into a cluster of another chain */
+#define CHAIN_BAD_LINK 3 /* a link to a cluster that doesn't exist or is bad */
+#define CHAIN_FREE_LINK 4 /* a link to a cluster marked free */
+
+/* one directory entry with a chain to validate */
+struct check_job {
+    struct fat_dirtab *dt;
+    uint32_t slot;
+    char *path;
+    int is_dir;
+    /* filled in by the worker */
+    uint32_t n_clusters; /* clusters claimed */
+    uint32_t tail; /* last cluster claimed, 0 if none */
+    int error; /* CHAIN_* */
+    uint32_t at; /* where the walk stopped on an error */
+    int other; /* the other claimant of a cross-linked cluster */
+};
+
+struct check_ctx {
+    struct fat_volume *vol;
+    struct fat_dirtab **dirs; /* subdirectories loaded for the run */
+    int n_dirs, cap_dirs;
+    struct check_job *jobs;
+    int n_jobs, cap_jobs;
+    int32_t *owner; /* per cluster: job index + 1, claimed atomically */
+    uint64_t *seen; /* directories already descended into */
+};
+
+static const char *chain_error[] = {
+    "ok", "loops back on itself", "is cross-linked with", "links to an invalid cluster",
+    "links to a free cluster"
+};
+
+static int add_job(struct check_ctx *ctx, struct fat_dirtab *dt, uint32_t slot, const char *path){
+    if (ctx->n_jobs == ctx->cap_jobs){
+        int cap = ctx->cap_jobs ? ctx->cap_jobs * 2 : 256;
+        struct check_job *tmp = realloc(ctx->jobs, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        ctx->jobs = tmp;
+        ctx->cap_jobs = cap;
+    }
+    struct check_job *job = &ctx->jobs[ctx->n_jobs];
+    memset(job, 0, sizeof(*job));
+    job->dt = dt;
+    job->slot = slot;
+    job->is_dir = (dt->ents[slot].attr & DIR_ATTR_DIRECTORY) != 0;
+    if (!(job->path = strdup(path)))
+        return -1;
+    ctx->n_jobs++;
+    return 0;
+}
+
+/* gather every entry of a directory and of the directories below it
+ * a directory is only descended into once, so directory loops end here
+ */
+static int collect(struct check_ctx *ctx, struct fat_dirtab *dt, const char *prefix, int depth){
+    char path[CHECK_PATH_MAX];
+    char name[LFN_UTF8_MAX];
+    uint32_t slot;
+
+    for (slot = 0; slot < dt->n; slot++){
+        struct fat_dir *dir = &dt->ents[slot];
+        uint32_t cluster = dir->starting_cluster;
+        if (dir->name[0] == 0x00)
+            break;
+        if (!dir_is_visible(dir))
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", prefix, dirtab_name(dt, slot, name));
+        if (add_job(ctx, dt, slot, path) != 0)
+            return -1;
+
+        if (!(dir->attr & DIR_ATTR_DIRECTORY) || depth >= CHECK_MAX_DEPTH ||
+                cluster < 2 || cluster >= ctx->vol->fat.n_entries ||
+                (ctx->seen[cluster / 64] >> (cluster % 64)) & 1)
+            continue;
+        ctx->seen[cluster / 64] |= (uint64_t) 1 << (cluster % 64);
+
+        if (ctx->n_dirs == ctx->cap_dirs){
+            int cap = ctx->cap_dirs ? ctx->cap_dirs * 2 : 16;
+            struct fat_dirtab **tmp = realloc(ctx->dirs, cap * sizeof(*tmp));
+            if (!tmp)
+                return -1;
+            ctx->dirs = tmp;
+            ctx->cap_dirs = cap;
+        }
+        struct fat_dirtab *sub = malloc(sizeof(*sub));
+        if (!sub)
+            return -1;
+        if (dirtab_load(ctx->vol, cluster, sub) != 0){
+            /* the chain itself is reported by the walk */
+            free(sub);
+            continue;
+        }
+        ctx->dirs[ctx->n_dirs++] = sub;
+        if (collect(ctx, sub, path, depth + 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* worker: walk one chain, claiming its clusters
+ * a cluster can only be claimed once, so the walks together visit every
+ * cluster at most once, loops and cross-links included
+ */
+static void check_chain(void *arg, int i){
+    struct check_ctx *ctx = arg;
+    struct check_job *job = &ctx->jobs[i];
+    struct fat_cache *fat = &ctx->vol->fat;
+    uint32_t cluster = job->dt->ents[job->slot].starting_cluster;
+    int32_t expected;
+
+    if (cluster == 0)
+        return;
+
+    for (;;){
+        if (cluster < 2 || cluster >= fat->n_entries || fat->entries[cluster] == FAT_BAD){
+            job->error = CHAIN_BAD_LINK;
+            break;
+        }
+        if (fat->entries[cluster] == 0x0000){
+            job->error = CHAIN_FREE_LINK;
+            break;
+        }
+        expected = 0;
+        if (!__atomic_compare_exchange_n(&ctx->owner[cluster], &expected, i + 1, 0,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            job->error = expected == i + 1 ? CHAIN_LOOP : CHAIN_CROSS;
+            job->other = expected - 1;
+            break;
+        }
+        job->n_clusters++;
+        job->tail = cluster;
+        if (FAT_IS_EOF(fat->entries[cluster]))
+            return;
+        cluster = fat->entries[cluster];
+    }
+    job->at = cluster;
+}
+
+/* compare every FAT copy with the cached first one
+ * whole chunks are compared with memcmp and only chunks that differ are
+ * looked at sector by sector; with repair the differing sectors are marked
+ * dirty, so the next flush copies the first FAT over them
+ * returns the number of sectors that differ
+ */
+static uint32_t compare_fats(struct fat_volume *vol, int repair){
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+    uint32_t fat_size = fat->n_sects * fat->bytes_p_sect;
+    uint32_t copy, off, chunk, s, bad = 0, bad_copy;
+    uint8_t *buffer = NULL;
+
+    for (copy = 1; copy < bpb->n_fat; copy++){
+        bad_copy = 0;
+        for (off = 0; off < fat_size; off += chunk){
+            uint32_t addr = bpb_faddress(bpb) + copy * fat_size + off;
+            uint8_t *mine = (uint8_t *) fat->entries + off;
+            uint8_t *theirs;
+
+            chunk = fat_size - off < CHECK_CHUNK ? fat_size - off : CHECK_CHUNK;
+            theirs = vol_ptr(vol, addr, chunk);
+            if (!theirs){
+                if (!buffer && !(buffer = malloc(CHECK_CHUNK)))
+                    return fat->n_sects;
+                if (vol_read(vol, addr, buffer, chunk) != 0){
+                    free(buffer);
+                    return fat->n_sects;
+                }
+                theirs = buffer;
+            }
+            if (memcmp(mine, theirs, chunk) == 0)
+                continue;
+
+            for (s = 0; s < chunk; s += fat->bytes_p_sect){
+                if (memcmp(mine + s, theirs + s, fat->bytes_p_sect) == 0)
+                    continue;
+                bad_copy++;
+                if (repair)
+                    fat->dirty[(off + s) / fat->bytes_p_sect] = 1;
+            }
+        }
+        if (bad_copy)
+            fprintf(vol->out, "FAT copy %u differs from the first one in %u sector(s)\n", copy + 1, bad_copy);
+        bad += bad_copy;
+    }
+    free(buffer);
+    return bad;
+}
+
+/* end a chain after its last good cluster; a chain with no good cluster is
+ * dropped from its entry (and a directory entry with it)
+ */
+static int truncate_chain(struct check_ctx *ctx, struct check_job *job){
+    struct fat_dir *dir = &job->dt->ents[job->slot];
+
+    if (job->tail){
+        fat_cache_set(&ctx->vol->fat, job->tail, FAT_EOF);
+        return 0;
+    }
+    dir->starting_cluster = 0;
+    dir->file_size = 0;
+    if (dirtab_write(ctx->vol, job->dt, job->slot) != 0)
+        return -1;
+    return job->is_dir ? dirtab_remove(ctx->vol, job->dt, job->slot) : 0;
+}
+
+/* compare the length of a file's chain with its size and fix one of them:
+ * extra clusters are freed, a short chain shrinks the size
+ * returns 1 if they didn't match
+ */
+static int check_size(struct check_ctx *ctx, struct check_job *job, int repair){
+    struct fat_volume *vol = ctx->vol;
+    struct fat_dir *dir = &job->dt->ents[job->slot];
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint32_t need = (uint32_t) (((uint64_t) dir->file_size + cluster_size - 1) / cluster_size);
+    uint32_t c, i;
+
+    if (job->is_dir || job->error != CHAIN_OK || need == job->n_clusters)
+        return 0;
+
+    fprintf(vol->out, "%s: %u byte(s) need %u cluster(s), the chain has %u\n", job->path,
+            dir->file_size, need, job->n_clusters);
+    if (!repair)
+        return 1;
+
+    if (need < job->n_clusters){
+        if (need == 0){
+            fat_cache_free_chain(&vol->fat, dir->starting_cluster);
+            dir->starting_cluster = 0;
+            dirtab_write(vol, job->dt, job->slot);
+        } else {
+            c = dir->starting_cluster;
+            for (i = 1; i < need; i++)
+                c = fat_cache_next(&vol->fat, c);
+            fat_cache_free_chain(&vol->fat, fat_cache_next(&vol->fat, c));
+            fat_cache_set(&vol->fat, c, FAT_EOF);
+        }
+    } else {
+        dir->file_size = job->n_clusters * cluster_size;
+        dirtab_write(vol, job->dt, job->slot);
+    }
+    return 1;
+}
+
+/* allocated clusters no chain claimed, freed with repair
+ * a lost chain starts at a lost cluster that no other lost cluster links to
+ * returns the number of lost clusters
+ */
+static uint32_t find_lost(struct check_ctx *ctx, int repair){
+    struct fat_cache *fat = &ctx->vol->fat;
+    uint64_t *linked = ctx->seen;
+    uint32_t c, lost = 0, chains = 0;
+
+    memset(linked, 0, (fat->n_entries + 63) / 64 * sizeof(uint64_t));
+    for (c = 2; c < fat->n_entries; c++){
+        uint16_t next = fat->entries[c];
+        if (next == 0x0000 || next == FAT_BAD || ctx->owner[c] != 0)
+            continue;
+        lost++;
+        if (next >= 2 && next < fat->n_entries)
+            linked[next / 64] |= (uint64_t) 1 << (next % 64);
+    }
+    if (lost == 0)
+        return 0;
+
+    for (c = 2; c < fat->n_entries; c++){
+        uint16_t next = fat->entries[c];
+        if (next == 0x0000 || next == FAT_BAD || ctx->owner[c] != 0)
+            continue;
+        if (!((linked[c / 64] >> (c % 64)) & 1))
+            chains++;
+        if (repair)
+            fat_cache_set(fat, c, 0x0000);
+    }
+    fprintf(ctx->vol->out, "%u lost cluster(s) in %u chain(s)%s\n", lost, chains, repair ? ", freed" : "");
+    return lost;
+}
+
+/* check the volume and, with repair, fix what was found */
+int check(struct fat_volume *vol, int threads, int repair){
+    struct check_ctx ctx;
+    struct fat_cache *fat = &vol->fat;
+    struct fat_dirtab *root;
+    int i, found = 0, fixed = 0, ret = 0;
+    double start = now_ms();
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.vol = vol;
+
+    /* repairs rewrite entries through the checker's own copies */
+    path_cache_clear(vol);
+    root = path_root(vol);
+    ctx.owner = calloc(fat->n_entries, sizeof(int32_t));
+    ctx.seen = calloc((fat->n_entries + 63) / 64, sizeof(uint64_t));
+    if (!root || !ctx.owner || !ctx.seen || collect(&ctx, root, "", 0) != 0){
+        fprintf(stderr, "Erro ao ler os diretórios da imagem\n");
+        ret = -1;
+    }
+
+    if (ret == 0){
+        /* before any repair touches the cached FAT */
+        if (compare_fats(vol, repair)){
+            found++;
+            fixed += repair;
+        }
+
+        pool_run(repair ? 1 : threads, ctx.n_jobs, check_chain, &ctx);
+
+        for (i = 0; i < ctx.n_jobs; i++){
+            struct check_job *job = &ctx.jobs[i];
+            if (job->error == CHAIN_OK)
+                continue;
+            found++;
+            if (job->error == CHAIN_CROSS)
+                fprintf(vol->out, "%s %s %s at cluster %u\n", job->path, chain_error[job->error],
+                        ctx.jobs[job->other].path, job->at);
+            else
+                fprintf(vol->out, "%s %s at cluster %u\n", job->path, chain_error[job->error], job->at);
+            if (repair && truncate_chain(&ctx, job) == 0){
+                fixed++;
+                /* what is left is a good chain: its size is checked below */
+                job->error = CHAIN_OK;
+            }
+        }
+        for (i = 0; i < ctx.n_jobs; i++){
+            if (check_size(&ctx, &ctx.jobs[i], repair)){
+                found++;
+                fixed += repair;
+            }
+        }
+        if (find_lost(&ctx, repair)){
+            found++;
+            fixed += repair;
+        }
+
+        if (repair && vol_sync(vol) != 0){
+            fprintf(stderr, "Erro ao gravar os reparos\n");
+            fixed = 0;
+        }
+
+        fprintf(vol->out, "%d entr%s checked, %u cluster(s) in use: %d problem(s)",
+                ctx.n_jobs, ctx.n_jobs == 1 ? "y" : "ies", fat->n_entries - 2 - fat->n_free, found);
+        if (repair)
+            fprintf(vol->out, ", %d repaired", fixed);
+        fprintf(vol->out, ", %.3f ms\n", now_ms() - start);
+    }
+
+    for (i = 0; i < ctx.n_jobs; i++)
+        free(ctx.jobs[i].path);
+    free(ctx.jobs);
+    free(ctx.owner);
+    free(ctx.seen);
+    for (i = 0; i < ctx.n_dirs; i++){
+        dirtab_destroy(ctx.dirs[i]);
+        free(ctx.dirs[i]);
+    }
+    free(ctx.dirs);
+    return ret < 0 ? -1 : found - fixed;
+}
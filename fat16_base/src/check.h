@@ -0,0 +1,24 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include "volume.h"
+
+/* Consistency checker.
+ * Every chain reachable from a directory entry is walked once, on a pool of
+ * threads, claiming its clusters in a shared ownership table; a cluster
+ * claimed twice is a loop (same chain) or a cross-link (another chain), and
+ * allocated clusters nobody claimed are lost. Chain lengths are checked
+ * against file sizes and the FAT copies are compared with the first one.
+ * The whole check is linear in the number of clusters.
+ */
+
+/* check the volume and, with repair, fix what was found
+ * repairs truncate bad chains, fix file sizes, free lost clusters and copy
+ * the first FAT over the others; they run on one thread, so the first
+ * claimant of a cross-linked cluster is always the same
+ * returns the number of problems left (found and not repaired), or -1 if
+ * the volume could not be checked
+ */
+int check(struct fat_volume *, int threads, int repair);
+
+#endif
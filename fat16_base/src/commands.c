@@ -1,324 +1,593 @@
-#include <unistd.h>
-#include <string.h>
-#include <stdlib.h>
-#include <sys/stat.h>
-#include "commands.h"
-#include "fat16.h"
-#include "support.h"
-
-off_t fsize(const char *filename){
-    struct stat st;
-    if (stat(filename, &st) == 0)
-        return st.st_size;
-    return -1;
-}
-
-struct fat_dir find(struct fat_dir *dirs, char *filename, struct fat_bpb *bpb){
-    struct fat_dir curdir;
-    int dirs_len = sizeof(struct fat_dir) * bpb->possible_rentries;
-    int i;
-
-    for (i=0; i < dirs_len; i++){
-        if (strcmp((char *) dirs[i].name, filename) == 0){
-            curdir = dirs[i];
-            break;
-        }
-    }
-    return curdir;
-}
-
-// Função para encontrar um cluster livre no FAT16
-uint32_t find_empty_cluster(FILE *fp, struct fat_bpb *bpb) {
-    uint32_t fat_offset = bpb->bytes_p_sect * bpb->reserved_sect;
-    uint32_t fat_entries = bpb->sect_per_fat * bpb->bytes_p_sect / 2;
-    uint16_t fat_val;
-
-    for (uint32_t i = 0; i < fat_entries; i++) {
-        fseek(fp, fat_offset + i * 2, SEEK_SET);
-        fread(&fat_val, 2, 1, fp);
-
-        if (fat_val == 0x0000) {
-            return bpb->reserved_sect + bpb->sect_per_fat + i;
-        }
-    }
-
-    return -1; // Nenhum cluster livre encontrado
-}
-
-struct fat_dir *ls(FILE *fp, struct fat_bpb *bpb){
-    int i;
-    struct fat_dir *dirs = malloc(sizeof (struct fat_dir) * bpb->possible_rentries);
-
-    for (i=0; i < bpb->possible_rentries; i++){
-        uint32_t offset = bpb_froot_addr(bpb) + i * 32;
-        read_bytes(fp, offset, &dirs[i], sizeof(dirs[i]));
-    }
-    return dirs;
-}
-
-int write_dir(FILE *fp, char *fname, struct fat_dir *dir){
-    char* name = padding(fname);
-    strcpy((char *) dir->name, (char *) name);
-    if (fwrite(dir, 1, sizeof(struct fat_dir), fp) <= 0)
-        return -1;
-    return 0;
-}
-
-int write_data(FILE *fp, char *fname, struct fat_dir *dir, struct fat_bpb *bpb){
-
-    FILE *localf = fopen(fname, "r");
-    int c;
-
-    while ((c = fgetc(localf)) != EOF){
-        if (fputc(c, fp) != c)
-            return -1;
-    }
-    return 0;
-}
-
-int wipe(FILE *fp, struct fat_dir *dir, struct fat_bpb *bpb){
-    int start_offset = bpb_froot_addr(bpb) + (bpb->bytes_p_sect * \
-            dir->starting_cluster);
-    int limit_offset = start_offset + dir->file_size;
-
-    while (start_offset <= limit_offset){
-        fseek(fp, ++start_offset, SEEK_SET);
-        if(fputc(0x0, fp) != 0x0)
-            return 01;
-    }
-    return 0;
-}
-
-void mv(FILE *fp, char *filename, struct fat_bpb *bpb) {
-    // Encontrar o diretório do arquivo a ser movido
-    struct fat_dir *dirs = ls(fp, bpb);
-    struct fat_dir file_to_move = find(dirs, filename, bpb);
-
-    // Verificar se o arquivo existe/
-    if (strncmp((char *) file_to_move.name, filename, 11) != 0) {
-        fprintf(stderr, "Arquivo não encontrado\n");
-        free(dirs);  // Liberar memória antes de retornar
-        return;
-    }
-
-    // Marcar o diretório do arquivo como excluído
-    if (wipe(fp, &file_to_move, bpb) != 0) {
-        fprintf(stderr, "Erro ao limpar os clusters do arquivo\n");
-        free(dirs);  // Liberar memória antes de retornar
-        return;
-    }
-
-    // Encontrar o índice do diretório para marcar como excluído
-    int dir_index = -1;
-    for (int i = 0; i < bpb->possible_rentries; i++) {
-        if (memcmp(&dirs[i], &file_to_move, sizeof(struct fat_dir)) == 0) {
-            dir_index = i;
-            break;
-        }
-    }
-
-    cp(fp, filename, filename, bpb);
-
-    if (dir_index != -1) {
-        uint32_t dir_offset = bpb_froot_addr(bpb) + dir_index * sizeof(struct fat_dir);
-        fseek(fp, dir_offset, SEEK_SET);
-        if (fputc(DIR_FREE_ENTRY, fp) == EOF) {
-            fprintf(stderr, "Erro ao marcar o diretório como excluído\n");
-        } else {
-            printf("Arquivo '%s' movido com sucesso\n", filename);
-        }
-    } else {
-        fprintf(stderr, "Erro ao encontrar o índice do diretório\n");
-    }
-
-    // Liberar memória alocada
-    free(dirs);
-}
-
-void update_fat(FILE *fp, uint32_t current_cluster, uint32_t next_cluster, struct fat_bpb *bpb) {
-    uint32_t fat_offset = bpb_faddress(bpb) + current_cluster * 2;  // FAT16 usa 2 bytes por entrada
-    fseek(fp, fat_offset, SEEK_SET);
-    fwrite(&next_cluster, 2, 1, fp);
-}
-
-
-void mv2(FILE *fp, const char *filename, struct fat_bpb *bpb) {
-    fprintf(stdout, "teste");
-    // Abrir o arquivo externo
-    FILE *src_file = fopen(filename, "rb");
-    if (src_file == NULL) {
-        fprintf(stderr, "Erro ao abrir o arquivo externo '%s'\n", filename);
-        return;
-    }
-
-    // Obter o tamanho do arquivo
-    off_t file_size = fsize(filename);
-    if (file_size == -1) {
-        fprintf(stderr, "Erro ao obter o tamanho do arquivo '%s'\n", filename);
-        fclose(src_file);
-        return;
-    }
-
-    // Encontrar o primeiro cluster livre
-    uint32_t first_cluster = find_empty_cluster(fp, bpb);
-    if (first_cluster == (uint32_t)-1) {
-        fprintf(stderr, "Erro ao encontrar um cluster livre\n");
-        fclose(src_file);
-        return;
-    }
-
-    // Preparar a entrada de diretório
-    struct fat_dir new_entry = {0};
-    char *name_padded = padding(filename);
-    strncpy((char *)new_entry.name, name_padded, 11);
-    new_entry.attr = 0;
-    new_entry.starting_cluster = first_cluster;
-    new_entry.file_size = file_size;
-
-    // Escrever os dados do arquivo nos clusters
-    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
-    uint32_t remaining_size = file_size;
-    uint32_t current_cluster = first_cluster;
-    uint8_t *buffer = malloc(cluster_size);
-
-    if (buffer == NULL) {
-        fprintf(stderr, "Erro ao alocar memória para buffer\n");
-        fclose(src_file);
-        return;
-    }
-
-    while (remaining_size > 0) {
-        // Ler os dados do arquivo externo
-        size_t bytes_to_write = remaining_size > cluster_size ? cluster_size : remaining_size;
-        fread(buffer, 1, bytes_to_write, src_file);
-
-        // Calcular o offset do cluster atual e escrever os dados
-        uint32_t cluster_offset = bpb_clust_addr(bpb, current_cluster);
-        fseek(fp, cluster_offset, SEEK_SET);
-        fwrite(buffer, 1, bytes_to_write, fp);
-
-        remaining_size -= bytes_to_write;
-        if (remaining_size > 0) {
-            // Encontrar o próximo cluster livre
-            uint32_t next_cluster = find_empty_cluster(fp, bpb);
-            if (next_cluster == (uint32_t)-1) {
-                fprintf(stderr, "Erro ao encontrar o próximo cluster livre\n");
-                free(buffer);
-                fclose(src_file);
-                return;
-            }
-
-            // Atualizar a tabela FAT para vincular os clusters
-            update_fat(fp, current_cluster, next_cluster, bpb);
-            current_cluster = next_cluster;
-        } else {
-            // Marcar o fim do arquivo na tabela FAT
-            update_fat(fp, current_cluster, 0xFFFF, bpb);  // 0xFFFF indica fim de arquivo no FAT16
-        }
-    }
-
-    free(buffer);
-    fclose(src_file);
-
-    // Escrever a nova entrada de diretório no diretório raiz
-    struct fat_dir *dirs = ls(fp, bpb);
-    for (int i = 0; i < bpb->possible_rentries; i++) {
-        if (dirs[i].name[0] == DIR_FREE_ENTRY || dirs[i].name[0] == 0x00) {
-            uint32_t dir_offset = bpb_froot_addr(bpb) + i * sizeof(struct fat_dir);
-            fseek(fp, dir_offset, SEEK_SET);
-            fwrite(&new_entry, sizeof(struct fat_dir), 1, fp);
-            printf("Arquivo '%s' adicionado com sucesso\n", filename);
-            free(dirs);
-
-            if (remove(filename) != 0) {
-                fprintf(stderr, "Erro ao deletar o arquivo de origem '%s'\n", filename);
-            } else {
-                printf("Arquivo de origem '%s' deletado com sucesso\n", filename);
-            }
-            return;
-        }
-        
-    }
-
-    fprintf(stderr, "Erro ao encontrar um slot livre no diretório raiz\n");
-    free(dirs);
-}
-
-void rm(FILE *fp, char *filename, struct fat_bpb *bpb){
-
-    struct fat_dir *dirs = ls(fp, bpb);
-    struct fat_dir dir_to_remove = find(dirs, filename, bpb);
-
-    if (strncmp((char *) dir_to_remove.name, filename, 11) == 0) {
-        if (wipe(fp, &dir_to_remove, bpb) != 0) {
-            fprintf(stderr, "Erro ao limpar os clusters do arquivo\n");
-            free(dirs);
-            return;
-        }
-
-        int dir_index = -1;
-        for (int i = 0; i < bpb->possible_rentries; i++) {
-            if (memcmp(&dirs[i], &dir_to_remove, sizeof(struct fat_dir)) == 0) {
-                dir_index = i;
-                break;
-            }
-        }
-
-        if (dir_index != -1) {
-
-            uint32_t dir_offset = bpb_froot_addr(bpb) + dir_index * sizeof(struct fat_dir);
-
-            fseek(fp, dir_offset, SEEK_SET);
-            fputc(0xE5, fp);
-        } else {
-            fprintf(stderr, "Erro ao encontrar o índice do diretório\n");
-        }
-    } else {
-        fprintf(stderr, "Arquivo não encontrado\n");
-    }
-
-    free(dirs);
-}
-
-
-void cp(FILE *fp, char *filename, char *file_dst_name, struct fat_bpb *bpb){
-
-    struct fat_dir *dir = ls(fp, bpb);
-    struct fat_dir file_dir = find(dir, filename, bpb);
-
-    FILE *dst_file = fopen(file_dst_name, "w");
-    if (!dst_file) {
-        perror("Erro ao abrir arquivo destino");
-        return;
-    }
-
-    uint32_t cluster = file_dir.starting_cluster;
-    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
-    uint32_t file_size = file_dir.file_size;
-    uint32_t bytes_to_read;
-
-    char *buffer = malloc(cluster_size);
-    if (!buffer) {
-        perror("Erro ao alocar buffer");
-        fclose(dst_file);
-        free(dir);
-        return;
-    }
-
-    while (file_size > 0) {
-        bytes_to_read = file_size > cluster_size ? cluster_size : file_size;
-        uint32_t offset = bpb_clust_addr(bpb, cluster);
-        fseek(fp, offset, SEEK_SET);
-        fread(buffer, 1, bytes_to_read, fp);
-        fwrite(buffer, 1, bytes_to_read, dst_file);
-
-        file_size -= bytes_to_read;
-        cluster = fat_next_cluster(fp, bpb, cluster);
-    }
-
-    free(buffer);
-    fclose(dst_file);
-    free(dir);
-
-}
-
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "commands.h"
+#include "fat16.h"
+#include "fatcache.h"
+#include "alloc.h"
+#include "volume.h"
+#include "dirindex.h"
+#include "dir.h"
+#include "path.h"
+#include "support.h"
+#include "output.h"
+#include "extract.h"
+#include "export.h"
+#include "hash.h"
+#include "import.h"
+#include "defrag.h"
+#include "check.h"
+#include "dirscan.h"
+
+#define PUT_BUFFER_SIZE (1 << 20) /* bytes read from the source at a time */
+
+off_t fsize(const char *filename){
+    struct stat st;
+    if (stat(filename, &st) == 0)
+        return st.st_size;
+    return -1;
+}
+
+/* slot of the entry at a path, with the directory holding it, or -1 */
+int find(struct fat_volume *vol, char *path, struct fat_dirtab **dir){
+    return path_lookup(vol, path, dir);
+}
+
+/* load the root directory once and index it by name
+ * the entries belong to the volume and stay cached until vol_close()
+ */
+struct fat_dir *ls(struct fat_volume *vol){
+    struct fat_dirtab *root = path_root(vol);
+    return root ? root->ents : NULL;
+}
+
+/* write a directory entry to free slots, keeping the cached copy indexed
+ * the 8.3 name (and the long name, if one is needed) comes from fname
+ */
+int write_dir(struct fat_volume *vol, struct fat_dirtab *dt, char *fname, struct fat_dir *dir){
+    return dirtab_add(vol, dt, fname, dir) < 0 ? -1 : 0;
+}
+
+/* the file at a path: its slot and directory, or -1 (after telling why) */
+static int find_file(struct fat_volume *vol, char *path, struct fat_dirtab **dir){
+    int slot = find(vol, path, dir);
+
+    if (slot < 0) {
+        fprintf(stderr, "Arquivo não encontrado\n");
+        return -1;
+    }
+    if ((*dir)->ents[slot].attr & DIR_ATTR_DIRECTORY) {
+        fprintf(stderr, "'%s' é um diretório\n", path);
+        return -1;
+    }
+    return slot;
+}
+
+/* clear the clusters of a file, one write (or hole) per extent
+ * the whole of every cluster is cleared, not just file_size bytes, so the
+ * cost follows the number of extents and not the size of the file
+ * returns -1 if the chain is broken or writing failed and 0 if success
+ */
+int wipe(struct fat_volume *vol, struct fat_dir *dir, int mode){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    struct fat_extent *ext;
+    int i, ret = 0;
+
+    if (mode == WIPE_NONE || dir->starting_cluster < 2)
+        return 0;
+
+    int n_ext = fat_chain_extents(&vol->fat, dir->starting_cluster, &ext);
+    if (n_ext < 0)
+        return -1;
+
+    for (i = 0; i < n_ext && ret == 0; i++)
+        ret = vol_zero(vol, bpb_clust_addr(bpb, ext[i].start), ext[i].len * cluster_size,
+                mode == WIPE_PUNCH);
+    free(ext);
+    return ret;
+}
+
+/* a new entry can be created at a path: its directory exists, the name is
+ * not taken and a slot is free; the directory is stored in the last argument
+ * returns -1 (after telling why) if it can't
+ */
+static int check_new_name(struct fat_volume *vol, const char *path, struct fat_dirtab **dir){
+    if (find(vol, (char *) path, dir) >= 0) {
+        fprintf(stderr, "Arquivo '%s' já existe na imagem\n", path);
+        return -1;
+    }
+    if (!*dir) {
+        fprintf(stderr, "Diretório de '%s' não encontrado\n", path);
+        return -1;
+    }
+    if ((*dir)->idx.n_free == 0) {
+        fprintf(stderr, "Erro ao encontrar um slot livre no diretório\n");
+        return -1;
+    }
+    return 0;
+}
+
+int mv(struct fat_volume *vol, char *filename) {
+    // Copiar primeiro: se a cópia falhar o arquivo continua na imagem
+    if (cp(vol, filename, (char *) path_basename(filename)) != 0)
+        return -1;
+
+    // Remover da imagem, liberando a cadeia de clusters
+    if (rm(vol, filename, WIPE_NONE) != 0) {
+        fprintf(stderr, "Erro ao marcar o diretório como excluído\n");
+        return -1;
+    }
+    printf("Arquivo '%s' movido com sucesso\n", filename);
+    return 0;
+}
+
+int mv2(struct fat_volume *vol, const char *filename) {
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+
+    // Abrir o arquivo externo
+    int src_fd = open(filename, O_RDONLY);
+    if (src_fd < 0) {
+        fprintf(stderr, "Erro ao abrir o arquivo externo '%s'\n", filename);
+        return -1;
+    }
+
+    // Obter o tamanho do arquivo
+    off_t file_size = fsize(filename);
+    if (file_size == -1) {
+        fprintf(stderr, "Erro ao obter o tamanho do arquivo '%s'\n", filename);
+        close(src_fd);
+        return -1;
+    }
+
+    // O nome não pode existir e precisa haver um slot livre no diretório raiz
+    struct fat_dirtab *dt;
+    if (check_new_name(vol, path_basename(filename), &dt) != 0) {
+        close(src_fd);
+        return -1;
+    }
+
+    // Reservar de uma vez toda a cadeia, em blocos contíguos sempre que possível
+    // (um arquivo vazio não tem clusters, como em put)
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint32_t n_clusters = (file_size + cluster_size - 1) / cluster_size;
+    uint32_t first_cluster = n_clusters > 0 ? fat_alloc_chain(fat, n_clusters) : 0;
+    if (n_clusters > 0 && first_cluster == 0) {
+        fprintf(stderr, "Erro ao encontrar clusters livres\n");
+        close(src_fd);
+        return -1;
+    }
+
+    // Preparar a entrada de diretório (o nome é gravado por write_dir)
+    struct fat_dir new_entry = {0};
+    new_entry.attr = 0;
+    new_entry.starting_cluster = first_cluster;
+    new_entry.file_size = file_size;
+
+    // Escrever os dados do arquivo nos clusters, um extent por vez
+    struct fat_extent *ext;
+    int n_ext = fat_chain_extents(fat, first_cluster, &ext);
+    if (n_ext < 0) {
+        perror("Erro ao alocar extents");
+        fat_cache_free_chain(fat, first_cluster);
+        close(src_fd);
+        return -1;
+    }
+    uint32_t left = vol_copy_in(vol, ext, n_ext, file_size, src_fd);
+    free(ext);
+    close(src_fd);
+    if (left > 0) {
+        fprintf(stderr, "Erro ao copiar '%s': faltam %u bytes\n", filename, left);
+        fat_cache_free_chain(fat, first_cluster);
+        return -1;
+    }
+
+    // Escrever a nova entrada de diretório no diretório raiz
+    if (write_dir(vol, dt, (char *) filename, &new_entry) != 0) {
+        fprintf(stderr, "Erro ao gravar a entrada de diretório\n");
+        fat_cache_free_chain(fat, first_cluster);
+        return -1;
+    }
+    printf("Arquivo '%s' adicionado com sucesso\n", filename);
+
+    if (remove(filename) != 0) {
+        fprintf(stderr, "Erro ao deletar o arquivo de origem '%s'\n", filename);
+    } else {
+        printf("Arquivo de origem '%s' deletado com sucesso\n", filename);
+    }
+    return 0;
+}
+
+int put(struct fat_volume *vol, const char *src, const char *filename) {
+    // "-" lê da entrada padrão, que pode ser um pipe
+    int src_fd = strcmp(src, "-") == 0 ? STDIN_FILENO : open(src, O_RDONLY);
+    if (src_fd < 0) {
+        fprintf(stderr, "Erro ao abrir o arquivo externo '%s'\n", src);
+        return -1;
+    }
+
+    int ret = put_fd(vol, src_fd, filename);
+    if (src_fd != STDIN_FILENO)
+        close(src_fd);
+    return ret;
+}
+
+/* stream a descriptor into clusters reserved as the data arrives
+ * returns -1 on error, with first set to whatever was allocated so far
+ */
+static int put_stream(struct fat_volume *vol, int src_fd, uint32_t *first, uint64_t *size) {
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+
+    // Buffer de tamanho fixo, múltiplo do cluster: a memória não depende da entrada
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint32_t buffer_size = PUT_BUFFER_SIZE / cluster_size * cluster_size;
+    if (buffer_size == 0)
+        buffer_size = cluster_size;
+    uint8_t *buffer = malloc(buffer_size);
+    *first = 0;
+    *size = 0;
+    if (buffer == NULL) {
+        fprintf(stderr, "Erro ao alocar memória para buffer\n");
+        return -1;
+    }
+
+    uint32_t first_cluster = 0, tail = 0;
+    uint64_t file_size = 0;
+    uint64_t start = stats_clock(vol->stats);
+    ssize_t got;
+    int ret = 0;
+
+    while ((got = read_full(src_fd, buffer, buffer_size)) > 0) {
+        if (file_size + got > UINT32_MAX) {
+            fprintf(stderr, "Arquivo maior que 4 GiB\n");
+            ret = -1;
+            break;
+        }
+
+        // Os clusters são reservados à medida que os dados chegam
+        uint32_t need = (got + cluster_size - 1) / cluster_size;
+        uint32_t done = 0;
+        while (need > 0) {
+            uint32_t len;
+            uint32_t start = fat_alloc_run(fat, need, &len);
+            if (len == 0) {
+                fprintf(stderr, "Erro ao encontrar clusters livres\n");
+                ret = -1;
+                break;
+            }
+            if (tail)
+                fat_cache_set(fat, tail, start);
+            else
+                first_cluster = start;
+            tail = start + len - 1;
+
+            // Um run contíguo é gravado com uma única escrita
+            uint32_t bytes = len * cluster_size;
+            if (bytes > got - done)
+                bytes = got - done;
+            if (vol_write(vol, bpb_clust_addr(bpb, start), buffer + done, bytes) != 0) {
+                ret = -1;
+                break;
+            }
+            done += bytes;
+            need -= len;
+        }
+        if (ret != 0)
+            break;
+        file_size += got;
+    }
+    if (got < 0) {
+        perror("Erro ao ler o arquivo externo");
+        ret = -1;
+    }
+    stats_phase(vol->stats, STATS_DATA_COPY, start);
+
+    free(buffer);
+    *first = first_cluster;
+    *size = file_size;
+    return ret;
+}
+
+/* copy size bytes of a regular file into a chain reserved up front, so the
+ * async engine can keep reads in flight over all of it
+ * returns -1 on error, with first set to whatever was allocated
+ */
+static int put_async(struct fat_volume *vol, int src_fd, uint64_t size, uint32_t *first) {
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+    struct fat_extent *ext;
+
+    *first = 0;
+    if (size > UINT32_MAX) {
+        fprintf(stderr, "Arquivo maior que 4 GiB\n");
+        return -1;
+    }
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    *first = fat_alloc_chain(fat, (size + cluster_size - 1) / cluster_size);
+    if (*first == 0) {
+        fprintf(stderr, "Erro ao encontrar clusters livres\n");
+        return -1;
+    }
+
+    int n_ext = fat_chain_extents(fat, *first, &ext);
+    if (n_ext < 0) {
+        perror("Erro ao alocar extents");
+        return -1;
+    }
+    uint32_t left = vol_copy_in(vol, ext, n_ext, size, src_fd);
+    free(ext);
+    if (left > 0) {
+        fprintf(stderr, "Erro ao copiar o arquivo externo: faltam %u bytes\n", left);
+        return -1;
+    }
+    return 0;
+}
+
+int put_fd(struct fat_volume *vol, int src_fd, const char *filename) {
+    struct fat_cache *fat = &vol->fat;
+
+    struct fat_dirtab *dt;
+    if (check_new_name(vol, filename, &dt) != 0)
+        return -1;
+
+    // Com o motor assíncrono, o tamanho de um arquivo regular é conhecido de antemão
+    uint32_t first_cluster;
+    uint64_t file_size;
+    struct stat st;
+    off_t pos;
+    int ret;
+
+    if (vol->aio && fstat(src_fd, &st) == 0 && S_ISREG(st.st_mode) &&
+            (pos = lseek(src_fd, 0, SEEK_CUR)) >= 0 && st.st_size > pos) {
+        file_size = st.st_size - pos;
+        ret = put_async(vol, src_fd, file_size, &first_cluster);
+    } else {
+        ret = put_stream(vol, src_fd, &first_cluster, &file_size);
+    }
+
+    // A entrada de diretório só é gravada quando o tamanho final é conhecido
+    struct fat_dir new_entry = {0};
+    new_entry.starting_cluster = first_cluster;
+    new_entry.file_size = file_size;
+
+    if (ret == 0) {
+        if (write_dir(vol, dt, (char *) filename, &new_entry) != 0) {
+            fprintf(stderr, "Erro ao gravar a entrada de diretório\n");
+            ret = -1;
+        }
+    }
+    if (ret != 0) {
+        fat_cache_free_chain(fat, first_cluster);
+        return -1;
+    }
+
+    fprintf(vol->out, "Arquivo '%s' adicionado com sucesso (%llu bytes)\n", filename,
+            (unsigned long long) file_size);
+    return 0;
+}
+
+int rm(struct fat_volume *vol, char *filename, int mode){
+
+    struct fat_dirtab *dt;
+    int slot = find_file(vol, filename, &dt);
+
+    if (slot >= 0) {
+        struct fat_dir *dir = &dt->ents[slot];
+
+        if (wipe(vol, dir, mode) != 0) {
+            fprintf(stderr, "Erro ao limpar os clusters do arquivo\n");
+            return -1;
+        }
+
+        // A cadeia é liberada no cache; todas as cópias da FAT são gravadas no sync
+        fat_cache_free_chain(&vol->fat, dir->starting_cluster);
+        return dirtab_remove(vol, dt, slot);
+    } else {
+        return -1;
+    }
+}
+
+
+int cp(struct fat_volume *vol, char *filename, char *file_dst_name){
+    struct fat_dirtab *dt;
+    int slot = find_file(vol, filename, &dt);
+    if (slot < 0)
+        return -1;
+    struct fat_dir file_dir = dt->ents[slot];
+
+    int dst_fd = open(file_dst_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (dst_fd < 0) {
+        perror("Erro ao abrir arquivo destino");
+        return -1;
+    }
+
+    // Resolver a cadeia em extents (sequências de clusters consecutivos)
+    struct fat_extent *ext;
+    int n_ext = fat_chain_extents(&vol->fat, file_dir.starting_cluster, &ext);
+    if (n_ext < 0) {
+        perror("Erro ao alocar extents");
+        close(dst_fd);
+        return -1;
+    }
+
+    // Cada extent é copiado com uma única operação
+    uint32_t file_size = vol_copy_extents(vol, ext, n_ext, file_dir.file_size, dst_fd);
+
+    if (file_size > 0)
+        fprintf(stderr, "Arquivo '%s' incompleto: faltam %u bytes\n", filename, file_size);
+    fprintf(stderr, "%s: %d extent(s)\n", filename, n_ext);
+
+    free(ext);
+    close(dst_fd);
+    return file_size > 0 ? -1 : 0;
+}
+
+/* put or put -r, leaving out what the volume already holds
+ * the files of the volume are all hashed first; a local file is then only
+ * read in full when its size and first cluster match one of them
+ */
+static int put_dedup(struct fat_volume *vol, const char *src, const char *dest, int tree){
+    struct hash_index idx;
+    const struct hash_file *same;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), ret;
+
+    // Um arquivo ilegível fica fora do índice, mas não impede a importação
+    if (hash_volume(vol, threads > 0 ? threads : 1, &idx) != 0)
+        fprintf(stderr, "Arquivos ilegíveis da imagem não serão considerados duplicatas\n");
+    if (tree){
+        ret = put_tree(vol, src, dest, &idx);
+    } else {
+        int src_fd = open(src, O_RDONLY);
+        if (src_fd < 0) {
+            fprintf(stderr, "Erro ao abrir o arquivo externo '%s'\n", src);
+            ret = -1;
+        } else if ((same = hash_index_find(vol, &idx, src_fd))) {
+            fprintf(vol->out, "Arquivo '%s' já está na imagem como '%s'\n", src, same->path);
+            ret = 0;
+        } else {
+            ret = put_fd(vol, src_fd, dest);
+        }
+        if (src_fd >= 0)
+            close(src_fd);
+    }
+    hash_index_free(&idx);
+    return ret;
+}
+
+/* dir_walk callback: one full path per line, directories end with '/'
+ * ctx is the stream to print to
+ */
+static int print_entry(void *ctx, const char *path, struct fat_dir *dir){
+    fprintf(ctx, "%s%s\n", path, (dir->attr & DIR_ATTR_DIRECTORY) ? "/" : "");
+    return 0;
+}
+
+/* list a directory tree to a stream, one directory cluster at a time */
+int ls_recursive(struct fat_volume *vol, uint32_t cluster, const char *path, FILE *out){
+    char prefix[1024];
+    size_t len;
+
+    /* entries are printed as prefix/NAME, so drop trailing slashes */
+    snprintf(prefix, sizeof(prefix), "%s", path);
+    len = strlen(prefix);
+    while (len > 0 && prefix[len - 1] == '/')
+        prefix[--len] = '\0';
+
+    return dir_walk(vol, cluster, prefix, 1, print_entry, out) < 0 ? -1 : 0;
+}
+
+/* run one command against a mounted volume
+ * argv[0] is the command name, followed by its arguments (without the image)
+ * returns -1 if the command failed or is unknown and 0 if success
+ */
+int run_command(struct fat_volume *vol, int argc, char **argv){
+    char *command = argv[0];
+
+    if (strcmp(command, "ls") == 0){
+        int recursive = argc >= 2 && strcmp(argv[1], "-R") == 0;
+        char *path = argc >= 2 + recursive ? argv[1 + recursive] : "/";
+
+        /* the root is scanned where it lies, without loading or indexing it */
+        if (!recursive && path[strspn(path, "/")] == '\0')
+            return dir_scan_root(vol, show_file, vol->out) < 0 ? -1 : 0;
+
+        struct fat_dirtab *dt = path_dir(vol, path);
+        if (!dt) {
+            fprintf(stderr, "Diretório '%s' não encontrado\n", path);
+            return -1;
+        }
+        if (recursive)
+            return ls_recursive(vol, dt->cluster, path, vol->out);
+        show_files(vol->out, dt->ents, dt->n);
+        return 0;
+    }
+
+    if (strcmp(command, "cp") == 0 && argc >= 3){
+        return cp(vol, argv[1], argv[2]);
+    }
+
+    if (strcmp(command, "mv") == 0 && argc >= 2){ //move o arquivo do FAT
+        return mv(vol, argv[1]);
+    }
+    if (strcmp(command, "rm") == 0 && argc >= 2){
+        int mode = WIPE_NONE;
+        if (argc >= 3 && strcmp(argv[1], "-z") == 0)
+            mode = WIPE_ZERO;
+        else if (argc >= 3 && strcmp(argv[1], "-p") == 0)
+            mode = WIPE_PUNCH;
+        return rm(vol, argv[argc - 1], mode);
+    }
+    if (strcmp(command, "mv2") == 0 && argc >= 2){//move o arquivo local para dentro do FAT
+        return mv2(vol, argv[1]);
+    }
+
+    if (strcmp(command, "put") == 0){
+        int tree = 0, dedup = 0, i;
+        for (i = 1; i < argc && (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-d") == 0); i++){
+            if (argv[i][1] == 'r')
+                tree = 1;
+            else
+                dedup = 1;
+        }
+        if (argc - i >= 2 && dedup)
+            return put_dedup(vol, argv[i], argv[i + 1], tree);
+        if (argc - i >= 2)
+            return tree ? put_tree(vol, argv[i], argv[i + 1], NULL) : put(vol, argv[i], argv[i + 1]);
+    }
+
+    if (strcmp(command, "hash") == 0){
+        int threads = sysconf(_SC_NPROCESSORS_ONLN), clusters = 0, i;
+        for (i = 1; i < argc; i++){
+            if (strcmp(argv[i], "-c") == 0)
+                clusters = 1;
+            else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+                threads = atoi(argv[++i]);
+        }
+        return hash_print(vol, threads > 0 ? threads : 1, clusters);
+    }
+
+    if (strcmp(command, "extract-all") == 0 && argc >= 2){
+        int threads = 1;
+        if (argc >= 4 && strcmp(argv[1], "-j") == 0){
+            threads = atoi(argv[2]);
+            argv += 2;
+        }
+        return extract_all(vol, argv[1], threads > 0 ? threads : 1, NULL) == 0 ? 0 : -1;
+    }
+
+    if (strcmp(command, "export") == 0){
+        int format = EXPORT_TAR;
+        if (argc >= 3 && strcmp(argv[1], "-f") == 0){
+            if (strcmp(argv[2], "cpio") == 0)
+                format = EXPORT_CPIO;
+            else if (strcmp(argv[2], "tar") != 0){
+                fprintf(stderr, "Formato desconhecido: %s\n", argv[2]);
+                return -1;
+            }
+        }
+        return export_volume(vol, format, STDOUT_FILENO);
+    }
+
+    if (strcmp(command, "defrag") == 0){
+        return defrag(vol);
+    }
+
+    if (strcmp(command, "check") == 0){
+        int threads = sysconf(_SC_NPROCESSORS_ONLN), repair = 0, i;
+        for (i = 1; i < argc; i++){
+            if (strcmp(argv[i], "--repair") == 0)
+                repair = 1;
+            else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+                threads = atoi(argv[++i]);
+        }
+        return check(vol, threads > 0 ? threads : 1, repair) == 0 ? 0 : -1;
+    }
+
+    fprintf(stderr, "Comando inválido: %s\n", command);
+    return -1;
+}
@@ -1,27 +1,44 @@
-#ifndef COMMANDS_H
-#define COMMANDS_H
-
-#include "fat16.h"
-
-/* list files in fat_bpb */
-struct fat_dir *ls(FILE *, struct fat_bpb *);
-
-/* write content to directory */
-int write_dir (FILE *, char *, struct fat_dir *);
-
-/* write file content to fat directory */
-int write_data(FILE *, char *, struct fat_dir *, struct fat_bpb *);
-
-/* move file from source to destination */
-void mv(FILE *, char *, struct fat_bpb *);
-
-/* delete the file from the fat directory */
-void rm(FILE *, char *, struct fat_bpb *);
-
-/* copy the file to the fat directory */
-void cp(FILE *fp, char *filename, char *file_dst_name, struct fat_bpb *bpb);
-
-/* helper function: find specific filename in fat_dir */
-struct fat_dir find(struct fat_dir *, char *, struct fat_bpb *);
-
-#endif
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "fat16.h"
+#include "volume.h"
+
+#define WIPE_NONE 0 /* rm only frees the clusters */
+#define WIPE_ZERO 1 /* rm overwrites the clusters with zeros */
+#define WIPE_PUNCH 2 /* rm punches a hole over the clusters (zeros if it can't) */
+
+/* list files in fat_bpb (the entries are cached in the volume) */
+struct fat_dir *ls(struct fat_volume *);
+
+/* list a directory tree to a stream, one directory cluster at a time */
+int ls_recursive(struct fat_volume *, uint32_t, const char *, FILE *);
+
+/* add a directory entry, with a long name if it needs one, to a loaded directory */
+int write_dir (struct fat_volume *, struct fat_dirtab *, char *, struct fat_dir *);
+
+/* move file from source to destination */
+int mv(struct fat_volume *, char *);
+
+/* delete the file from the fat directory and free its clusters */
+int rm(struct fat_volume *, char *, int);
+
+/* move a local file into the fat directory */
+int mv2(struct fat_volume *, const char *);
+
+/* stream a local file, or stdin when the source is "-", into a new file */
+int put(struct fat_volume *, const char *, const char *);
+
+/* stream everything left to read on a descriptor into a new file */
+int put_fd(struct fat_volume *, int, const char *);
+
+/* copy the file to the fat directory */
+int cp(struct fat_volume *, char *filename, char *file_dst_name);
+
+/* run one command (name followed by its arguments) against a volume */
+int run_command(struct fat_volume *, int, char **);
+
+/* helper function: slot of the entry at a path, or -1, and its directory */
+int find(struct fat_volume *, char *, struct fat_dirtab **);
+
+#endif
@@ -0,0 +1,448 @@
+#include "defrag.h"
+#include "alloc.h"
+#include "support.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFRAG_CHUNK (4 << 20) /* largest single read or write of file data */
+#define DEFRAG_BATCH (64 << 20) /* bytes moved between two commits */
+#define DEFRAG_MAX_DEPTH 64
+
+/* a file that may be moved: where its entry lives and where its data is */
+struct defrag_file {
+    struct fat_dirtab *dt;
+    uint32_t slot;
+    uint32_t first; /* current first cluster */
+    uint32_t moved_to; /* first cluster of the copy, 0 if not moved yet */
+};
+
+struct defrag_ctx {
+    struct fat_volume *vol;
+    struct fat_dirtab **dirs; /* subdirectories loaded for the run */
+    int n_dirs, cap_dirs;
+    struct defrag_file *files;
+    int n_files, cap_files;
+    int32_t *owner; /* per cluster: file index + 1, -1 for directories */
+    int cross_linked;
+    int *batch; /* files copied but not committed yet */
+    int n_batch;
+    uint64_t batch_bytes;
+    uint8_t *buffer;
+    uint64_t moved;
+    int n_moves;
+};
+
+struct defrag_stats {
+    uint32_t files, fragmented, extents;
+    uint32_t free_runs, largest_free;
+};
+
+/* set the owner of every cluster of a chain; with check, clusters that
+ * already had one are counted as cross-linked
+ */
+static void mark_chain(struct defrag_ctx *ctx, uint32_t cluster, int32_t owner, int check){
+    struct fat_extent *ext;
+    int i, n_ext = fat_chain_extents(&ctx->vol->fat, cluster, &ext);
+    uint32_t c;
+
+    for (i = 0; i < n_ext; i++){
+        for (c = ext[i].start; c < ext[i].start + ext[i].len; c++){
+            if (check && ctx->owner[c] != 0)
+                ctx->cross_linked++;
+            ctx->owner[c] = owner;
+        }
+    }
+    if (n_ext > 0)
+        free(ext);
+}
+
+/* gather the files of a directory and of every directory below it
+ * the subdirectories stay loaded, so their entries can be rewritten
+ */
+static int collect(struct defrag_ctx *ctx, struct fat_dirtab *dt, int depth){
+    uint32_t slot;
+
+    for (slot = 0; slot < dt->n; slot++){
+        struct fat_dir *dir = &dt->ents[slot];
+        if (dir->name[0] == 0x00)
+            break;
+        if (!dir_is_visible(dir) || dir->starting_cluster < 2 ||
+                dir->starting_cluster >= ctx->vol->fat.n_entries)
+            continue;
+        /* files get their real index once they are sorted */
+        mark_chain(ctx, dir->starting_cluster, (dir->attr & DIR_ATTR_DIRECTORY) ? -1 : 1, 1);
+
+        if (dir->attr & DIR_ATTR_DIRECTORY){
+            if (depth >= DEFRAG_MAX_DEPTH)
+                continue;
+            if (ctx->n_dirs == ctx->cap_dirs){
+                int cap = ctx->cap_dirs ? ctx->cap_dirs * 2 : 16;
+                struct fat_dirtab **tmp = realloc(ctx->dirs, cap * sizeof(*tmp));
+                if (!tmp)
+                    return -1;
+                ctx->dirs = tmp;
+                ctx->cap_dirs = cap;
+            }
+            struct fat_dirtab *sub = malloc(sizeof(*sub));
+            if (!sub || dirtab_load(ctx->vol, dir->starting_cluster, sub) != 0){
+                free(sub);
+                return -1;
+            }
+            ctx->dirs[ctx->n_dirs++] = sub;
+            if (collect(ctx, sub, depth + 1) != 0)
+                return -1;
+            continue;
+        }
+
+        if (ctx->n_files == ctx->cap_files){
+            int cap = ctx->cap_files ? ctx->cap_files * 2 : 256;
+            struct defrag_file *tmp = realloc(ctx->files, cap * sizeof(*tmp));
+            if (!tmp)
+                return -1;
+            ctx->files = tmp;
+            ctx->cap_files = cap;
+        }
+        struct defrag_file *f = &ctx->files[ctx->n_files++];
+        f->dt = dt;
+        f->slot = slot;
+        f->first = dir->starting_cluster;
+        f->moved_to = 0;
+    }
+    return 0;
+}
+
+/* fragmentation of the files and of the free space */
+static void measure(struct defrag_ctx *ctx, struct defrag_stats *st){
+    struct fat_cache *fat = &ctx->vol->fat;
+    struct fat_extent *ext;
+    uint32_t c, run = 0;
+    int i, n_ext;
+
+    memset(st, 0, sizeof(*st));
+    for (i = 0; i < ctx->n_files; i++){
+        n_ext = fat_chain_extents(fat, ctx->files[i].first, &ext);
+        if (n_ext <= 0)
+            continue;
+        st->files++;
+        st->extents += n_ext;
+        if (n_ext > 1)
+            st->fragmented++;
+        free(ext);
+    }
+
+    for (c = 2; c <= fat->n_entries; c++){
+        if (c < fat->n_entries && fat->entries[c] == 0x0000){
+            run++;
+            continue;
+        }
+        if (run > 0){
+            st->free_runs++;
+            if (run > st->largest_free)
+                st->largest_free = run;
+        }
+        run = 0;
+    }
+}
+
+static void print_stats(const char *when, struct defrag_stats *st){
+    printf("%s: %u file(s), %u fragmented, %u extent(s); free space in %u run(s), largest %u cluster(s)\n",
+            when, st->files, st->fragmented, st->extents, st->free_runs, st->largest_free);
+}
+
+/* copy the clusters of one chain, in order, into those of another
+ * contiguous clusters are moved with one read and one write of up to
+ * DEFRAG_CHUNK bytes
+ */
+static int copy_chain(struct fat_volume *vol, uint32_t from, uint32_t to, uint8_t *buffer){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    struct fat_extent *src, *dst;
+    int n_src = fat_chain_extents(&vol->fat, from, &src);
+    int n_dst = fat_chain_extents(&vol->fat, to, &dst);
+    int i = 0, j = 0, ret = 0;
+    uint32_t src_done = 0, dst_done = 0; /* clusters used of src[i] and dst[j] */
+
+    if (n_src < 0 || n_dst < 0){
+        if (n_src >= 0)
+            free(src);
+        if (n_dst >= 0)
+            free(dst);
+        return -1;
+    }
+
+    while (ret == 0 && i < n_src && j < n_dst){
+        uint32_t n = src[i].len - src_done;
+        if (n > dst[j].len - dst_done)
+            n = dst[j].len - dst_done;
+        if (n > DEFRAG_CHUNK / cluster_size)
+            n = DEFRAG_CHUNK / cluster_size;
+
+        if (vol_read(vol, bpb_clust_addr(bpb, src[i].start + src_done), buffer, n * cluster_size) != 0 ||
+                vol_write(vol, bpb_clust_addr(bpb, dst[j].start + dst_done), buffer, n * cluster_size) != 0)
+            ret = -1;
+
+        src_done += n;
+        dst_done += n;
+        if (src_done == src[i].len){
+            i++;
+            src_done = 0;
+        }
+        if (dst_done == dst[j].len){
+            j++;
+            dst_done = 0;
+        }
+    }
+    free(src);
+    free(dst);
+    return ret;
+}
+
+/* number of clusters in the chain of a file */
+static uint32_t chain_length(struct fat_cache *fat, uint32_t first, int *n_ext){
+    struct fat_extent *ext;
+    uint32_t len = 0;
+    int j;
+
+    *n_ext = fat_chain_extents(fat, first, &ext);
+    if (*n_ext <= 0)
+        return 0;
+    for (j = 0; j < *n_ext; j++)
+        len += ext[j].len;
+    free(ext);
+    return len;
+}
+
+/* make the copies of the pending files live
+ * the copies and their chains are synced first, then the entries are
+ * pointed at them, and only then are the old chains freed; each FAT write
+ * (to every copy) only links or frees chains no entry points to, so a crash
+ * at any step leaves every file readable, at worst with lost clusters
+ */
+static int commit(struct defrag_ctx *ctx){
+    struct fat_volume *vol = ctx->vol;
+    int i, n = ctx->n_batch;
+
+    ctx->n_batch = 0;
+    ctx->batch_bytes = 0;
+    if (n == 0)
+        return 0;
+    if (vol_sync(vol) != 0)
+        return -1;
+
+    for (i = 0; i < n; i++){
+        struct defrag_file *f = &ctx->files[ctx->batch[i]];
+        f->dt->ents[f->slot].starting_cluster = f->moved_to;
+        if (dirtab_write(vol, f->dt, f->slot) != 0)
+            return -1;
+    }
+    if (vol_sync(vol) != 0)
+        return -1;
+
+    for (i = 0; i < n; i++){
+        struct defrag_file *f = &ctx->files[ctx->batch[i]];
+        mark_chain(ctx, f->first, 0, 0);
+        fat_cache_free_chain(&vol->fat, f->first);
+        mark_chain(ctx, f->moved_to, ctx->batch[i] + 1, 0);
+        f->first = f->moved_to;
+        f->moved_to = 0;
+    }
+    return vol_sync(vol);
+}
+
+/* copy a file into a chain already allocated for it
+ * the move is pending until the next commit()
+ * returns -1 (after freeing the new chain) if copying failed
+ */
+static int move_file(struct defrag_ctx *ctx, int i, uint32_t target){
+    struct fat_volume *vol = ctx->vol;
+    struct defrag_file *f = &ctx->files[i];
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    int n_ext;
+    uint32_t len = chain_length(&vol->fat, f->first, &n_ext);
+
+    if (copy_chain(vol, f->first, target, ctx->buffer) != 0){
+        fprintf(stderr, "Erro ao mover os clusters do arquivo\n");
+        fat_cache_free_chain(&vol->fat, target);
+        return -1;
+    }
+
+    f->moved_to = target;
+    ctx->batch[ctx->n_batch++] = i;
+    ctx->batch_bytes += (uint64_t) len * cluster_size;
+    ctx->moved += (uint64_t) len * cluster_size;
+    ctx->n_moves++;
+    return 0;
+}
+
+/* move the files with clusters in [lo, hi) anywhere outside of it
+ * the free clusters of the window are held while the new chains are taken,
+ * so the files can go to any free space, even in fragments; they are put
+ * in their final place when the sweep gets to them
+ * returns 1 if there is not enough free space and -1 on errors
+ */
+static int evict(struct defrag_ctx *ctx, uint32_t lo, uint32_t hi){
+    struct fat_cache *fat = &ctx->vol->fat;
+    uint32_t held = 0, tail = 0; /* the free clusters of the window, as one chain */
+    uint32_t c, run, target;
+    int ret = 0, n_ext;
+
+    for (c = lo; c < hi; c += run){
+        run = 1;
+        if (fat->entries[c] != 0x0000)
+            continue;
+        while (c + run < hi && fat->entries[c + run] == 0x0000)
+            run++;
+        if (fat_alloc_in(fat, run, c, c + run) != c)
+            continue;
+        if (tail)
+            fat_cache_set(fat, tail, c);
+        else
+            held = c;
+        tail = c + run - 1;
+    }
+
+    for (c = lo; c < hi && ret == 0; c++){
+        int owner = ctx->owner[c];
+        if (owner <= 0 || ctx->files[owner - 1].moved_to)
+            continue;
+        target = fat_alloc_chain(fat, chain_length(fat, ctx->files[owner - 1].first, &n_ext));
+        if (target == 0)
+            ret = 1;
+        else
+            ret = move_file(ctx, owner - 1, target);
+    }
+
+    fat_cache_free_chain(fat, held);
+    return ret;
+}
+
+static int by_first_cluster(const void *a, const void *b){
+    const struct defrag_file *fa = a, *fb = b;
+    return (fa->first > fb->first) - (fa->first < fb->first);
+}
+
+/* lay the files out one after the other from the start of the data region,
+ * in their current order
+ * the files in the way of the next one are first moved out, past it if
+ * possible; directory clusters and clusters no entry owns are stepped over
+ * returns -1 if a move failed; running out of room just ends the sweep
+ */
+static int sweep(struct defrag_ctx *ctx){
+    struct fat_cache *fat = &ctx->vol->fat;
+    uint32_t p = 2, c, len, target;
+    int i, n_ext, r;
+
+    for (i = 0; i < ctx->n_files; i++){
+        struct defrag_file *f = &ctx->files[i];
+
+        len = chain_length(fat, f->first, &n_ext);
+        if (len == 0)
+            continue;
+
+        for (;;){
+            int busy = 0, fixed = 0;
+
+            if (p + len > fat->n_entries)
+                return commit(ctx);
+            if (n_ext == 1 && f->first == p)
+                break;
+
+            for (c = p; c < p + len; c++){
+                if (fat->entries[c] == 0x0000)
+                    continue;
+                busy = 1;
+                if (ctx->owner[c] <= 0)
+                    fixed = c;
+            }
+            if (!busy){
+                target = fat_alloc_in(fat, len, p, p + len);
+                if (target != p || move_file(ctx, i, target) != 0)
+                    return -1;
+                if (ctx->batch_bytes >= DEFRAG_BATCH && commit(ctx) != 0)
+                    return -1;
+                break;
+            }
+
+            /* copies not committed yet look like clusters nobody owns */
+            if (ctx->n_batch > 0){
+                if (commit(ctx) != 0)
+                    return -1;
+                continue;
+            }
+            if (fixed){
+                p = fixed + 1;
+                continue;
+            }
+
+            /* move whatever is in the way (maybe f itself) out of the window */
+            r = evict(ctx, p, p + len);
+            if (commit(ctx) != 0 || r < 0)
+                return -1;
+            if (r > 0){
+                printf("not enough free space to pack past cluster %u\n", p);
+                return 0;
+            }
+        }
+        p += len;
+    }
+    return commit(ctx);
+}
+
+/* defragment every file of the volume
+ * returns -1 if the files could not be listed or a move failed
+ */
+int defrag(struct fat_volume *vol){
+    struct defrag_ctx ctx;
+    struct defrag_stats before, after;
+    struct fat_dirtab *root;
+    int i, ret = 0;
+    double start = now_ms();
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.vol = vol;
+
+    /* the resolver's copies of the subdirectories would go stale */
+    path_cache_clear(vol);
+    root = path_root(vol);
+    ctx.owner = calloc(vol->fat.n_entries, sizeof(int32_t));
+    if (!root || !ctx.owner || collect(&ctx, root, 0) != 0){
+        fprintf(stderr, "Erro ao listar os arquivos da imagem\n");
+        ret = -1;
+    } else if (ctx.cross_linked){
+        fprintf(stderr, "%d cluster(s) em mais de uma cadeia; a imagem precisa ser reparada antes\n",
+                ctx.cross_linked);
+        ret = -1;
+    }
+
+    if (ret == 0){
+        qsort(ctx.files, ctx.n_files, sizeof(struct defrag_file), by_first_cluster);
+        for (i = 0; i < ctx.n_files; i++)
+            mark_chain(&ctx, ctx.files[i].first, i + 1, 0);
+
+        measure(&ctx, &before);
+        print_stats("before", &before);
+
+        ctx.buffer = malloc(DEFRAG_CHUNK);
+        ctx.batch = malloc((ctx.n_files + 1) * sizeof(int));
+        if (!ctx.buffer || !ctx.batch)
+            ret = -1;
+        else
+            ret = sweep(&ctx);
+
+        measure(&ctx, &after);
+        print_stats("after", &after);
+        printf("%llu bytes moved in %d move(s), %.3f ms\n", (unsigned long long) ctx.moved,
+                ctx.n_moves, now_ms() - start);
+    }
+
+    free(ctx.buffer);
+    free(ctx.batch);
+    free(ctx.files);
+    free(ctx.owner);
+    for (i = 0; i < ctx.n_dirs; i++){
+        dirtab_destroy(ctx.dirs[i]);
+        free(ctx.dirs[i]);
+    }
+    free(ctx.dirs);
+    return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "volume.h"
+
+/* Offline defragmenter.
+ * The files are laid out back to back from the start of the data region,
+ * in their current order, each as one contiguous run, so the free space
+ * ends up in one piece at the end. Files in the way are first moved out to
+ * any free space. Data is only ever copied into free clusters and the FAT
+ * and the entries are switched over in crash-safe steps.
+ * Directory clusters are not moved.
+ */
+
+/* defragment every file of the volume and print the fragmentation before
+ * and after
+ * returns -1 if the files could not be listed or a move failed
+ */
+int defrag(struct fat_volume *);
+
+#endif
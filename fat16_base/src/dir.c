@@ -0,0 +1,416 @@
+#include "dir.h"
+#include "volume.h"
+#include "support.h"
+#include "dirscan.h"
+#include "lfn.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DIR_MAX_DEPTH 64 /* deeper trees (or directory loops) are not walked */
+#define DIR_MAX_TAIL 999999 /* highest numeric tail tried for a 8.3 alias */
+
+/* load and index the directory starting at a cluster (0 for the root)
+ * the root region is read with one request, a subdirectory with one
+ * request per extent of its chain
+ * returns -1 if the chain is broken, memory is short or reading failed
+ */
+static int load(struct fat_volume *vol, uint32_t cluster, struct fat_dirtab *dt){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint32_t offset = 0;
+    int i;
+
+    memset(dt, 0, sizeof(*dt));
+    dt->cluster = cluster;
+
+    if (cluster == 0){
+        dt->n = bpb->possible_rentries;
+    } else {
+        dt->n_ext = fat_chain_extents(&vol->fat, cluster, &dt->ext);
+        if (dt->n_ext <= 0){
+            fprintf(stderr, "Cadeia inválida no diretório do cluster %u\n", cluster);
+            dirtab_destroy(dt);
+            return -1;
+        }
+        for (i = 0; i < dt->n_ext; i++)
+            dt->n += dt->ext[i].len * cluster_size / sizeof(struct fat_dir);
+    }
+
+    /* one extra zeroed slot, so a full directory still has an end mark */
+    dt->ents = calloc(dt->n + 1, sizeof(struct fat_dir));
+    if (!dt->ents){
+        dirtab_destroy(dt);
+        return -1;
+    }
+
+    if (cluster == 0){
+        if (vol_read(vol, bpb_froot_addr(bpb), dt->ents, dt->n * sizeof(struct fat_dir)) != 0){
+            dirtab_destroy(dt);
+            return -1;
+        }
+    } else {
+        for (i = 0; i < dt->n_ext; i++){
+            uint32_t len = dt->ext[i].len * cluster_size;
+            if (vol_read(vol, bpb_clust_addr(bpb, dt->ext[i].start),
+                        (uint8_t *) dt->ents + offset, len) != 0){
+                dirtab_destroy(dt);
+                return -1;
+            }
+            offset += len;
+        }
+    }
+
+    if (dir_index_build(&dt->idx, dt->ents, dt->n) != 0){
+        dirtab_destroy(dt);
+        return -1;
+    }
+    return 0;
+}
+
+/* load and index the directory starting at a cluster, timed as a
+ * directory load
+ */
+int dirtab_load(struct fat_volume *vol, uint32_t cluster, struct fat_dirtab *dt){
+    uint64_t start = stats_clock(vol->stats);
+    int ret = load(vol, cluster, dt);
+
+    stats_phase(vol->stats, STATS_DIR_LOAD, start);
+    return ret;
+}
+
+/* image offset of a slot of a loaded directory */
+uint32_t dirtab_slot_addr(struct fat_volume *vol, struct fat_dirtab *dt, uint32_t slot){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t cluster_size = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint32_t byte = slot * sizeof(struct fat_dir);
+    int i;
+
+    if (dt->cluster == 0)
+        return bpb_froot_addr(bpb) + byte;
+
+    for (i = 0; i < dt->n_ext; i++){
+        uint32_t len = dt->ext[i].len * cluster_size;
+        if (byte < len)
+            return bpb_clust_addr(bpb, dt->ext[i].start) + byte;
+        byte -= len;
+    }
+    return 0;
+}
+
+/* write the cached entry at a slot back to the image */
+int dirtab_write(struct fat_volume *vol, struct fat_dirtab *dt, uint32_t slot){
+    return vol_write_meta(vol, dirtab_slot_addr(vol, dt, slot), &dt->ents[slot], sizeof(struct fat_dir));
+}
+
+/* set up an empty subdirectory over the chain starting at a cluster
+ * only its "." and ".." entries are in use; nothing is written until
+ * dirtab_write_all()
+ * returns -1 if the chain is invalid or memory could not be allocated
+ */
+int dirtab_create(struct fat_volume *vol, uint32_t cluster, uint32_t parent, struct fat_dirtab *dt){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    int i;
+
+    memset(dt, 0, sizeof(*dt));
+    dt->cluster = cluster;
+    dt->n_ext = fat_chain_extents(&vol->fat, cluster, &dt->ext);
+    if (dt->n_ext <= 0){
+        dirtab_destroy(dt);
+        return -1;
+    }
+    for (i = 0; i < dt->n_ext; i++)
+        dt->n += dt->ext[i].len * cluster_size / sizeof(struct fat_dir);
+
+    dt->ents = calloc(dt->n + 1, sizeof(struct fat_dir));
+    if (!dt->ents){
+        dirtab_destroy(dt);
+        return -1;
+    }
+    memcpy(dt->ents[0].name, ".          ", 11);
+    dt->ents[0].attr = DIR_ATTR_DIRECTORY;
+    dt->ents[0].starting_cluster = cluster;
+    memcpy(dt->ents[1].name, "..         ", 11);
+    dt->ents[1].attr = DIR_ATTR_DIRECTORY;
+    dt->ents[1].starting_cluster = parent;
+
+    if (dir_index_build(&dt->idx, dt->ents, dt->n) != 0){
+        dirtab_destroy(dt);
+        return -1;
+    }
+    return 0;
+}
+
+/* write every slot of a loaded subdirectory, one write per extent */
+int dirtab_write_all(struct fat_volume *vol, struct fat_dirtab *dt){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint32_t offset = 0;
+    int i;
+
+    if (dt->cluster == 0)
+        return vol_write_meta(vol, bpb_froot_addr(&vol->bpb), dt->ents, dt->n * sizeof(struct fat_dir));
+    for (i = 0; i < dt->n_ext; i++){
+        uint32_t len = dt->ext[i].len * cluster_size;
+        if (vol_write_meta(vol, bpb_clust_addr(&vol->bpb, dt->ext[i].start),
+                    (uint8_t *) dt->ents + offset, len) != 0)
+            return -1;
+        offset += len;
+    }
+    return 0;
+}
+
+/* release a loaded directory */
+void dirtab_destroy(struct fat_dirtab *dt){
+    dir_index_destroy(&dt->idx);
+    free(dt->ents);
+    free(dt->ext);
+    dt->ents = NULL;
+    dt->ext = NULL;
+    dt->n = 0;
+}
+
+/* the padded 8.3 name of a path component, if it is a plain 8.3 name or
+ * already padded (11 characters, no dot)
+ * returns 0 if the component can only be a long name
+ */
+int dir_short_key(const char *name, char *key){
+    if (!lfn_fits_short(name) && (strlen(name) != 11 || strchr(name, '.')))
+        return 0;
+    padding(name, key);
+    return 1;
+}
+
+/* slot of the entry with a name, long or 8.3 (in any case), or -1
+ * both lookups go through the index; nothing is assembled from the slots
+ */
+int dirtab_find(struct fat_dirtab *dt, const char *name){
+    uint16_t lname[LFN_MAX];
+    char key[12];
+    int slot, len;
+
+    if (dir_short_key(name, key) &&
+            (slot = dir_index_find(&dt->idx, dt->ents, (unsigned char *) key)) >= 0)
+        return slot;
+    len = utf8_to_ucs2(name, lname, LFN_MAX);
+    return len > 0 ? dir_index_find_long(&dt->idx, lname, len) : -1;
+}
+
+/* the name of the entry at a slot: its long name in UTF-8 if it has one,
+ * NAME.EXT otherwise
+ */
+const char *dirtab_name(struct fat_dirtab *dt, uint32_t slot, char *out){
+    struct dir_lname *ln = &dt->idx.lnames[slot];
+
+    if (ln->len > 0)
+        return ucs2_to_utf8(ln->name, ln->len, out);
+    return unpadding(dt->ents[slot].name, out);
+}
+
+/* the 8.3 name for a new entry, stored in short_name, and its long name,
+ * stored in lname; plain upper case 8.3 names get no long name, other
+ * 8.3 names keep their case in one
+ * returns the length of the long name (0 if none), or -1
+ */
+static int new_names(struct fat_dirtab *dt, const char *name, unsigned char *short_name, uint16_t *lname){
+    unsigned char basis[11];
+    char key[12];
+    const char *p;
+    uint32_t tail;
+    int len;
+
+    if (lfn_fits_short(name)){
+        padding(name, key);
+        memcpy(short_name, key, 11);
+        for (p = name; *p && !(*p >= 'a' && *p <= 'z'); p++)
+            ;
+        return *p ? utf8_to_ucs2(name, lname, LFN_MAX) : 0;
+    }
+
+    len = utf8_to_ucs2(name, lname, LFN_MAX);
+    if (len <= 0){
+        fprintf(stderr, "Nome inválido: '%s'\n", name);
+        return -1;
+    }
+    if (lfn_basis(lname, len, basis) == 0 && dir_index_find(&dt->idx, dt->ents, basis) < 0){
+        memcpy(short_name, basis, 11);
+        return len;
+    }
+    for (tail = 1; tail <= DIR_MAX_TAIL; tail++){
+        lfn_tail(basis, tail, short_name);
+        if (dir_index_find(&dt->idx, dt->ents, short_name) < 0)
+            return len;
+    }
+    fprintf(stderr, "Nenhum nome 8.3 livre para '%s'\n", name);
+    return -1;
+}
+
+/* slots an entry with the given name takes: its long name slots, if it
+ * needs a long name, and the 8.3 entry
+ * returns -1 if the name is invalid
+ */
+int dir_name_slots(const char *name){
+    uint16_t lname[LFN_MAX];
+    const char *p;
+    int len;
+
+    if (lfn_fits_short(name)){
+        for (p = name; *p && !(*p >= 'a' && *p <= 'z'); p++)
+            ;
+        if (!*p)
+            return 1;
+    }
+    len = utf8_to_ucs2(name, lname, LFN_MAX);
+    return len > 0 ? 1 + (len + LFN_CHARS - 1) / LFN_CHARS : -1;
+}
+
+/* put an entry with the given name in a loaded directory, in memory only
+ * the long name slots and the entry take consecutive free slots; the first
+ * of them is stored in first
+ * returns the slot of the entry, or -1
+ */
+int dirtab_place(struct fat_dirtab *dt, const char *name, struct fat_dir *dir, int *first){
+    struct fat_dir slots[LFN_MAX_SLOTS];
+    uint16_t lname[LFN_MAX];
+    int len, n_lfn = 0, i;
+
+    name = path_basename(name);
+    if ((len = new_names(dt, name, dir->name, lname)) < 0)
+        return -1;
+    if (len > 0)
+        n_lfn = lfn_make(lname, len, dir->name, slots);
+
+    *first = dir_index_take_run(&dt->idx, dt->n, n_lfn + 1);
+    if (*first < 0){
+        fprintf(stderr, "Erro ao encontrar um slot livre no diretório\n");
+        return -1;
+    }
+
+    for (i = 0; i <= n_lfn; i++)
+        dt->ents[*first + i] = i < n_lfn ? slots[i] : *dir;
+    if (dir_index_insert(&dt->idx, dt->ents, *first + n_lfn, lname, len) != 0)
+        return -1;
+    return *first + n_lfn;
+}
+
+/* add an entry with the given name to a loaded directory
+ * the long name is written first, so an interrupted add leaves at most an
+ * orphan long name, which is ignored
+ * returns the slot of the entry, or -1
+ */
+int dirtab_add(struct fat_volume *vol, struct fat_dirtab *dt, const char *name, struct fat_dir *dir){
+    int slot, first, i;
+
+    if ((slot = dirtab_place(dt, name, dir, &first)) < 0)
+        return -1;
+    for (i = first; i <= slot; i++){
+        if (dirtab_write(vol, dt, i) != 0)
+            return -1;
+    }
+    return slot;
+}
+
+/* mark the entry at a slot and its long name slots as deleted
+ * only the first byte of every slot is written
+ */
+int dirtab_remove(struct fat_volume *vol, struct fat_dirtab *dt, uint32_t slot){
+    uint8_t mark = DIR_FREE_ENTRY;
+    uint32_t first = slot - dt->idx.lnames[slot].n_slots;
+    uint32_t i;
+
+    dir_index_remove(&dt->idx, dt->ents, slot);
+    for (i = first; i <= slot; i++){
+        dt->ents[i].name[0] = DIR_FREE_ENTRY;
+        if (vol_write_meta(vol, dirtab_slot_addr(vol, dt, i), &mark, 1) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* entries that name a file or a subdirectory */
+int dir_is_visible(struct fat_dir *dir){
+    if (dir->name[0] == 0x00 || dir->name[0] == DIR_FREE_ENTRY || dir->name[0] == '.')
+        return 0;
+    if (dir->attr == DIR_ATTR_LFN || (dir->attr & DIR_ATTR_VOLUMEID))
+        return 0;
+    return 1;
+}
+
+static int walk(struct fat_volume *vol, uint32_t cluster, const char *prefix, int recursive,
+        dir_walk_fn fn, void *ctx, int depth){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t chunk = bpb->bytes_p_sect * bpb->sector_p_clust;
+    uint32_t offset = bpb_froot_addr(bpb);
+    uint32_t left = bpb->possible_rentries * sizeof(struct fat_dir);
+    uint32_t steps = 0, lead = 0, n;
+    char path[DIR_PATH_MAX];
+    char name[LFN_UTF8_MAX];
+    const char *lname;
+    struct dir_iter it;
+    struct fat_dir *dir;
+    int ret = 0;
+
+    /* the last slots of the previous cluster are kept in front of the next
+     * one, for long names that start in one cluster and end in the other
+     */
+    struct fat_dir *buffer = malloc(LFN_MAX_SLOTS * sizeof(struct fat_dir) + chunk);
+    struct fat_dir *ents = buffer + LFN_MAX_SLOTS;
+    if (!buffer)
+        return -1;
+
+    while (ret == 0){
+        /* the root region is read a cluster's worth at a time too */
+        if (cluster == 0){
+            if (left == 0)
+                break;
+            if (chunk > left)
+                chunk = left;
+            if (vol_read(vol, offset, ents, chunk) != 0){
+                ret = -1;
+                break;
+            }
+            offset += chunk;
+            left -= chunk;
+        } else {
+            if (cluster < 2 || cluster >= vol->fat.n_entries || steps++ >= vol->fat.n_entries)
+                break;
+            if (vol_read(vol, bpb_clust_addr(bpb, cluster), ents, chunk) != 0){
+                ret = -1;
+                break;
+            }
+            cluster = fat_cache_next(&vol->fat, cluster);
+        }
+
+        n = chunk / sizeof(struct fat_dir);
+        dir_iter_init(&it, ents, n);
+        it.lead = lead;
+        while (ret == 0 && (dir = dir_iter_next(&it))){
+            if (!(lname = dir_iter_lname(&it, dir, name)))
+                lname = unpadding(dir->name, name);
+            snprintf(path, sizeof(path), "%s/%s", prefix, lname);
+            ret = fn(ctx, path, dir);
+
+            if (ret == 0 && recursive && (dir->attr & DIR_ATTR_DIRECTORY) && depth < DIR_MAX_DEPTH)
+                ret = walk(vol, dir->starting_cluster, path, recursive, fn, ctx, depth + 1);
+        }
+        if (it.end_mark)
+            break;
+
+        lead = lead + n < LFN_MAX_SLOTS ? lead + n : LFN_MAX_SLOTS;
+        memmove(ents - lead, ents + n - lead, lead * sizeof(struct fat_dir));
+    }
+
+    free(buffer);
+    return ret;
+}
+
+/* call fn for every entry of a directory, descending into subdirectories
+ * when recursive; only one cluster per level of the tree is in memory
+ * a non-zero return from fn stops the walk and is returned
+ */
+int dir_walk(struct fat_volume *vol, uint32_t cluster, const char *prefix, int recursive,
+        dir_walk_fn fn, void *ctx){
+    uint64_t start = stats_clock(vol->stats);
+    int ret = walk(vol, cluster, prefix, recursive, fn, ctx, 0);
+
+    stats_phase(vol->stats, STATS_DIR_LOAD, start);
+    return ret;
+}
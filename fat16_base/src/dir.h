@@ -0,0 +1,91 @@
+#ifndef DIR_H
+#define DIR_H
+
+#include "fat16.h"
+#include "fatcache.h"
+#include "dirindex.h"
+
+struct fat_volume;
+
+#define DIR_PATH_MAX 1024 /* longest path dir_walk() passes on, with its NUL */
+
+/* A loaded directory.
+ * Either the fixed root region (cluster 0) or a subdirectory, whose slots
+ * live in a cluster chain. The entries are kept in memory with their name
+ * index; changes are written back slot by slot with dirtab_write().
+ */
+struct fat_dirtab {
+    uint32_t cluster; /* first cluster, 0 for the root directory */
+    struct fat_dir *ents; /* the slots, followed by a zeroed end mark */
+    uint32_t n; /* number of slots */
+    struct fat_extent *ext; /* where the slots of a subdirectory live */
+    int n_ext;
+    struct dir_index idx; /* name index of the entries */
+};
+
+/* called by dir_walk() for every entry; path is the full path of the entry */
+typedef int (*dir_walk_fn)(void *ctx, const char *path, struct fat_dir *dir);
+
+/* load and index the directory starting at a cluster (0 for the root) */
+int dirtab_load(struct fat_volume *, uint32_t, struct fat_dirtab *);
+
+/* image offset of a slot of a loaded directory */
+uint32_t dirtab_slot_addr(struct fat_volume *, struct fat_dirtab *, uint32_t);
+
+/* write the cached entry at a slot back to the image */
+int dirtab_write(struct fat_volume *, struct fat_dirtab *, uint32_t);
+
+/* set up an empty subdirectory over the chain starting at a cluster, with
+ * its "." and ".." entries (the latter pointing at the parent's cluster)
+ */
+int dirtab_create(struct fat_volume *, uint32_t, uint32_t, struct fat_dirtab *);
+
+/* write every slot of a loaded directory back to the image */
+int dirtab_write_all(struct fat_volume *, struct fat_dirtab *);
+
+/* release a loaded directory */
+void dirtab_destroy(struct fat_dirtab *);
+
+/* slot of the entry with a name, long or 8.3 (in any case), or -1 */
+int dirtab_find(struct fat_dirtab *, const char *);
+
+/* the name of the entry at a slot: its long name in UTF-8 if it has one,
+ * NAME.EXT otherwise; out must hold LFN_UTF8_MAX bytes
+ */
+const char *dirtab_name(struct fat_dirtab *, uint32_t, char *);
+
+/* add an entry with the given name to a loaded directory
+ * names that aren't plain upper case 8.3 names get long name slots and, if
+ * needed, a 8.3 alias with a numeric tail (LONGNA~1.TXT)
+ * returns the slot of the entry, or -1
+ */
+int dirtab_add(struct fat_volume *, struct fat_dirtab *, const char *, struct fat_dir *);
+
+/* put an entry in a loaded directory like dirtab_add(), without writing it;
+ * the first of the slots it took is stored in the last argument
+ */
+int dirtab_place(struct fat_dirtab *, const char *, struct fat_dir *, int *);
+
+/* slots an entry with the given name takes, or -1 if the name is invalid */
+int dir_name_slots(const char *);
+
+/* mark the entry at a slot and its long name slots as deleted */
+int dirtab_remove(struct fat_volume *, struct fat_dirtab *, uint32_t);
+
+/* the padded 8.3 name of a path component, if it is a plain 8.3 name or
+ * already padded; key must hold 12 bytes
+ * returns 0 if the component can only be a long name
+ */
+int dir_short_key(const char *, char *);
+
+/* entries that name a file or a subdirectory (not ".", "..", labels or
+ * long name parts) */
+int dir_is_visible(struct fat_dir *);
+
+/* call fn for every entry of a directory, descending into subdirectories
+ * when recursive; one cluster is read at a time, nothing is kept loaded
+ * paths are made of the long names of the entries where they have one
+ */
+int dir_walk(struct fat_volume *, uint32_t, const char *, int, dir_walk_fn, void *);
+
+#endif
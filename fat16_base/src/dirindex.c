@@ -0,0 +1,329 @@
+#include "dirindex.h"
+#include "lfn.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* FNV-1a over the 11 bytes of a 8.3 name */
+static uint32_t name_hash(const unsigned char *name){
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < 11; i++){
+        h ^= name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* FNV-1a over the folded characters of a long name */
+static uint32_t long_hash(const uint16_t *folded, int len){
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++){
+        h ^= folded[i] & 0xFF;
+        h *= 16777619u;
+        h ^= folded[i] >> 8;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* entries that can be found by name: no free slots, long name parts or labels */
+static int is_named(struct fat_dir *dir){
+    if (dir->name[0] == 0x00 || dir->name[0] == DIR_FREE_ENTRY)
+        return 0;
+    if (dir->attr == DIR_ATTR_LFN || (dir->attr & DIR_ATTR_VOLUMEID))
+        return 0;
+    return 1;
+}
+
+/* hash of the entry at a slot, in the 8.3 table or in the long name one */
+static uint32_t slot_hash(struct dir_index *idx, struct fat_dir *dirs, uint32_t slot, int longs){
+    struct dir_lname *ln = &idx->lnames[slot];
+
+    if (longs)
+        return long_hash(ln->name + ln->len, ln->len);
+    return name_hash(dirs[slot].name);
+}
+
+/* put a slot in the first bucket from b that is not taken
+ * returns 1 if that bucket was DIX_EMPTY and 0 if it was a tombstone
+ */
+static int bucket_put(int32_t *table, uint32_t mask, uint32_t b, uint32_t slot){
+    uint32_t steps;
+    int was_empty;
+
+    /* a directory has at most half as many slots as the table has buckets */
+    for (steps = 0; steps < mask && table[b] >= 0; steps++)
+        b = (b + 1) & mask;
+    if (table[b] >= 0)
+        return 0;
+    was_empty = table[b] == DIX_EMPTY;
+    table[b] = slot;
+    return was_empty;
+}
+
+/* rehash the live slots of a table, turning its tombstones back into
+ * DIX_EMPTY buckets; every insert may use up an empty bucket and removals
+ * only leave tombstones, so without this a long session fills the table and
+ * a probe for a missing name never ends
+ * the table is left as it is if the copy can't be allocated
+ */
+static void table_rehash(struct dir_index *idx, struct fat_dir *dirs, int longs){
+    int32_t *table = longs ? idx->ltable : idx->table;
+    uint32_t *used = longs ? &idx->lused : &idx->used;
+    uint32_t size = idx->mask + 1, i, n = 0;
+    int32_t *live = malloc(size * sizeof(int32_t));
+
+    if (!live)
+        return;
+    for (i = 0; i < size; i++){
+        if (table[i] >= 0)
+            live[n++] = table[i];
+    }
+    memset(table, 0xff, size * sizeof(int32_t));
+    for (i = 0; i < n; i++)
+        bucket_put(table, idx->mask, slot_hash(idx, dirs, live[i], longs) & idx->mask, live[i]);
+    *used = n;
+    free(live);
+}
+
+/* index a slot in one of the tables, rehashing it once less than a quarter
+ * of its buckets are still empty
+ */
+static void table_put(struct dir_index *idx, struct fat_dir *dirs, uint32_t slot, int longs){
+    int32_t *table = longs ? idx->ltable : idx->table;
+    uint32_t *used = longs ? &idx->lused : &idx->used;
+
+    *used += bucket_put(table, idx->mask, slot_hash(idx, dirs, slot, longs) & idx->mask, slot);
+    if (*used > idx->mask - idx->mask / 4)
+        table_rehash(idx, dirs, longs);
+}
+
+/* keep the long name of the entry at a slot and index it by its folded form
+ * returns -1 if memory could not be allocated
+ */
+static int long_put(struct dir_index *idx, struct fat_dir *dirs, uint32_t slot,
+        const uint16_t *name, int len, int n_slots){
+    struct dir_lname *ln = &idx->lnames[slot];
+    int i;
+
+    ln->name = malloc(2 * len * sizeof(uint16_t));
+    if (!ln->name)
+        return -1;
+    memcpy(ln->name, name, len * sizeof(uint16_t));
+    for (i = 0; i < len; i++)
+        ln->name[len + i] = lfn_fold(name[i]);
+    ln->len = len;
+    ln->n_slots = n_slots;
+
+    table_put(idx, dirs, slot, 1);
+    return 0;
+}
+
+/* build the index of n directory entries
+ * slots after the first end-of-directory mark are all free; long name
+ * slots are collected on the way and checked against the entry after them
+ * returns -1 if memory could not be allocated
+ */
+int dir_index_build(struct dir_index *idx, struct fat_dir *dirs, uint32_t n){
+    uint32_t size = 16;
+    uint32_t i, end = n;
+    struct lfn_acc acc;
+    int len;
+
+    while (size < n * 2)
+        size <<= 1;
+
+    idx->mask = size - 1;
+    idx->used = 0;
+    idx->lused = 0;
+    idx->n_free = 0;
+    idx->n_slots = n;
+    idx->table = malloc(size * sizeof(int32_t));
+    idx->ltable = malloc(size * sizeof(int32_t));
+    idx->lnames = calloc(n ? n : 1, sizeof(struct dir_lname));
+    idx->free_slots = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!idx->table || !idx->ltable || !idx->lnames || !idx->free_slots){
+        fprintf(stderr, "Erro ao alocar o índice do diretório\n");
+        dir_index_destroy(idx);
+        return -1;
+    }
+    memset(idx->table, 0xff, size * sizeof(int32_t)); /* every bucket DIX_EMPTY */
+    memset(idx->ltable, 0xff, size * sizeof(int32_t));
+
+    lfn_acc_reset(&acc);
+    for (i = 0; i < n; i++){
+        if (dirs[i].name[0] == 0x00){
+            end = i;
+            break;
+        }
+        if (dirs[i].name[0] == DIR_FREE_ENTRY){
+            lfn_acc_reset(&acc);
+            continue;
+        }
+        if (dirs[i].attr == DIR_ATTR_LFN){
+            lfn_acc_push(&acc, &dirs[i]);
+            continue;
+        }
+        len = lfn_acc_finish(&acc, &dirs[i]);
+        if (!is_named(&dirs[i]))
+            continue;
+        table_put(idx, dirs, i, 0);
+        if (len > 0 && long_put(idx, dirs, i, acc.name, len, acc.n_slots) != 0){
+            fprintf(stderr, "Erro ao alocar o índice do diretório\n");
+            dir_index_destroy(idx);
+            return -1;
+        }
+    }
+
+    /* pushed from the end so the lowest slot is handed out first */
+    for (i = n; i-- > 0;){
+        if (i >= end || dirs[i].name[0] == DIR_FREE_ENTRY)
+            idx->free_slots[idx->n_free++] = i;
+    }
+    return 0;
+}
+
+/* slot of the entry with the given 8.3 name, or -1 */
+int dir_index_find(struct dir_index *idx, struct fat_dir *dirs, const unsigned char *name){
+    uint32_t b = name_hash(name) & idx->mask;
+    uint32_t steps;
+    int32_t slot;
+
+    for (steps = 0; steps <= idx->mask && (slot = idx->table[b]) != DIX_EMPTY; steps++){
+        if (slot >= 0 && memcmp(dirs[slot].name, name, 11) == 0)
+            return slot;
+        b = (b + 1) & idx->mask;
+    }
+    return -1;
+}
+
+/* slot of the entry with the given long name (any case), or -1
+ * the name is compared with the folded copy kept in the index
+ */
+int dir_index_find_long(struct dir_index *idx, const uint16_t *name, int len){
+    uint16_t folded[LFN_MAX];
+    uint32_t b, steps;
+    int32_t slot;
+    int i;
+
+    if (len <= 0 || len > LFN_MAX)
+        return -1;
+    for (i = 0; i < len; i++)
+        folded[i] = lfn_fold(name[i]);
+
+    b = long_hash(folded, len) & idx->mask;
+    for (steps = 0; steps <= idx->mask && (slot = idx->ltable[b]) != DIX_EMPTY; steps++){
+        if (slot >= 0 && idx->lnames[slot].len == len &&
+                memcmp(idx->lnames[slot].name + len, folded, len * sizeof(uint16_t)) == 0)
+            return slot;
+        b = (b + 1) & idx->mask;
+    }
+    return -1;
+}
+
+/* drop a slot from one of the tables */
+static void table_drop(int32_t *table, uint32_t mask, uint32_t b, uint32_t slot){
+    uint32_t steps;
+
+    for (steps = 0; steps <= mask && table[b] != DIX_EMPTY; steps++){
+        if (table[b] == (int32_t) slot){
+            table[b] = DIX_DELETED;
+            return;
+        }
+        b = (b + 1) & mask;
+    }
+}
+
+/* drop the entry at a slot from the index and make the slot free, along
+ * with the slots of its long name
+ */
+void dir_index_remove(struct dir_index *idx, struct fat_dir *dirs, uint32_t slot){
+    struct dir_lname *ln = &idx->lnames[slot];
+    uint32_t i;
+
+    table_drop(idx->table, idx->mask, name_hash(dirs[slot].name) & idx->mask, slot);
+    idx->free_slots[idx->n_free++] = slot;
+
+    if (ln->len > 0){
+        table_drop(idx->ltable, idx->mask, long_hash(ln->name + ln->len, ln->len) & idx->mask, slot);
+        for (i = 1; i <= ln->n_slots; i++)
+            idx->free_slots[idx->n_free++] = slot - i;
+        free(ln->name);
+        memset(ln, 0, sizeof(*ln));
+    }
+}
+
+/* add the entry just written at a slot taken with dir_index_take_free
+ * or dir_index_take_run, with its long name (len 0 if it has none)
+ * returns -1 if memory could not be allocated
+ */
+int dir_index_insert(struct dir_index *idx, struct fat_dir *dirs, uint32_t slot,
+        const uint16_t *name, int len){
+    if (!is_named(&dirs[slot]))
+        return 0;
+    table_put(idx, dirs, slot, 0);
+    if (len > 0)
+        return long_put(idx, dirs, slot, name, len, (len + LFN_CHARS - 1) / LFN_CHARS);
+    return 0;
+}
+
+/* take a free slot, or -1 if the directory is full */
+int dir_index_take_free(struct dir_index *idx){
+    if (idx->n_free == 0)
+        return -1;
+    return idx->free_slots[--idx->n_free];
+}
+
+/* take the lowest run of count consecutive free slots, or -1
+ * runs are looked for among the free slots of the stack, so they never
+ * start past the end mark while lower slots are still free there
+ */
+int dir_index_take_run(struct dir_index *idx, uint32_t n, uint32_t count){
+    uint8_t *is_free;
+    uint32_t i, j, run = 0;
+    int start = -1;
+
+    if (count == 1)
+        return dir_index_take_free(idx);
+    if (idx->n_free < count || !(is_free = calloc(n, 1)))
+        return -1;
+
+    for (i = 0; i < idx->n_free; i++)
+        is_free[idx->free_slots[i]] = 1;
+    for (i = 0; i < n && start < 0; i++){
+        run = is_free[i] ? run + 1 : 0;
+        if (run == count)
+            start = i + 1 - count;
+    }
+
+    if (start >= 0){
+        for (i = 0, j = 0; i < idx->n_free; i++){
+            uint32_t s = idx->free_slots[i];
+            if (s < (uint32_t) start || s >= start + count)
+                idx->free_slots[j++] = s;
+        }
+        idx->n_free = j;
+    }
+    free(is_free);
+    return start;
+}
+
+/* release the memory used by the index */
+void dir_index_destroy(struct dir_index *idx){
+    uint32_t i;
+
+    for (i = 0; idx->lnames && i < idx->n_slots; i++)
+        free(idx->lnames[i].name);
+    free(idx->table);
+    free(idx->ltable);
+    free(idx->lnames);
+    free(idx->free_slots);
+    idx->table = NULL;
+    idx->ltable = NULL;
+    idx->lnames = NULL;
+    idx->free_slots = NULL;
+    idx->n_free = 0;
+}
@@ -0,0 +1,65 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fat16.h"
+
+/* long name of an entry, assembled once when the index is built */
+struct dir_lname {
+    uint16_t *name; /* len characters as stored, then len folded ones */
+    uint16_t len;
+    uint8_t n_slots; /* long name slots right before the entry */
+};
+
+/* Name index of a loaded directory.
+ * Open-addressing hash tables from the 11-byte 8.3 name and from the
+ * case-folded long name to the slot of the entry, plus a list of the free
+ * slots, so lookups, removals and the insertion of new entries don't scan
+ * the directory. Long names are collected in the same pass that fills the
+ * tables and kept per slot.
+ */
+struct dir_index {
+    int32_t *table; /* slot of the entry, DIX_EMPTY or DIX_DELETED */
+    int32_t *ltable; /* same, by long name */
+    uint32_t mask; /* table size - 1, the size is a power of two */
+    uint32_t used; /* buckets of table that are not DIX_EMPTY */
+    uint32_t lused; /* same, in ltable */
+    struct dir_lname *lnames; /* per slot, len 0 if the entry has no long name */
+    uint32_t n_slots; /* slots of the directory */
+    uint32_t *free_slots; /* stack of free slots, lowest slot on top */
+    uint32_t n_free; /* number of free slots in the stack */
+};
+
+#define DIX_EMPTY -1 /* never used bucket: ends a probe */
+#define DIX_DELETED -2 /* removed entry: probing goes on past it; a table
+                           * is rehashed when few DIX_EMPTY buckets are left */
+
+/* build the index of n directory entries */
+int dir_index_build(struct dir_index *, struct fat_dir *, uint32_t);
+
+/* slot of the entry with the given 8.3 name, or -1 */
+int dir_index_find(struct dir_index *, struct fat_dir *, const unsigned char *);
+
+/* slot of the entry with the given long name (any case), or -1 */
+int dir_index_find_long(struct dir_index *, const uint16_t *, int);
+
+/* drop the entry at a slot from the index and make the slot free, along
+ * with the slots of its long name
+ * must be called before the entry is marked as deleted
+ */
+void dir_index_remove(struct dir_index *, struct fat_dir *, uint32_t);
+
+/* add the entry just written at a slot taken with dir_index_take_free
+ * or dir_index_take_run, with its long name (len 0 if it has none)
+ */
+int dir_index_insert(struct dir_index *, struct fat_dir *, uint32_t, const uint16_t *, int);
+
+/* take a free slot, or -1 if the directory is full */
+int dir_index_take_free(struct dir_index *);
+
+/* take the lowest run of count consecutive free slots among n, or -1 */
+int dir_index_take_run(struct dir_index *, uint32_t, uint32_t);
+
+/* release the memory used by the index */
+void dir_index_destroy(struct dir_index *);
+
+#endif
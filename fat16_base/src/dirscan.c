@@ -0,0 +1,151 @@
+#include "dirscan.h"
+#include "volume.h"
+#include "lfn.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SCAN_BLOCK 16 /* slots classified at once */
+#define SCAN_CHUNK 512 /* root slots read at a time without a mapping */
+
+/* bit mask of the file and subdirectory slots among count slots
+ * slots from the end mark on are left out, and end is set if there was one
+ */
+static uint32_t classify(struct fat_dir *ents, uint32_t count, int *end){
+    uint32_t skip = 0, stop = 0, i;
+
+#ifdef __SSE2__
+    if (count == SCAN_BLOCK){
+        uint8_t first[SCAN_BLOCK], attr[SCAN_BLOCK];
+        for (i = 0; i < SCAN_BLOCK; i++){
+            first[i] = ents[i].name[0];
+            attr[i] = ents[i].attr;
+        }
+        __m128i f = _mm_loadu_si128((const __m128i *) first);
+        __m128i a = _mm_loadu_si128((const __m128i *) attr);
+        __m128i label = _mm_set1_epi8(DIR_ATTR_VOLUMEID); /* long names have it too */
+
+        stop = _mm_movemask_epi8(_mm_cmpeq_epi8(f, _mm_setzero_si128()));
+        skip = _mm_movemask_epi8(_mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi8(f, _mm_set1_epi8((char) DIR_FREE_ENTRY)),
+                        _mm_cmpeq_epi8(f, _mm_set1_epi8('.'))),
+                    _mm_cmpeq_epi8(_mm_and_si128(a, label), label)));
+    } else
+#endif
+    {
+        for (i = 0; i < count; i++){
+            uint8_t c = ents[i].name[0];
+            if (c == 0x00)
+                stop |= 1u << i;
+            if (c == DIR_FREE_ENTRY || c == '.' || (ents[i].attr & DIR_ATTR_VOLUMEID))
+                skip |= 1u << i;
+        }
+    }
+
+    uint32_t live = ~(skip | stop) & ((1u << count) - 1);
+    if (stop){
+        *end = 1;
+        live &= (1u << __builtin_ctz(stop)) - 1;
+    }
+    return live;
+}
+
+/* start iterating over n slots */
+void dir_iter_init(struct dir_iter *it, struct fat_dir *ents, uint32_t n){
+    it->ents = ents;
+    it->n = n;
+    it->next = 0;
+    it->base = 0;
+    it->live = 0;
+    it->lead = 0;
+    it->end_mark = 0;
+}
+
+/* the next file or subdirectory, or NULL at the end mark or of the buffer */
+struct fat_dir *dir_iter_next(struct dir_iter *it){
+    uint32_t bit;
+
+    while (it->live == 0){
+        if (it->end_mark || it->next >= it->n)
+            return NULL;
+        uint32_t count = it->n - it->next < SCAN_BLOCK ? it->n - it->next : SCAN_BLOCK;
+        it->base = it->next;
+        it->live = classify(it->ents + it->base, count, &it->end_mark);
+        it->next += count;
+    }
+
+    bit = __builtin_ctz(it->live);
+    it->live &= it->live - 1;
+    return it->ents + it->base + bit;
+}
+
+/* the long name of an entry returned by dir_iter_next() in UTF-8, or NULL
+ * its slots are read right before the entry, up to lead slots before ents
+ */
+const char *dir_iter_lname(struct dir_iter *it, struct fat_dir *dir, char *out){
+    uint32_t slot = dir - it->ents;
+
+    if (slot + it->lead == 0 || dir[-1].attr != DIR_ATTR_LFN)
+        return NULL;
+    return lfn_name(it->ents, slot, slot + it->lead, out);
+}
+
+/* run fn over what is left of an iteration */
+static int scan_iter(struct dir_iter *it, dir_scan_fn fn, void *ctx){
+    char name[LFN_UTF8_MAX];
+    struct fat_dir *dir;
+    int ret;
+
+    while ((dir = dir_iter_next(it))){
+        if ((ret = fn(ctx, dir, dir_iter_lname(it, dir, name))) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+/* call fn for every file or subdirectory of n slots */
+int dir_scan(struct fat_dir *ents, uint32_t n, dir_scan_fn fn, void *ctx){
+    struct dir_iter it;
+
+    dir_iter_init(&it, ents, n);
+    return scan_iter(&it, fn, ctx);
+}
+
+/* call fn for every file or subdirectory of the root directory
+ * without a mapping, the last slots of a chunk are kept in front of the
+ * next one, for long names that straddle the two
+ */
+int dir_scan_root(struct fat_volume *vol, dir_scan_fn fn, void *ctx){
+    struct fat_bpb *bpb = &vol->bpb;
+    uint32_t offset = bpb_froot_addr(bpb);
+    uint32_t left = bpb->possible_rentries;
+    uint32_t lead = 0;
+    struct fat_dir buffer[LFN_MAX_SLOTS + SCAN_CHUNK];
+    struct fat_dir *chunk = buffer + LFN_MAX_SLOTS;
+    struct fat_dir *ents;
+    struct dir_iter it;
+    int ret;
+
+    ents = vol_ptr(vol, offset, left * sizeof(struct fat_dir));
+    if (ents)
+        return dir_scan(ents, left, fn, ctx);
+
+    while (left > 0){
+        uint32_t n = left < SCAN_CHUNK ? left : SCAN_CHUNK;
+        if (vol_read(vol, offset, chunk, n * sizeof(struct fat_dir)) != 0)
+            return -1;
+
+        dir_iter_init(&it, chunk, n);
+        it.lead = lead;
+        if ((ret = scan_iter(&it, fn, ctx)) != 0)
+            return ret;
+        if (it.end_mark)
+            break;
+        offset += n * sizeof(struct fat_dir);
+        left -= n;
+        lead = LFN_MAX_SLOTS;
+        memcpy(buffer, chunk + n - LFN_MAX_SLOTS, LFN_MAX_SLOTS * sizeof(struct fat_dir));
+    }
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef DIRSCAN_H
+#define DIRSCAN_H
+
+#include "fat16.h"
+
+struct fat_volume;
+
+/* Directory entry scanner.
+ * Walks a buffer of directory slots without allocating, classifying them
+ * 16 at a time (with SSE2 where available): the end mark stops the scan,
+ * and deleted, "." / "..", long name and volume label slots are skipped,
+ * so only files and subdirectories come out.
+ */
+struct dir_iter {
+    struct fat_dir *ents;
+    uint32_t n; /* slots in the buffer */
+    uint32_t next; /* first slot of the next block to classify */
+    uint32_t base; /* first slot of the current block */
+    uint32_t live; /* one bit per entry of the current block still to return */
+    uint32_t lead; /* slots before ents that may hold the start of a long name */
+    int end_mark; /* the end mark was reached */
+};
+
+/* called by dir_scan() for every file or subdirectory, with its long name
+ * in UTF-8 (NULL if it has none)
+ */
+typedef int (*dir_scan_fn)(void *ctx, struct fat_dir *dir, const char *lname);
+
+/* start iterating over n slots */
+void dir_iter_init(struct dir_iter *, struct fat_dir *, uint32_t);
+
+/* the next file or subdirectory, or NULL at the end mark or of the buffer */
+struct fat_dir *dir_iter_next(struct dir_iter *);
+
+/* the long name of an entry returned by dir_iter_next() in UTF-8, or NULL
+ * out must hold LFN_UTF8_MAX bytes
+ */
+const char *dir_iter_lname(struct dir_iter *, struct fat_dir *, char *);
+
+/* call fn for every file or subdirectory of n slots
+ * a non-zero return from fn stops the scan and is returned
+ */
+int dir_scan(struct fat_dir *, uint32_t, dir_scan_fn, void *);
+
+/* call fn for every file or subdirectory of the root directory, scanning
+ * the mapped image in place or reading it in fixed-size chunks
+ * returns -1 if reading failed, or what dir_scan() returned
+ */
+int dir_scan_root(struct fat_volume *, dir_scan_fn, void *);
+
+#endif
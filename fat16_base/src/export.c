@@ -0,0 +1,442 @@
+#include "export.h"
+#include "dir.h"
+#include "stats.h"
+#include "support.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EXPORT_BUFFER (4 << 20) /* bytes per buffer; two of them are in flight */
+#define TAR_BLOCK 512
+#define TAR_RECORD (20 * TAR_BLOCK) /* what tar writes, and expects, at a time */
+
+/* an entry of the volume, found by the walk */
+struct export_entry {
+    char *path; /* relative to the root, without a leading '/' */
+    struct fat_dir dir;
+    int order; /* position in the walk, which qsort doesn't keep */
+};
+
+/* the ustar header; only characters, so the packing doesn't matter */
+struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+
+/* the reader and the writer trade buffers; the locks need their natural
+ * alignment, which fat16.h's packing would take away
+ */
+#pragma pack(push, 8)
+
+struct export_buf {
+    uint8_t *data;
+    uint32_t len;
+    int full; /* filled by the reader, not yet written */
+};
+
+struct export_ctx {
+    struct fat_volume *vol;
+    int format;
+    int fd;
+    struct export_entry *ents;
+    int n, cap;
+    struct export_buf buf[2];
+    int cur; /* the buffer the reader fills */
+    uint64_t written; /* archive bytes so far, for the padding */
+    int done; /* the reader has handed over its last buffer */
+    int failed; /* a file was missing data or the image couldn't be read */
+    int aborted; /* the output can't be written any more */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+#pragma pack(pop)
+
+/* dir_walk callback: remember every entry */
+static int collect(void *arg, const char *path, struct fat_dir *dir){
+    struct export_ctx *ctx = arg;
+
+    if (ctx->n == ctx->cap){
+        int cap = ctx->cap ? ctx->cap * 2 : 256;
+        struct export_entry *tmp = realloc(ctx->ents, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        ctx->ents = tmp;
+        ctx->cap = cap;
+    }
+    if (!(ctx->ents[ctx->n].path = strdup(path + 1)))
+        return -1;
+    ctx->ents[ctx->n].dir = *dir;
+    ctx->ents[ctx->n].order = ctx->n;
+    ctx->n++;
+    return 0;
+}
+
+/* directories first, in the order of the walk (parents before children),
+ * then files by their first cluster; ties, like the empty files that all
+ * have cluster 0, keep the order of the walk
+ */
+static int entry_order(const void *a, const void *b){
+    const struct export_entry *x = a, *y = b;
+    int xd = (x->dir.attr & DIR_ATTR_DIRECTORY) != 0;
+    int yd = (y->dir.attr & DIR_ATTR_DIRECTORY) != 0;
+
+    if (xd != yd)
+        return yd - xd;
+    if (xd)
+        return x->order - y->order;
+    if (x->dir.starting_cluster != y->dir.starting_cluster)
+        return x->dir.starting_cluster < y->dir.starting_cluster ? -1 : 1;
+    return x->order - y->order;
+}
+
+/* the time of last write as a Unix time; FAT keeps local time, in 2 s steps */
+static time_t entry_mtime(struct fat_dir *dir){
+    struct tm tm;
+
+    if (dir->last_write_date == 0)
+        return 0;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = (dir->last_write_date >> 9) + 80;
+    tm.tm_mon = ((dir->last_write_date >> 5) & 0x0f) - 1;
+    tm.tm_mday = dir->last_write_date & 0x1f;
+    tm.tm_hour = dir->last_write_time >> 11;
+    tm.tm_min = (dir->last_write_time >> 5) & 0x3f;
+    tm.tm_sec = (dir->last_write_time & 0x1f) * 2;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    return t < 0 ? 0 : t;
+}
+
+static uint32_t entry_mode(struct fat_dir *dir){
+    if (dir->attr & DIR_ATTR_DIRECTORY)
+        return 0040755;
+    return (dir->attr & DIR_ATTR_READONLY) ? 0100444 : 0100644;
+}
+
+/* reader: the buffer to fill next, once the writer is done with it
+ * returns NULL if the writer gave up
+ */
+static struct export_buf *next_buffer(struct export_ctx *ctx){
+    struct export_buf *buf = &ctx->buf[ctx->cur];
+
+    pthread_mutex_lock(&ctx->lock);
+    buf->full = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    ctx->cur ^= 1;
+    buf = &ctx->buf[ctx->cur];
+    while (buf->full && !ctx->aborted)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+    return ctx->aborted ? NULL : buf;
+}
+
+/* reader: room for at least one byte in the current buffer */
+static struct export_buf *room(struct export_ctx *ctx){
+    struct export_buf *buf = &ctx->buf[ctx->cur];
+    return buf->len < EXPORT_BUFFER ? buf : next_buffer(ctx);
+}
+
+/* reader: append bytes to the archive (NULL for zeros) */
+static int emit(struct export_ctx *ctx, const void *data, uint32_t len){
+    const uint8_t *p = data;
+    struct export_buf *buf;
+
+    while (len > 0){
+        if (!(buf = room(ctx)))
+            return -1;
+        uint32_t n = EXPORT_BUFFER - buf->len < len ? EXPORT_BUFFER - buf->len : len;
+        if (p){
+            memcpy(buf->data + buf->len, p, n);
+            p += n;
+        } else {
+            memset(buf->data + buf->len, 0, n);
+        }
+        buf->len += n;
+        ctx->written += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* reader: zeros up to the next multiple of align */
+static int emit_pad(struct export_ctx *ctx, uint32_t align){
+    uint32_t rest = ctx->written % align;
+    return rest ? emit(ctx, NULL, align - rest) : 0;
+}
+
+/* reader: append the first size bytes of a file, read straight into the
+ * buffers; data missing from a broken chain is written as zeros, so the
+ * archive stays readable
+ */
+static int emit_file(struct export_ctx *ctx, struct export_entry *e){
+    struct fat_volume *vol = ctx->vol;
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint32_t left = e->dir.file_size;
+    struct fat_extent *ext = NULL;
+    struct export_buf *buf;
+    int i, n_ext = 0;
+
+    if (left > 0 && (n_ext = fat_chain_extents(&vol->fat, e->dir.starting_cluster, &ext)) < 0)
+        n_ext = 0;
+
+    for (i = 0; i < n_ext && left > 0; i++){
+        uint32_t offset = bpb_clust_addr(&vol->bpb, ext[i].start);
+        uint32_t len = ext[i].len * cluster_size < left ? ext[i].len * cluster_size : left;
+
+        while (len > 0){
+            if (!(buf = room(ctx))){
+                free(ext);
+                return -1;
+            }
+            uint32_t n = EXPORT_BUFFER - buf->len < len ? EXPORT_BUFFER - buf->len : len;
+            if (vol_read(vol, offset, buf->data + buf->len, n) != 0){
+                free(ext);
+                return -1;
+            }
+            buf->len += n;
+            ctx->written += n;
+            offset += n;
+            len -= n;
+            left -= n;
+        }
+    }
+    free(ext);
+
+    if (left > 0){
+        fprintf(stderr, "Arquivo '%s' incompleto: faltam %u bytes\n", e->path, left);
+        ctx->failed = 1;
+        if (emit(ctx, NULL, left) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* a pax extended header carrying a path too long for ustar */
+static int emit_pax_path(struct export_ctx *ctx, const char *path){
+    struct tar_header h;
+    size_t len = strlen(path) + strlen(" path=\n"), digits = 1, total;
+    unsigned int sum = 0;
+    size_t i;
+
+    /* the length of the record counts its own digits */
+    for (total = len + digits; snprintf(NULL, 0, "%zu", total) > (int) digits; total = len + digits)
+        digits++;
+
+    memset(&h, 0, sizeof(h));
+    snprintf(h.name, sizeof(h.name), "PaxHeaders/%.80s", path);
+    snprintf(h.mode, sizeof(h.mode), "%07o", 0644);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011o", (uint32_t) total);
+    snprintf(h.mtime, sizeof(h.mtime), "%011o", 0);
+    h.type = 'x';
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    memset(h.checksum, ' ', sizeof(h.checksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += ((unsigned char *) &h)[i];
+    snprintf(h.checksum, sizeof(h.checksum), "%06o", sum);
+
+    char *record = malloc(total + 1);
+    if (!record)
+        return -1;
+    snprintf(record, total + 1, "%zu path=%s\n", total, path);
+    int ret = emit(ctx, &h, sizeof(h)) == 0 && emit(ctx, record, total) == 0 ? emit_pad(ctx, TAR_BLOCK) : -1;
+    free(record);
+    return ret;
+}
+
+/* the ustar header of an entry; a name over 100 bytes is split into prefix
+ * and name at a '/', or carried by a pax header if it can't be
+ */
+static int emit_tar_header(struct export_ctx *ctx, struct export_entry *e){
+    int is_dir = (e->dir.attr & DIR_ATTR_DIRECTORY) != 0;
+    char path[DIR_PATH_MAX + 1];
+    struct tar_header h;
+    unsigned int sum = 0;
+    size_t len, i;
+    char *cut = NULL;
+
+    snprintf(path, sizeof(path), "%s%s", e->path, is_dir ? "/" : "");
+    len = strlen(path);
+    memset(&h, 0, sizeof(h));
+    if (len <= sizeof(h.name)){
+        memcpy(h.name, path, len);
+    } else {
+        /* the last '/' that leaves a prefix that fits */
+        for (i = 1; i < len - 1 && i <= sizeof(h.prefix); i++){
+            if (path[i] == '/' && len - i - 1 <= sizeof(h.name))
+                cut = &path[i];
+        }
+        if (cut){
+            memcpy(h.prefix, path, cut - path);
+            memcpy(h.name, cut + 1, len - (cut - path) - 1);
+        } else {
+            if (emit_pax_path(ctx, path) != 0)
+                return -1;
+            memcpy(h.name, path, sizeof(h.name));
+        }
+    }
+
+    snprintf(h.mode, sizeof(h.mode), "%07o", entry_mode(&e->dir) & 07777);
+    snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+    snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+    snprintf(h.size, sizeof(h.size), "%011o", is_dir ? 0 : e->dir.file_size);
+    snprintf(h.mtime, sizeof(h.mtime), "%011llo", (unsigned long long) entry_mtime(&e->dir));
+    h.type = is_dir ? '5' : '0';
+    memcpy(h.magic, "ustar", 6);
+    memcpy(h.version, "00", 2);
+    memset(h.checksum, ' ', sizeof(h.checksum));
+    for (i = 0; i < sizeof(h); i++)
+        sum += ((unsigned char *) &h)[i];
+    snprintf(h.checksum, sizeof(h.checksum), "%06o", sum);
+
+    return emit(ctx, &h, sizeof(h));
+}
+
+/* the newc header of an entry and its name, padded to 4 bytes */
+static int emit_cpio_header(struct export_ctx *ctx, const char *name, uint32_t ino, uint32_t mode,
+        uint32_t size, time_t mtime){
+    char h[111];
+
+    snprintf(h, sizeof(h), "070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X",
+            ino, mode, 0, 0, (mode & 0040000) ? 2 : 1, (uint32_t) mtime, size,
+            0, 0, 0, 0, (uint32_t) strlen(name) + 1, 0);
+    if (emit(ctx, h, 110) != 0 || emit(ctx, name, strlen(name) + 1) != 0)
+        return -1;
+    return emit_pad(ctx, 4);
+}
+
+/* reader thread: the whole archive, into the buffers */
+static void *export_reader(void *arg){
+    struct export_ctx *ctx = arg;
+    uint64_t start = stats_clock(ctx->vol->stats);
+    int i, ret = 0;
+
+    for (i = 0; ret == 0 && i < ctx->n; i++){
+        struct export_entry *e = &ctx->ents[i];
+        int is_dir = (e->dir.attr & DIR_ATTR_DIRECTORY) != 0;
+
+        if (ctx->format == EXPORT_TAR)
+            ret = emit_tar_header(ctx, e);
+        else
+            ret = emit_cpio_header(ctx, e->path, i + 1, entry_mode(&e->dir),
+                    is_dir ? 0 : e->dir.file_size, entry_mtime(&e->dir));
+        if (ret == 0 && !is_dir)
+            ret = emit_file(ctx, e);
+        if (ret == 0)
+            ret = emit_pad(ctx, ctx->format == EXPORT_TAR ? TAR_BLOCK : 4);
+    }
+
+    /* the end of the archive */
+    if (ret == 0 && ctx->format == EXPORT_TAR)
+        ret = emit(ctx, NULL, 2 * TAR_BLOCK) == 0 ? emit_pad(ctx, TAR_RECORD) : -1;
+    else if (ret == 0)
+        ret = emit_cpio_header(ctx, "TRAILER!!!", 0, 0, 0, 0) == 0 ? emit_pad(ctx, TAR_BLOCK) : -1;
+    stats_phase(ctx->vol->stats, STATS_DATA_COPY, start);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ret != 0)
+        ctx->failed = 1;
+    ctx->buf[ctx->cur].full = 1;
+    ctx->done = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* write the whole volume as one archive to a descriptor */
+int export_volume(struct fat_volume *vol, int format, int fd){
+    struct export_ctx ctx;
+    pthread_t reader;
+    int i, cur = 0, ret = 0;
+
+    if (isatty(fd)){
+        fprintf(stderr, "A saída é um terminal: redirecione-a para um arquivo ou pipe\n");
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.vol = vol;
+    ctx.format = format;
+    ctx.fd = fd;
+    if (dir_walk(vol, 0, "", 1, collect, &ctx) != 0){
+        fprintf(stderr, "Erro ao percorrer os diretórios\n");
+        ret = -1;
+        goto out;
+    }
+    qsort(ctx.ents, ctx.n, sizeof(struct export_entry), entry_order);
+
+    ctx.buf[0].data = malloc(EXPORT_BUFFER);
+    ctx.buf[1].data = malloc(EXPORT_BUFFER);
+    if (!ctx.buf[0].data || !ctx.buf[1].data){
+        ret = -1;
+        goto out;
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    if (pthread_create(&reader, NULL, export_reader, &ctx) != 0){
+        ret = -1;
+        goto out;
+    }
+
+    /* writer: hand each buffer back as soon as it is out */
+    for (;;){
+        struct export_buf *buf = &ctx.buf[cur];
+        pthread_mutex_lock(&ctx.lock);
+        while (!buf->full)
+            pthread_cond_wait(&ctx.cond, &ctx.lock);
+        int last = ctx.done && ctx.cur == cur;
+        pthread_mutex_unlock(&ctx.lock);
+
+        if (write_all(fd, buf->data, buf->len) != 0){
+            perror("export");
+            pthread_mutex_lock(&ctx.lock);
+            ctx.aborted = 1;
+            pthread_cond_broadcast(&ctx.cond);
+            pthread_mutex_unlock(&ctx.lock);
+            ret = -1;
+            break;
+        }
+        if (last)
+            break;
+
+        pthread_mutex_lock(&ctx.lock);
+        buf->len = 0;
+        buf->full = 0;
+        pthread_cond_broadcast(&ctx.cond);
+        pthread_mutex_unlock(&ctx.lock);
+        cur ^= 1;
+    }
+    pthread_join(reader, NULL);
+    if (ctx.failed)
+        ret = -1;
+    fprintf(stderr, "%d entrada(s), %llu bytes exportados\n", ctx.n, (unsigned long long) ctx.written);
+
+out:
+    for (i = 0; i < ctx.n; i++)
+        free(ctx.ents[i].path);
+    free(ctx.ents);
+    free(ctx.buf[0].data);
+    free(ctx.buf[1].data);
+    return ret;
+}
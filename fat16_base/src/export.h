@@ -0,0 +1,17 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "volume.h"
+
+#define EXPORT_TAR 0
+#define EXPORT_CPIO 1 /* SVR4 "newc", as written by cpio -H newc */
+
+/* write the whole volume as one archive to a descriptor
+ * directories come first, in tree order, then the files in the order of
+ * their first cluster, so the image is read front to back; a reader thread
+ * fills one buffer while the other is being written out
+ * returns -1 if the archive is incomplete and 0 if success
+ */
+int export_volume(struct fat_volume *, int, int);
+
+#endif
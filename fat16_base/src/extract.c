@@ -0,0 +1,133 @@
+#include "extract.h"
+#include "commands.h"
+#include "pool.h"
+#include "support.h"
+#include "lfn.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* one file to extract, planned before the workers start */
+struct extract_job {
+    char name[LFN_UTF8_MAX];
+    uint32_t size;
+    struct fat_extent *ext;
+    int n_ext;
+    int status; /* 0 once the file is fully written */
+};
+
+struct extract_ctx {
+    struct fat_volume *vol;
+    const char *outdir;
+    struct extract_job *jobs;
+};
+
+/* whether a name read from the image can be used as a file of the output
+ * directory: no separators, control characters, "." or ".."
+ */
+static int safe_name(const char *name){
+    const unsigned char *c;
+
+    if (!name[0] || !strcmp(name, ".") || !strcmp(name, ".."))
+        return 0;
+    for (c = (const unsigned char *) name; *c; c++)
+        if (*c == '/' || *c < 0x20 || *c == 0x7f)
+            return 0;
+    return 1;
+}
+
+/* worker: write one planned file into the output directory
+ * only reads the volume (the FAT snapshot and the image, at explicit offsets)
+ */
+static void extract_one(void *arg, int i){
+    struct extract_ctx *ctx = arg;
+    struct extract_job *job = &ctx->jobs[i];
+    char path[4096];
+
+    snprintf(path, sizeof(path), "%s/%s", ctx->outdir, job->name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0644);
+    if (fd < 0){
+        perror(path);
+        job->status = -1;
+        return;
+    }
+
+    if (vol_copy_extents(ctx->vol, job->ext, job->n_ext, job->size, fd) != 0){
+        fprintf(stderr, "Erro ao extrair '%s'\n", job->name);
+        job->status = -1;
+    }
+    close(fd);
+}
+
+/* copy every file of the root directory into a local directory */
+int extract_all(struct fat_volume *vol, const char *outdir, int threads, uint64_t *extracted){
+    struct extract_ctx ctx = { vol, outdir, NULL };
+    struct fat_dirtab *root = path_root(vol);
+    struct fat_dir *dirs = root ? root->ents : NULL;
+    int i, n = 0, failed = 0;
+    uint64_t bytes = 0;
+    double start, planned, end;
+
+    if (!dirs)
+        return -1;
+    if (mkdir(outdir, 0755) != 0 && access(outdir, W_OK) != 0){
+        perror(outdir);
+        return -1;
+    }
+
+    start = now_ms();
+    ctx.jobs = calloc(vol->bpb.possible_rentries, sizeof(struct extract_job));
+    if (!ctx.jobs)
+        return -1;
+
+    /* resolve every chain up front from the cached FAT */
+    for (i = 0; i < vol->bpb.possible_rentries; i++){
+        struct fat_dir *dir = &dirs[i];
+        if (dir->name[0] == 0x00)
+            break;
+        if (dir->name[0] == DIR_FREE_ENTRY || dir->attr == DIR_ATTR_LFN ||
+                (dir->attr & (DIR_ATTR_VOLUMEID | DIR_ATTR_DIRECTORY)))
+            continue;
+
+        struct extract_job *job = &ctx.jobs[n];
+        dirtab_name(root, i, job->name);
+        if (!safe_name(job->name)){
+            fprintf(stderr, "Nome inválido: '%s'\n", job->name);
+            failed++;
+            continue;
+        }
+        job->size = dir->file_size;
+        job->n_ext = fat_chain_extents(&vol->fat, dir->starting_cluster, &job->ext);
+        if (job->n_ext < 0){
+            fprintf(stderr, "Erro ao resolver a cadeia de '%s'\n", job->name);
+            failed++;
+            continue;
+        }
+        bytes += job->size;
+        n++;
+    }
+    planned = now_ms();
+
+    /* nothing written through stdio may be left behind the descriptor */
+    fflush(vol->fp);
+    pool_run(threads, n, extract_one, &ctx);
+    end = now_ms();
+
+    for (i = 0; i < n; i++){
+        if (ctx.jobs[i].status != 0)
+            failed++;
+        free(ctx.jobs[i].ext);
+    }
+    free(ctx.jobs);
+
+    if (extracted){
+        *extracted = bytes;
+        return failed;
+    }
+    fprintf(stderr, "%d file(s), %llu bytes, %d thread(s): %.3f ms (%.3f ms planning), %.1f MB/s\n",
+            n, (unsigned long long) bytes, threads, end - start, planned - start,
+            end > start ? bytes / 1048576.0 / ((end - start) / 1000.0) : 0.0);
+    return failed;
+}
@@ -0,0 +1,15 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "volume.h"
+
+/* copy every file of the root directory into a local directory
+ * the cluster chains are all resolved first; the copies then run on a
+ * pool of threads that read the image at explicit offsets
+ * the bytes extracted are stored in bytes if it isn't NULL, and a summary
+ * with the timings is printed otherwise
+ * returns the number of files that failed, or -1 if it couldn't run
+ */
+int extract_all(struct fat_volume *, const char *, int, uint64_t *);
+
+#endif
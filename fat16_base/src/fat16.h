@@ -1,68 +1,95 @@
-#ifndef FAT16_H
-#define FAT16_H
-
-#include <stdint.h>
-#include <stdio.h>
-
-#define DIR_FREE_ENTRY 0xE5
-
-#define DIR_ATTR_READONLY 1 << 0 /* file is read only */
-#define DIR_ATTR_HIDDEN 1 << 1 /* file is hidden */
-#define DIR_ATTR_SYSTEM 1 << 2 /* system file (also hidden) */
-#define DIR_ATTR_VOLUMEID 1 << 3 /* special entry containing disk volume lable */
-#define DIR_ATTR_DIRECTORY 1 << 4 /* describes a subdirectory */
-#define DIR_ATTR_ARCHIVE 1 << 5 /*  archive flag (always set when file is modified */
-#define DIR_ATTR_LFN 0xf /* not used */
-#define FAT_EOF 0xFFFF
-
-#define SIG 0xAA55 /* boot sector signature -- sector is executable */
-
-#pragma pack(push, 1)
-struct fat_dir {
-    unsigned char name[11]; /* Short name + file extension */
-    uint8_t attr; /* file attributes */
-    uint8_t ntres; /* reserved for Windows NT, Set value to 0 when a file is created. */
-    uint8_t creation_stamp; /* milisecond timestamp at file creation time */;
-    uint16_t creation_time; /* time file was created */
-    uint16_t ctreation_date; /* date file was created */
-    uint16_t last_access_date; /* last access date (last read/written) */
-    uint16_t reserved_fat32; /* reserved for fat32 */
-    uint16_t last_write_time; /* time of last write */
-    uint16_t last_write_date; /* date of last write */
-    uint16_t starting_cluster; /* starting cluster */
-    uint32_t file_size; /* 32-bit */
-};
-
-/* Boot Sector and BPB
- * Located at the first sector of the volume in the reserved region.
- * AKA as the boot sector, reserved sector or even the "0th" sector.
- */
-struct fat_bpb { /* bios Parameter block */
-    uint8_t jmp_instruction[3]; /* code to jump to the bootstrap code */
-    unsigned char oem_id[8]; /* Oem ID: name of the formatting OS */
-
-    uint16_t bytes_p_sect; /* bytes per sector */
-    uint8_t sector_p_clust; /* sector per cluster */
-    uint16_t reserved_sect; /* reserved sectors */
-    uint8_t n_fat; /* number of FAT copies */
-    uint16_t possible_rentries; /* number of possible root entries */
-    uint16_t snumber_sect; /* small number of sectors */
-
-    uint8_t media_desc; /* media descriptor */
-    uint16_t sect_per_fat; /* sector per FAT */
-    uint16_t sect_per_track; /* sector per track */
-    uint16_t number_of_heads; /* number of heads */
-    uint32_t hidden_sects; /* hidden sectors */
-    uint32_t large_n_sects; /* large number of sectors */
-};
-
-int read_bytes(FILE *, unsigned int, void *, unsigned int);
-void rfat(FILE *, struct fat_bpb *);
-
-/* prototypes for calculating fat stuff */
-uint32_t bpb_faddress(struct fat_bpb *);
-uint32_t bpb_froot_addr(struct fat_bpb *);
-uint32_t bpb_fdata_addr(struct fat_bpb *);
-uint32_t bpb_fdata_sector_count(struct fat_bpb *);
-
-#endif
+#ifndef FAT16_H
+#define FAT16_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DIR_FREE_ENTRY 0xE5
+
+#define DIR_ATTR_READONLY 1 << 0 /* file is read only */
+#define DIR_ATTR_HIDDEN 1 << 1 /* file is hidden */
+#define DIR_ATTR_SYSTEM 1 << 2 /* system file (also hidden) */
+#define DIR_ATTR_VOLUMEID 1 << 3 /* special entry containing disk volume lable */
+#define DIR_ATTR_DIRECTORY 1 << 4 /* describes a subdirectory */
+#define DIR_ATTR_ARCHIVE 1 << 5 /*  archive flag (always set when file is modified */
+#define DIR_ATTR_LFN 0xf /* slot holds part of a VFAT long name */
+#define FAT_EOF 0xFFFF
+#define FAT_BAD 0xFFF7 /* bad cluster mark */
+#define FAT_IS_EOF(x) ((x) >= 0xFFF8) /* any of the end of chain marks */
+
+#define SIG 0xAA55 /* boot sector signature -- sector is executable */
+
+#pragma pack(push, 1)
+struct fat_dir {
+    unsigned char name[11]; /* Short name + file extension */
+    uint8_t attr; /* file attributes */
+    uint8_t ntres; /* reserved for Windows NT, Set value to 0 when a file is created. */
+    uint8_t creation_stamp; /* milisecond timestamp at file creation time */;
+    uint16_t creation_time; /* time file was created */
+    uint16_t ctreation_date; /* date file was created */
+    uint16_t last_access_date; /* last access date (last read/written) */
+    uint16_t reserved_fat32; /* reserved for fat32 */
+    uint16_t last_write_time; /* time of last write */
+    uint16_t last_write_date; /* date of last write */
+    uint16_t starting_cluster; /* starting cluster */
+    uint32_t file_size; /* 32-bit */
+};
+
+/* VFAT long name slot
+ * A long name is stored in slots placed just before the 8.3 entry, 13 UCS-2
+ * characters each, the last part first. Every slot carries the checksum of
+ * the 8.3 name, so a long name left behind by a tool that doesn't know
+ * about them can be told apart.
+ */
+struct fat_lfn {
+    uint8_t ord; /* part number, from 1; LFN_LAST is set on the last part */
+    uint16_t name1[5]; /* characters 1-5 of the part */
+    uint8_t attr; /* always DIR_ATTR_LFN */
+    uint8_t type; /* 0 */
+    uint8_t checksum; /* checksum of the 8.3 name */
+    uint16_t name2[6]; /* characters 6-11 */
+    uint16_t first_cluster; /* 0 */
+    uint16_t name3[2]; /* characters 12-13 */
+};
+
+#define LFN_LAST 0x40
+#define LFN_CHARS 13 /* characters per slot */
+#define LFN_MAX 255 /* characters in a long name */
+#define LFN_MAX_SLOTS 20 /* slots of the longest name */
+
+/* Boot Sector and BPB
+ * Located at the first sector of the volume in the reserved region.
+ * AKA as the boot sector, reserved sector or even the "0th" sector.
+ */
+struct fat_bpb { /* bios Parameter block */
+    uint8_t jmp_instruction[3]; /* code to jump to the bootstrap code */
+    unsigned char oem_id[8]; /* Oem ID: name of the formatting OS */
+
+    uint16_t bytes_p_sect; /* bytes per sector */
+    uint8_t sector_p_clust; /* sector per cluster */
+    uint16_t reserved_sect; /* reserved sectors */
+    uint8_t n_fat; /* number of FAT copies */
+    uint16_t possible_rentries; /* number of possible root entries */
+    uint16_t snumber_sect; /* small number of sectors */
+
+    uint8_t media_desc; /* media descriptor */
+    uint16_t sect_per_fat; /* sector per FAT */
+    uint16_t sect_per_track; /* sector per track */
+    uint16_t number_of_heads; /* number of heads */
+    uint32_t hidden_sects; /* hidden sectors */
+    uint32_t large_n_sects; /* large number of sectors */
+};
+
+int read_bytes(FILE *, unsigned int, void *, unsigned int);
+void rfat(FILE *, struct fat_bpb *);
+
+/* prototypes for calculating fat stuff */
+uint32_t bpb_faddress(struct fat_bpb *);
+uint32_t bpb_froot_addr(struct fat_bpb *);
+uint32_t bpb_fdata_addr(struct fat_bpb *);
+uint32_t bpb_fdata_sector_count(struct fat_bpb *);
+uint32_t bpb_total_sects(struct fat_bpb *);
+uint32_t bpb_cluster_count(struct fat_bpb *);
+uint32_t bpb_clust_addr(struct fat_bpb *, uint32_t);
+
+#endif
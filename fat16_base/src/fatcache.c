@@ -0,0 +1,173 @@
+#include "fatcache.h"
+#include "alloc.h"
+#include "volume.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* load the first FAT of the volume into its cache
+ * returns -1 if memory could not be allocated or the FAT could not be read
+ */
+int fat_cache_load(struct fat_volume *vol){
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+    uint32_t fat_size = bpb->sect_per_fat * bpb->bytes_p_sect;
+    uint32_t clusters = bpb_cluster_count(bpb) + 2;
+
+    fat->n_sects = bpb->sect_per_fat;
+    fat->bytes_p_sect = bpb->bytes_p_sect;
+    fat->n_entries = fat_size / 2;
+    if (clusters < fat->n_entries)
+        fat->n_entries = clusters;
+
+    fat->free_map = NULL;
+    fat->held = NULL;
+    fat->n_held = fat->held_cap = 0;
+    fat->entries = malloc(fat_size);
+    fat->dirty = calloc(fat->n_sects, 1);
+    if (!fat->entries || !fat->dirty){
+        fprintf(stderr, "Erro ao alocar memória para a FAT\n");
+        fat_cache_destroy(fat);
+        return -1;
+    }
+
+    if (vol_read(vol, bpb_faddress(bpb), fat->entries, fat_size) != 0 ||
+            fat_alloc_init(fat) != 0){
+        fat_cache_destroy(fat);
+        return -1;
+    }
+    return 0;
+}
+
+/* get the FAT entry (next cluster) of a cluster */
+uint16_t fat_cache_next(struct fat_cache *fat, uint32_t cluster){
+    if (fat->stats)
+        stats_lookups(fat->stats, 1);
+    if (cluster >= fat->n_entries)
+        return FAT_EOF;
+    return fat->entries[cluster];
+}
+
+/* change the FAT entry of a cluster and mark its sector dirty */
+void fat_cache_set(struct fat_cache *fat, uint32_t cluster, uint16_t value){
+    if (cluster < 2 || cluster >= fat->n_entries)
+        return;
+
+    /* keep the allocator's bitmap in step with the table; a held cluster
+     * isn't in it, so taking it back leaves the bitmap alone */
+    if (fat->free_map && (fat->entries[cluster] == 0) != (value == 0)){
+        uint64_t bit = (uint64_t) 1 << (cluster % 64);
+        if (value != 0){
+            if (fat->free_map[cluster / 64] & bit){
+                fat->free_map[cluster / 64] &= ~bit;
+                fat->n_free--;
+            }
+        } else if (fat->hold){
+            fat_alloc_hold(fat, cluster);
+        } else {
+            fat->free_map[cluster / 64] |= bit;
+            fat->n_free++;
+        }
+    }
+    fat->entries[cluster] = value;
+    fat->dirty[cluster * 2 / fat->bytes_p_sect] = 1;
+}
+
+/* release every cluster of the chain starting at the given cluster */
+void fat_cache_free_chain(struct fat_cache *fat, uint32_t cluster){
+    uint32_t next;
+    uint32_t steps = 0;
+
+    /* the step limit stops on looping chains */
+    while (cluster >= 2 && cluster < fat->n_entries && steps++ < fat->n_entries){
+        next = fat->entries[cluster];
+        fat_cache_set(fat, cluster, 0x0000);
+        if (FAT_IS_EOF(next))
+            break;
+        cluster = next;
+    }
+}
+
+/* resolve the chain starting at a cluster into extents
+ * the walk stops at the end of chain mark, at an entry that is not a valid
+ * cluster and after n_entries steps, so looping chains can't hang it
+ * returns the number of extents, stored in a malloc'ed array, or -1
+ */
+int fat_chain_extents(struct fat_cache *fat, uint32_t cluster, struct fat_extent **out){
+    struct fat_extent *ext = NULL, *tmp;
+    int n = 0, cap = 0;
+    uint32_t steps = 0;
+    uint64_t start = stats_clock(fat->stats);
+
+    *out = NULL;
+    while (cluster >= 2 && cluster < fat->n_entries && steps++ < fat->n_entries){
+        if (n > 0 && ext[n - 1].start + ext[n - 1].len == cluster){
+            ext[n - 1].len++;
+        } else {
+            if (n == cap){
+                cap = cap ? cap * 2 : 8;
+                tmp = realloc(ext, cap * sizeof(*ext));
+                if (!tmp){
+                    free(ext);
+                    return -1;
+                }
+                ext = tmp;
+            }
+            ext[n].start = cluster;
+            ext[n].len = 1;
+            n++;
+        }
+        cluster = fat->entries[cluster];
+    }
+    *out = ext;
+    if (fat->stats){
+        stats_lookups(fat->stats, steps);
+        stats_phase(fat->stats, STATS_CHAIN_WALK, start);
+    }
+    return n;
+}
+
+/* write the dirty sectors back to every FAT copy
+ * consecutive dirty sectors are written with a single write
+ * returns -1 if writing failed and 0 if success
+ */
+int fat_cache_flush(struct fat_volume *vol){
+    struct fat_bpb *bpb = &vol->bpb;
+    struct fat_cache *fat = &vol->fat;
+    uint32_t sect, run, copy;
+    uint32_t fat_size = fat->n_sects * fat->bytes_p_sect;
+
+    for (sect = 0; sect < fat->n_sects; sect += run){
+        run = 0;
+        while (sect + run < fat->n_sects && fat->dirty[sect + run])
+            run++;
+        if (run == 0){
+            run = 1;
+            continue;
+        }
+
+        for (copy = 0; copy < bpb->n_fat; copy++){
+            uint32_t offset = bpb_faddress(bpb) + copy * fat_size + sect * fat->bytes_p_sect;
+            uint8_t *src = (uint8_t *) fat->entries + sect * fat->bytes_p_sect;
+            if (vol_write_meta(vol, offset, src, run * fat->bytes_p_sect) != 0){
+                fprintf(stderr, "Erro ao gravar a FAT\n");
+                return -1;
+            }
+        }
+        memset(fat->dirty + sect, 0, run);
+    }
+    return fflush(vol->fp) == 0 ? 0 : -1;
+}
+
+/* release the memory used by the cache */
+void fat_cache_destroy(struct fat_cache *fat){
+    free(fat->entries);
+    free(fat->dirty);
+    free(fat->free_map);
+    free(fat->held);
+    fat->entries = NULL;
+    fat->dirty = NULL;
+    fat->free_map = NULL;
+    fat->held = NULL;
+    fat->n_held = fat->held_cap = 0;
+    fat->n_entries = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef FATCACHE_H
+#define FATCACHE_H
+
+#include "fat16.h"
+#include "stats.h"
+
+/* In-memory copy of the FAT.
+ * The first FAT is loaded once after rfat(); lookups and updates are done
+ * on this copy and only the sectors that changed are written back, to
+ * every FAT copy, by fat_cache_flush().
+ */
+struct fat_cache {
+    uint16_t *entries; /* the whole FAT, one 16-bit entry per cluster */
+    uint32_t n_entries; /* number of entries that map to real clusters */
+    uint8_t *dirty; /* one flag per FAT sector */
+    uint32_t n_sects; /* sectors per FAT */
+    uint16_t bytes_p_sect; /* bytes per sector */
+    uint64_t *free_map; /* free-cluster bitmap, bit set means free (see alloc.c) */
+    uint32_t n_free; /* number of free clusters */
+    uint32_t cursor; /* next-fit hint: where the next search starts */
+    int hold; /* keep freed clusters out of the bitmap until released */
+    uint32_t *held; /* clusters freed since the last release */
+    uint32_t n_held, held_cap;
+    struct fat_stats *stats; /* the volume's counters, NULL if not counting */
+};
+
+/* a run of consecutive clusters of a chain */
+struct fat_extent {
+    uint32_t start; /* first cluster */
+    uint32_t len; /* number of clusters */
+};
+
+struct fat_volume;
+
+/* load the first FAT of the volume into its cache */
+int fat_cache_load(struct fat_volume *);
+
+/* get the FAT entry (next cluster) of a cluster */
+uint16_t fat_cache_next(struct fat_cache *, uint32_t);
+
+/* change the FAT entry of a cluster and mark its sector dirty */
+void fat_cache_set(struct fat_cache *, uint32_t, uint16_t);
+
+/* release every cluster of the chain starting at the given cluster */
+void fat_cache_free_chain(struct fat_cache *, uint32_t);
+
+/* resolve the chain starting at a cluster into extents
+ * returns the number of extents, stored in a malloc'ed array, or -1
+ */
+int fat_chain_extents(struct fat_cache *, uint32_t, struct fat_extent **);
+
+/* write the dirty sectors back to every FAT copy */
+int fat_cache_flush(struct fat_volume *);
+
+/* release the memory used by the cache */
+void fat_cache_destroy(struct fat_cache *);
+
+#endif
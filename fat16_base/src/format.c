@@ -0,0 +1,158 @@
+#include "format.h"
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* size the FAT for the rest of the geometry
+ * uses the FAT size formula from the Microsoft FAT specification, which
+ * may round up by a sector but never gives a FAT too small for the volume
+ * returns the number of data clusters, or 0 if the geometry can't hold any
+ */
+uint32_t format_geometry(struct fat_geometry *geo){
+    uint32_t root_sects = (geo->possible_rentries * 32 + geo->bytes_p_sect - 1) / geo->bytes_p_sect;
+    uint32_t meta = geo->reserved_sect + root_sects;
+    uint32_t per_fat, spf, pad;
+
+    if (geo->total_sects <= meta || geo->sector_p_clust == 0)
+        return 0;
+
+    per_fat = (geo->bytes_p_sect / 2) * geo->sector_p_clust + geo->n_fat;
+    spf = (geo->total_sects - meta + per_fat - 1) / per_fat;
+    if (spf > 0xFFFF)
+        return 0;
+    geo->sect_per_fat = spf;
+
+    /* fewer clusters are left after the padding: the FAT still covers them */
+    if (geo->align > 1){
+        pad = (geo->align - (meta + geo->n_fat * spf) % geo->align) % geo->align;
+        if (geo->reserved_sect + pad > 0xFFFF)
+            return 0;
+        geo->reserved_sect += pad;
+        meta += pad;
+    }
+
+    if (geo->total_sects <= meta + geo->n_fat * spf)
+        return 0;
+    return (geo->total_sects - meta - geo->n_fat * spf) / geo->sector_p_clust;
+}
+
+/* choose the cluster size for an expected average file size */
+uint32_t format_choose(struct fat_geometry *geo, uint32_t avg_file){
+    struct fat_geometry best = *geo, g;
+    uint64_t best_waste = UINT64_MAX;
+    uint32_t best_clusters = 0, clusters, spc;
+
+    for (spc = 1; spc <= 128; spc *= 2){
+        if (geo->sector_p_clust && spc != geo->sector_p_clust)
+            continue;
+        /* 64 KiB clusters only when nothing smaller fits: not every
+         * system mounts them */
+        if (spc == 128 && best_clusters && !geo->sector_p_clust)
+            break;
+        g = *geo;
+        g.sector_p_clust = spc;
+        g.align = spc;
+        clusters = format_geometry(&g);
+        if (clusters < FAT16_MIN_CLUSTERS || clusters > FAT16_MAX_CLUSTERS)
+            continue;
+
+        /* a small file leaves the rest of its cluster unused; a big one,
+         * half a cluster on average */
+        uint64_t cluster_size = (uint64_t) spc * g.bytes_p_sect;
+        uint64_t slack = avg_file < cluster_size ? cluster_size - avg_file : cluster_size / 2;
+        uint64_t per_file = avg_file + slack;
+        uint64_t n_files = clusters * cluster_size / per_file;
+        uint64_t waste = (uint64_t) (g.reserved_sect + g.n_fat * g.sect_per_fat) * g.bytes_p_sect +
+                n_files * slack;
+
+        if (waste < best_waste){
+            best_waste = waste;
+            best = g;
+            best_clusters = clusters;
+        }
+    }
+    if (best_clusters)
+        *geo = best;
+    return best_clusters;
+}
+
+/* create an empty FAT16 image with the given geometry
+ * the image is sized with ftruncate, so the root directory and the data
+ * region are holes; only the boot sector and the first FAT sector of each
+ * copy are written
+ * returns -1 if the geometry is invalid or the image could not be written
+ */
+int format_image(const char *path, struct fat_geometry *geo){
+    uint8_t sector[4096];
+    struct fat_bpb bpb;
+    uint32_t clusters = format_geometry(geo);
+    uint32_t serial = (uint32_t) time(NULL);
+    int i, fd;
+
+    if (clusters == 0 || geo->bytes_p_sect > sizeof(sector)){
+        fprintf(stderr, "Geometria inválida para FAT16\n");
+        return -1;
+    }
+    if (clusters < FAT16_MIN_CLUSTERS || clusters > FAT16_MAX_CLUSTERS)
+        fprintf(stderr, "Aviso: %u clusters fora da faixa do FAT16 (%d-%d)\n",
+                clusters, FAT16_MIN_CLUSTERS, FAT16_MAX_CLUSTERS);
+
+    memset(&bpb, 0, sizeof(bpb));
+    bpb.jmp_instruction[0] = 0xEB;
+    bpb.jmp_instruction[1] = 0x3C;
+    bpb.jmp_instruction[2] = 0x90;
+    memcpy(bpb.oem_id, "MKIMAGE ", 8);
+    bpb.bytes_p_sect = geo->bytes_p_sect;
+    bpb.sector_p_clust = geo->sector_p_clust;
+    bpb.reserved_sect = geo->reserved_sect;
+    bpb.n_fat = geo->n_fat;
+    bpb.possible_rentries = geo->possible_rentries;
+    if (geo->total_sects < 0x10000)
+        bpb.snumber_sect = geo->total_sects;
+    else
+        bpb.large_n_sects = geo->total_sects;
+    bpb.media_desc = 0xF8;
+    bpb.sect_per_fat = geo->sect_per_fat;
+    bpb.sect_per_track = 32;
+    bpb.number_of_heads = 64;
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+        perror(path);
+        return -1;
+    }
+
+    /* boot sector: BPB, extended BPB and signature */
+    memset(sector, 0, geo->bytes_p_sect);
+    memcpy(sector, &bpb, sizeof(bpb));
+    sector[36] = 0x80; /* drive number */
+    sector[38] = 0x29; /* extended boot signature */
+    memcpy(sector + 39, &serial, 4);
+    memcpy(sector + 43, "NO NAME    FAT16   ", 19);
+    sector[510] = SIG & 0xFF;
+    sector[511] = SIG >> 8;
+
+    int ret = 0;
+    if (ftruncate(fd, (off_t) geo->total_sects * geo->bytes_p_sect) != 0 ||
+            pwrite(fd, sector, geo->bytes_p_sect, 0) != geo->bytes_p_sect)
+        ret = -1;
+
+    /* entries 0 and 1 of every FAT copy: media descriptor and end of chain */
+    memset(sector, 0, geo->bytes_p_sect);
+    sector[0] = bpb.media_desc;
+    sector[1] = 0xFF;
+    sector[2] = 0xFF;
+    sector[3] = 0xFF;
+    for (i = 0; ret == 0 && i < geo->n_fat; i++){
+        off_t offset = (off_t) (geo->reserved_sect + i * geo->sect_per_fat) * geo->bytes_p_sect;
+        if (pwrite(fd, sector, geo->bytes_p_sect, offset) != geo->bytes_p_sect)
+            ret = -1;
+    }
+
+    if (ret != 0)
+        perror(path);
+    if (close(fd) != 0)
+        ret = -1;
+    return ret;
+}
@@ -0,0 +1,40 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+#include "fat16.h"
+
+#define FAT16_MIN_CLUSTERS 4085 /* fewer clusters make a FAT12 volume */
+#define FAT16_MAX_CLUSTERS 65524 /* more make a FAT32 one */
+
+/* Layout of a volume to be created */
+struct fat_geometry {
+    uint32_t total_sects; /* size of the volume in sectors */
+    uint16_t bytes_p_sect;
+    uint8_t sector_p_clust;
+    uint16_t reserved_sect;
+    uint8_t n_fat;
+    uint16_t possible_rentries;
+    uint16_t sect_per_fat; /* filled in by format_geometry() */
+    uint32_t align; /* sectors the data region starts on a multiple of, 0 for none */
+};
+
+/* size the FAT for the rest of the geometry
+ * with align set, the reserved region grows so that the data region (and
+ * so every cluster) starts on a multiple of align sectors
+ * returns the number of data clusters, or 0 if the geometry can't hold any
+ */
+uint32_t format_geometry(struct fat_geometry *);
+
+/* choose the cluster size for an expected average file size: the FAT16
+ * geometry that wastes the least space on the FAT, the alignment and the
+ * slack at the end of the files, with a volume full of such files
+ * a sector_p_clust already set is kept; clusters are aligned to their size
+ * and are 64 KiB only if no smaller size fits
+ * returns the number of data clusters, or 0 if no cluster size fits FAT16
+ */
+uint32_t format_choose(struct fat_geometry *, uint32_t);
+
+/* create an empty FAT16 image with the given geometry */
+int format_image(const char *, struct fat_geometry *);
+
+#endif
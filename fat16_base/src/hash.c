@@ -0,0 +1,413 @@
+#include "hash.h"
+#include "dir.h"
+#include "pool.h"
+#include "support.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HASH_BUFFER (1 << 20) /* bytes read at a time when the image isn't mapped */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t *p){
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const uint8_t *p){
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input){
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val){
+    acc ^= xxh_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* XXH64 of a buffer (the images and this code are little-endian) */
+uint64_t hash_xxh64(const void *data, size_t len, uint64_t seed){
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32){
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2, v2 = seed + PRIME64_2;
+        uint64_t v3 = seed, v4 = seed - PRIME64_1;
+        /* four independent lanes: the loop runs at memory speed */
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + PRIME64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8){
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end){
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++){
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/* hash each cluster-sized piece of len bytes into leaves */
+static void hash_leaves(const uint8_t *data, uint32_t len, uint32_t cluster_size, uint64_t *leaves){
+    uint32_t n;
+
+    for (; len > 0; data += n, len -= n){
+        n = len < cluster_size ? len : cluster_size;
+        *leaves++ = hash_xxh64(data, n, 0);
+    }
+}
+
+/* the digest of a file from the digests of its clusters */
+static uint64_t hash_file_digest(const uint64_t *leaves, uint32_t n, uint32_t size){
+    return hash_xxh64(leaves, n * sizeof(uint64_t), size);
+}
+
+/* one file to hash, planned before the workers start */
+struct hash_job {
+    struct fat_extent *ext;
+    int n_ext;
+    int status;
+};
+
+struct hash_ctx {
+    struct fat_volume *vol;
+    struct hash_index *idx;
+    struct hash_job *jobs;
+};
+
+/* dir_walk callback: every file, with its first cluster and size */
+static int collect(void *arg, const char *path, struct fat_dir *dir){
+    struct hash_index *idx = arg;
+
+    if (dir->attr & DIR_ATTR_DIRECTORY)
+        return 0;
+    if (idx->n == idx->cap){
+        int cap = idx->cap ? idx->cap * 2 : 256;
+        struct hash_file *tmp = realloc(idx->files, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        idx->files = tmp;
+        idx->cap = cap;
+    }
+    struct hash_file *f = &idx->files[idx->n];
+    memset(f, 0, sizeof(*f));
+    if (!(f->path = strdup(path)))
+        return -1;
+    f->size = dir->file_size;
+    f->first = dir->starting_cluster;
+    idx->n++;
+    return 0;
+}
+
+/* worker: hash one file, an extent at a time
+ * a mapped image is hashed in place; otherwise the extent is read at
+ * explicit offsets (or through the block cache) into a buffer
+ */
+static void hash_one(void *arg, int i){
+    struct hash_ctx *ctx = arg;
+    struct fat_volume *vol = ctx->vol;
+    struct hash_index *idx = ctx->idx;
+    struct hash_file *f = &idx->files[i];
+    struct hash_job *job = &ctx->jobs[i];
+    uint32_t cs = idx->cluster_size;
+    uint32_t n_leaves = (f->size + cs - 1) / cs, done = 0, left = f->size;
+    uint64_t *leaves = malloc((n_leaves ? n_leaves : 1) * sizeof(uint64_t));
+    uint8_t *buffer = NULL;
+    int e;
+
+    if (!leaves){
+        job->status = -1;
+        return;
+    }
+    for (e = 0; e < job->n_ext && left > 0; e++){
+        uint32_t addr = bpb_clust_addr(&vol->bpb, job->ext[e].start);
+        uint32_t len = job->ext[e].len * cs < left ? job->ext[e].len * cs : left;
+        uint8_t *p = vol_ptr(vol, addr, len);
+
+        if (p){
+            hash_leaves(p, len, cs, leaves + done);
+        } else {
+            uint32_t chunk = HASH_BUFFER / cs * cs, off, n;
+            if (chunk == 0)
+                chunk = cs;
+            if (!buffer && !(buffer = malloc(chunk)))
+                break;
+            for (off = 0; off < len; off += n){
+                n = len - off < chunk ? len - off : chunk;
+                if (vol->cache ? vol_read(vol, addr + off, buffer, n) != 0 :
+                        pread(vol->fd, buffer, n, addr + off) != (ssize_t) n)
+                    break;
+                hash_leaves(buffer, n, cs, leaves + done + off / cs);
+            }
+            if (off < len)
+                break;
+        }
+        /* the index of every cluster the file covers */
+        for (uint32_t c = 0; c < (len + cs - 1) / cs && job->ext[e].start + c < idx->n_clusters; c++)
+            idx->clusters[job->ext[e].start + c] = leaves[done + c];
+        done += (len + cs - 1) / cs;
+        left -= len;
+    }
+
+    if (left > 0){
+        job->status = -1;
+    } else {
+        f->head = n_leaves ? leaves[0] : 0;
+        f->digest = hash_file_digest(leaves, n_leaves, f->size);
+    }
+    free(buffer);
+    free(leaves);
+}
+
+/* by size, then by the digest of the first cluster */
+static int file_order(const void *a, const void *b){
+    const struct hash_file *x = a, *y = b;
+
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return x->head < y->head ? -1 : x->head > y->head;
+}
+
+/* hash every file of the volume, leaving the files in walk order */
+static int hash_files(struct fat_volume *vol, int threads, struct hash_index *idx){
+    struct hash_ctx ctx = { vol, idx, NULL };
+    int i, failed = 0;
+
+    memset(idx, 0, sizeof(*idx));
+    idx->cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    idx->n_clusters = vol->fat.n_entries;
+    if (!(idx->clusters = calloc(idx->n_clusters, sizeof(uint64_t))))
+        return -1;
+    if (dir_walk(vol, 0, "", 1, collect, idx) != 0){
+        fprintf(stderr, "Erro ao percorrer os diretórios\n");
+        return -1;
+    }
+    if (!(ctx.jobs = calloc(idx->n ? idx->n : 1, sizeof(struct hash_job))))
+        return -1;
+
+    /* resolve every chain up front from the cached FAT */
+    for (i = 0; i < idx->n; i++){
+        struct hash_file *f = &idx->files[i];
+        if (f->size > 0 && (ctx.jobs[i].n_ext = fat_chain_extents(&vol->fat, f->first, &ctx.jobs[i].ext)) < 0){
+            ctx.jobs[i].n_ext = 0;
+            ctx.jobs[i].status = -1;
+        }
+    }
+
+    /* nothing written through stdio may be left behind the descriptor */
+    if (vol->fp)
+        fflush(vol->fp);
+    pool_run(threads, idx->n, hash_one, &ctx);
+
+    for (i = 0; i < idx->n; i++){
+        if (ctx.jobs[i].status != 0){
+            fprintf(stderr, "Erro ao ler '%s'\n", idx->files[i].path);
+            idx->files[i].failed = 1;
+            failed++;
+        }
+        free(ctx.jobs[i].ext);
+    }
+    free(ctx.jobs);
+    return failed ? -1 : 0;
+}
+
+/* hash every file of the volume on a number of threads
+ * files that could not be read are left out of the index: their digests
+ * mean nothing
+ */
+int hash_volume(struct fat_volume *vol, int threads, struct hash_index *idx){
+    int ret = hash_files(vol, threads, idx);
+    int i, n = 0;
+
+    for (i = 0; i < idx->n; i++){
+        if (idx->files[i].failed)
+            free(idx->files[i].path);
+        else
+            idx->files[n++] = idx->files[i];
+    }
+    idx->n = n;
+    if (idx->files)
+        qsort(idx->files, idx->n, sizeof(struct hash_file), file_order);
+    return ret;
+}
+
+void hash_index_free(struct hash_index *idx){
+    int i;
+
+    for (i = 0; i < idx->n; i++)
+        free(idx->files[i].path);
+    free(idx->files);
+    free(idx->clusters);
+    memset(idx, 0, sizeof(*idx));
+}
+
+/* compare a file of the volume with a local file of the same size, byte
+ * for byte, reading the volume through its mapping when it has one
+ * returns 1 if they are the same and 0 if not, or if either can't be read
+ */
+static int same_contents(struct fat_volume *vol, const struct hash_file *f, int fd,
+        uint8_t *buffer, uint32_t chunk){
+    uint32_t cs = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint32_t left = f->size, off = 0, addr, len, pos, n;
+    struct fat_extent *ext;
+    const uint8_t *src;
+    uint8_t *image = malloc(chunk);
+    int n_ext = fat_chain_extents(&vol->fat, f->first, &ext), i, same = 1;
+
+    if (n_ext < 0 || !image){
+        free(image);
+        return 0;
+    }
+    for (i = 0; same && i < n_ext && left > 0; i++){
+        addr = bpb_clust_addr(&vol->bpb, ext[i].start);
+        len = ext[i].len * cs < left ? ext[i].len * cs : left;
+        for (pos = 0; same && pos < len; pos += n){
+            n = len - pos < chunk ? len - pos : chunk;
+            if (!(src = vol_ptr(vol, addr + pos, n))){
+                src = image;
+                if (vol_read(vol, addr + pos, image, n) != 0)
+                    same = 0;
+            }
+            if (same && (pread(fd, buffer, n, off) != (ssize_t) n || memcmp(buffer, src, n) != 0))
+                same = 0;
+            off += n;
+        }
+        left -= len;
+    }
+    free(ext);
+    free(image);
+    return same && left == 0;
+}
+
+/* the file of the volume with the same contents as a local file, or NULL
+ * a file whose digest matches is only taken once its bytes are compared
+ */
+const struct hash_file *hash_index_find(struct fat_volume *vol, const struct hash_index *idx, int fd){
+    uint32_t cs = idx->cluster_size, chunk = HASH_BUFFER / cs * cs;
+    const struct hash_file *f = NULL;
+    uint64_t *leaves = NULL, digest;
+    uint8_t *buffer = NULL;
+    struct stat st;
+    int lo = 0, hi = idx->n, i;
+
+    /* an empty file has no clusters to share */
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > UINT32_MAX)
+        return NULL;
+    uint32_t size = st.st_size, n_leaves = (size + cs - 1) / cs, off, n;
+
+    /* the first file of that size */
+    while (lo < hi){
+        int mid = (lo + hi) / 2;
+        if (idx->files[mid].size < size)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == idx->n || idx->files[lo].size != size)
+        return NULL;
+
+    if (chunk == 0)
+        chunk = cs;
+    if (!(leaves = malloc(n_leaves * sizeof(uint64_t))) || !(buffer = malloc(chunk)))
+        goto out;
+
+    /* the first cluster rules out most files of the same size */
+    n = size < cs ? size : cs;
+    if (pread(fd, buffer, n, 0) != (ssize_t) n)
+        goto out;
+    leaves[0] = hash_xxh64(buffer, n, 0);
+    for (i = lo; i < idx->n && idx->files[i].size == size && idx->files[i].head != leaves[0]; i++)
+        ;
+    if (i == idx->n || idx->files[i].size != size)
+        goto out;
+
+    for (off = n; off < size; off += n){
+        n = size - off < chunk ? size - off : chunk;
+        if (pread(fd, buffer, n, off) != (ssize_t) n)
+            goto out;
+        hash_leaves(buffer, n, cs, leaves + off / cs);
+    }
+    digest = hash_file_digest(leaves, n_leaves, size);
+    for (; i < idx->n && idx->files[i].size == size && idx->files[i].head == leaves[0]; i++){
+        if (idx->files[i].digest == digest && same_contents(vol, &idx->files[i], fd, buffer, chunk)){
+            f = &idx->files[i];
+            break;
+        }
+    }
+
+out:
+    free(leaves);
+    free(buffer);
+    return f;
+}
+
+/* the hash command */
+int hash_print(struct fat_volume *vol, int threads, int clusters){
+    struct hash_index idx;
+    uint64_t bytes = 0;
+    double start = now_ms(), end;
+    int i, ret;
+
+    ret = hash_files(vol, threads, &idx);
+    end = now_ms();
+    for (i = 0; i < idx.n; i++){
+        struct hash_file *f = &idx.files[i];
+        bytes += f->size;
+        if (!clusters){
+            fprintf(vol->out, "%016llx  %s\n", (unsigned long long) f->digest, f->path);
+            continue;
+        }
+        /* the chain is walked again only to print it in file order */
+        uint32_t c = f->first, k, n = (f->size + idx.cluster_size - 1) / idx.cluster_size;
+        for (k = 0; k < n && c >= 2 && c < idx.n_clusters; k++, c = fat_cache_next(&vol->fat, c))
+            fprintf(vol->out, "%u\t%016llx\t%s\n", c, (unsigned long long) idx.clusters[c], f->path);
+    }
+    fprintf(stderr, "%d file(s), %llu bytes, %d thread(s): %.3f ms, %.1f MB/s\n",
+            idx.n, (unsigned long long) bytes, threads, end - start,
+            end > start ? bytes / 1048576.0 / ((end - start) / 1000.0) : 0.0);
+    hash_index_free(&idx);
+    return ret;
+}
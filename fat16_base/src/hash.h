@@ -0,0 +1,55 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include "volume.h"
+
+/* Content hashing.
+ * Every cluster of a file (the part of it the file covers) is hashed on
+ * its own with XXH64, and the digest of the file is the XXH64 of its
+ * cluster digests, seeded with its size. Files and the clusters of a big
+ * file can so be hashed independently, and the cluster digests, kept per
+ * cluster number, are the content index of the volume. A local file is
+ * hashed the same way, cut in clusters of the volume's size, so it can be
+ * matched against the index before it is imported.
+ */
+
+struct hash_file {
+    char *path;
+    uint32_t size;
+    uint32_t first; /* first cluster */
+    uint64_t head; /* digest of the first cluster, to rule out most candidates cheaply */
+    uint64_t digest;
+    int failed; /* could not be read, so it has no digest */
+};
+
+struct hash_index {
+    struct hash_file *files; /* by size, then by head */
+    int n, cap;
+    uint64_t *clusters; /* per cluster number: digest of its contents, 0 if it isn't in a file */
+    uint32_t n_clusters;
+    uint32_t cluster_size;
+};
+
+/* XXH64 of a buffer */
+uint64_t hash_xxh64(const void *, size_t, uint64_t);
+
+/* hash every file of the volume on a number of threads; files that could
+ * not be read are left out of the index
+ * returns -1 if a file could not be read
+ */
+int hash_volume(struct fat_volume *, int, struct hash_index *);
+
+void hash_index_free(struct hash_index *);
+
+/* the file of the volume with the same contents as a local file, or NULL
+ * a digest match is confirmed by comparing the bytes of both files; the
+ * local file is read at explicit offsets, so it must be seekable
+ */
+const struct hash_file *hash_index_find(struct fat_volume *, const struct hash_index *, int);
+
+/* the hash command: the digest of every file, or with clusters set the
+ * digest of every cluster of every file, on the volume's output
+ */
+int hash_print(struct fat_volume *, int, int);
+
+#endif
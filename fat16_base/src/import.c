@@ -0,0 +1,377 @@
+#include "import.h"
+#include "alloc.h"
+#include "dir.h"
+#include "hash.h"
+#include "path.h"
+#include "support.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define IMPORT_BUFFER (4 << 20) /* bytes of consecutive clusters written at once */
+#define IMPORT_MAX_DEPTH 64
+#define IMPORT_PATH_MAX 4096
+
+/* one directory or file of the local tree */
+struct import_node {
+    char *src; /* local path */
+    int parent; /* node of the directory holding it, -1 for the top one */
+    int is_dir;
+    uint32_t size; /* bytes of a file, slots used by a directory */
+    uint32_t n_clusters;
+    uint32_t first; /* first cluster, once planned */
+    struct fat_dirtab dt; /* a directory's slots, built in memory */
+};
+
+struct import_ctx {
+    struct fat_volume *vol;
+    struct import_node *nodes; /* in scan order, a directory before its contents */
+    int n, cap;
+    int n_dirs;
+    uint64_t bytes;
+    const struct hash_index *dedup; /* files found in it are left out */
+    int n_same;
+    uint8_t *buf; /* staging buffer: buf_len bytes to be written at buf_addr */
+    uint32_t buf_addr, buf_len;
+};
+
+/* add a node for a local path, counting its slots in its directory
+ * returns the node, or -1
+ */
+static int add_node(struct import_ctx *ctx, const char *src, int parent, int is_dir, off_t size){
+    struct import_node *node;
+    int slots = 0;
+
+    if (parent >= 0 && (slots = dir_name_slots(path_basename(src))) < 0){
+        fprintf(stderr, "Nome inválido: '%s'\n", src);
+        return -1;
+    }
+    if (size > UINT32_MAX){
+        fprintf(stderr, "Arquivo maior que 4 GiB: '%s'\n", src);
+        return -1;
+    }
+    if (ctx->n == ctx->cap){
+        int cap = ctx->cap ? ctx->cap * 2 : 256;
+        struct import_node *tmp = realloc(ctx->nodes, cap * sizeof(*tmp));
+        if (!tmp)
+            return -1;
+        ctx->nodes = tmp;
+        ctx->cap = cap;
+    }
+    node = &ctx->nodes[ctx->n];
+    memset(node, 0, sizeof(*node));
+    if (!(node->src = strdup(src)))
+        return -1;
+    node->parent = parent;
+    node->is_dir = is_dir;
+    node->size = is_dir ? 2 : size; /* a directory starts with "." and ".." */
+    if (parent >= 0)
+        ctx->nodes[parent].size += slots;
+    if (is_dir)
+        ctx->n_dirs++;
+    else
+        ctx->bytes += size;
+    return ctx->n++;
+}
+
+/* a local file has the same contents as a file already on the volume */
+static int is_on_volume(struct import_ctx *ctx, const char *path){
+    const struct hash_file *same = NULL;
+    int fd = open(path, O_RDONLY);
+
+    if (fd >= 0){
+        same = hash_index_find(ctx->vol, ctx->dedup, fd);
+        close(fd);
+    }
+    if (same)
+        fprintf(stderr, "'%s' ignorado: igual a '%s'\n", path, same->path);
+    return same != NULL;
+}
+
+/* add the contents of a directory node, and of the directories below it,
+ * in name order
+ */
+static int scan(struct import_ctx *ctx, int dir, int depth){
+    struct dirent **names;
+    char path[IMPORT_PATH_MAX];
+    struct stat st;
+    int i, n, node, ret = 0;
+
+    if (depth >= IMPORT_MAX_DEPTH){
+        fprintf(stderr, "Árvore profunda demais em '%s'\n", ctx->nodes[dir].src);
+        return -1;
+    }
+    n = scandir(ctx->nodes[dir].src, &names, NULL, alphasort);
+    if (n < 0){
+        perror(ctx->nodes[dir].src);
+        return -1;
+    }
+
+    for (i = 0; i < n; i++){
+        const char *name = names[i]->d_name;
+        if (ret != 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        if (snprintf(path, sizeof(path), "%s/%s", ctx->nodes[dir].src, name) >= (int) sizeof(path) ||
+                stat(path, &st) != 0){
+            fprintf(stderr, "Erro ao ler '%s'\n", path);
+            ret = -1;
+        } else if (S_ISDIR(st.st_mode)){
+            if ((node = add_node(ctx, path, dir, 1, 0)) < 0 || scan(ctx, node, depth + 1) != 0)
+                ret = -1;
+        } else if (S_ISREG(st.st_mode)){
+            if (ctx->dedup && is_on_volume(ctx, path))
+                ctx->n_same++;
+            else if (add_node(ctx, path, dir, 0, st.st_size) < 0)
+                ret = -1;
+        } else {
+            fprintf(stderr, "'%s' ignorado: não é um arquivo nem um diretório\n", path);
+        }
+    }
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+/* carve the clusters of every node out of free runs, directories first
+ * each run asked for is as long as everything still to place, so the
+ * allocator hands out the lowest run that holds all of it when there is one
+ * returns -1 if the volume doesn't have room
+ */
+static int plan(struct import_ctx *ctx){
+    struct fat_cache *fat = &ctx->vol->fat;
+    uint32_t cluster_size = ctx->vol->bpb.bytes_p_sect * ctx->vol->bpb.sector_p_clust;
+    uint32_t run = 0, run_len = 0, left = 0, need, take, tail;
+    int pass, i;
+
+    for (i = 0; i < ctx->n; i++){
+        struct import_node *node = &ctx->nodes[i];
+        uint64_t bytes = node->is_dir ? (uint64_t) node->size * sizeof(struct fat_dir) : node->size;
+        node->n_clusters = (bytes + cluster_size - 1) / cluster_size;
+        left += node->n_clusters;
+    }
+    if (left > fat->n_free){
+        fprintf(stderr, "Espaço insuficiente: %u cluster(s) necessários, %u livres\n", left, fat->n_free);
+        return -1;
+    }
+
+    for (pass = 1; pass >= 0; pass--){
+        for (i = 0; i < ctx->n; i++){
+            struct import_node *node = &ctx->nodes[i];
+            if (node->is_dir != pass || node->n_clusters == 0)
+                continue;
+
+            /* a run comes linked as one chain: it is cut after each node */
+            for (need = node->n_clusters, tail = 0; need > 0; need -= take){
+                if (run_len == 0 && (run = fat_alloc_run(fat, left, &run_len)) == 0){
+                    if (tail)
+                        fat_cache_set(fat, tail, FAT_EOF);
+                    fprintf(stderr, "Erro ao encontrar clusters livres\n");
+                    return -1;
+                }
+                take = need < run_len ? need : run_len;
+                if (tail)
+                    fat_cache_set(fat, tail, run);
+                else
+                    node->first = run;
+                tail = run + take - 1;
+                run += take;
+                run_len -= take;
+                left -= take;
+            }
+            fat_cache_set(fat, tail, FAT_EOF);
+        }
+    }
+    return 0;
+}
+
+/* build the slots of every new directory in memory
+ * the entries get their final clusters and sizes, so nothing has to be
+ * patched after the data is written
+ */
+static int build_dirs(struct import_ctx *ctx, uint32_t top_parent){
+    int i, first;
+
+    for (i = 0; i < ctx->n; i++){
+        struct import_node *node = &ctx->nodes[i];
+        uint32_t parent = node->parent >= 0 ? ctx->nodes[node->parent].first : top_parent;
+        if (node->is_dir && dirtab_create(ctx->vol, node->first, parent, &node->dt) != 0)
+            return -1;
+    }
+    for (i = 0; i < ctx->n; i++){
+        struct import_node *node = &ctx->nodes[i];
+        struct fat_dir entry = {0};
+        if (node->parent < 0)
+            continue;
+
+        struct fat_dirtab *dt = &ctx->nodes[node->parent].dt;
+        const char *name = path_basename(node->src);
+        if (dirtab_find(dt, name) >= 0){
+            fprintf(stderr, "'%s' repete um nome (sem diferenciar maiúsculas)\n", node->src);
+            return -1;
+        }
+        entry.attr = node->is_dir ? DIR_ATTR_DIRECTORY : 0;
+        entry.starting_cluster = node->first;
+        entry.file_size = node->is_dir ? 0 : node->size;
+        if (dirtab_place(dt, name, &entry, &first) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* write out the staging buffer */
+static int stage_flush(struct import_ctx *ctx){
+    int ret = 0;
+
+    if (ctx->buf_len > 0)
+        ret = vol_write(ctx->vol, ctx->buf_addr, ctx->buf, ctx->buf_len);
+    ctx->buf_len = 0;
+    return ret;
+}
+
+/* read len bytes from a file into the staging buffer, to land at an image
+ * address; the buffer is written out first when it is full or the address
+ * doesn't follow what it holds (a gap of less than a cluster, the unused
+ * end of the previous file, is filled with zeros instead)
+ */
+static int stage(struct import_ctx *ctx, int fd, uint32_t addr, uint32_t len){
+    uint32_t cluster_size = ctx->vol->bpb.bytes_p_sect * ctx->vol->bpb.sector_p_clust;
+    uint32_t end, chunk;
+    ssize_t n;
+
+    while (len > 0){
+        end = ctx->buf_addr + ctx->buf_len;
+        if (ctx->buf_len > 0 && addr != end){
+            if (addr > end && addr - end < cluster_size && addr - end <= IMPORT_BUFFER - ctx->buf_len){
+                memset(ctx->buf + ctx->buf_len, 0, addr - end);
+                ctx->buf_len += addr - end;
+            } else if (stage_flush(ctx) != 0){
+                return -1;
+            }
+        }
+        if (ctx->buf_len == IMPORT_BUFFER && stage_flush(ctx) != 0)
+            return -1;
+        if (ctx->buf_len == 0)
+            ctx->buf_addr = addr;
+
+        chunk = IMPORT_BUFFER - ctx->buf_len < len ? IMPORT_BUFFER - ctx->buf_len : len;
+        n = read(fd, ctx->buf + ctx->buf_len, chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        ctx->buf_len += n;
+        addr += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* stream the data of every file, in the order of its clusters */
+static int write_files(struct import_ctx *ctx){
+    struct fat_volume *vol = ctx->vol;
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    struct fat_extent *ext;
+    uint64_t start = stats_clock(vol->stats);
+    int i, j, n_ext, fd, ret;
+
+    for (i = 0; i < ctx->n; i++){
+        struct import_node *node = &ctx->nodes[i];
+        uint32_t left = node->size;
+        if (node->is_dir || node->size == 0)
+            continue;
+
+        if ((fd = open(node->src, O_RDONLY)) < 0){
+            perror(node->src);
+            return -1;
+        }
+        n_ext = fat_chain_extents(&vol->fat, node->first, &ext);
+        for (j = 0, ret = n_ext > 0 ? 0 : -1; ret == 0 && j < n_ext && left > 0; j++){
+            uint32_t bytes = ext[j].len * cluster_size < left ? ext[j].len * cluster_size : left;
+            ret = stage(ctx, fd, bpb_clust_addr(&vol->bpb, ext[j].start), bytes);
+            left -= bytes;
+        }
+        if (n_ext > 0)
+            free(ext);
+        close(fd);
+        if (ret != 0){
+            fprintf(stderr, "Erro ao ler '%s' (o arquivo mudou?)\n", node->src);
+            return -1;
+        }
+    }
+    ret = stage_flush(ctx);
+    stats_phase(vol->stats, STATS_DATA_COPY, start);
+    return ret;
+}
+
+/* copy a local directory tree into a new directory at a path of the image */
+int put_tree(struct fat_volume *vol, const char *src, const char *dest, const struct hash_index *dedup){
+    struct import_ctx ctx;
+    struct fat_dirtab *parent;
+    struct fat_dir top = {0};
+    struct stat st;
+    double start = now_ms(), planned;
+    int i, ret = -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.vol = vol;
+    ctx.dedup = dedup;
+    if (stat(src, &st) != 0 || !S_ISDIR(st.st_mode)){
+        fprintf(stderr, "'%s' não é um diretório\n", src);
+        return -1;
+    }
+    if (path_lookup(vol, dest, &parent) >= 0){
+        fprintf(stderr, "Arquivo '%s' já existe na imagem\n", dest);
+        return -1;
+    }
+    if (!parent){
+        fprintf(stderr, "Diretório de '%s' não encontrado\n", dest);
+        return -1;
+    }
+
+    if (add_node(&ctx, src, -1, 1, 0) == 0 && scan(&ctx, 0, 0) == 0 && plan(&ctx) == 0){
+        planned = now_ms();
+        if ((ctx.buf = malloc(IMPORT_BUFFER)) && build_dirs(&ctx, parent->cluster) == 0 &&
+                write_files(&ctx) == 0){
+            /* the metadata goes last: every directory, then the entry that
+             * makes the tree reachable */
+            for (ret = 0, i = 0; ret == 0 && i < ctx.n; i++){
+                if (ctx.nodes[i].is_dir)
+                    ret = dirtab_write_all(vol, &ctx.nodes[i].dt);
+            }
+            top.attr = DIR_ATTR_DIRECTORY;
+            top.starting_cluster = ctx.nodes[0].first;
+            if (ret == 0 && dirtab_add(vol, parent, dest, &top) < 0)
+                ret = -1;
+        }
+    }
+
+    if (ret != 0){
+        for (i = 0; i < ctx.n; i++){
+            if (ctx.nodes[i].first)
+                fat_cache_free_chain(&vol->fat, ctx.nodes[i].first);
+        }
+    } else {
+        double end = now_ms();
+        printf("Diretório '%s' importado em '%s': %d arquivo(s), %d diretório(s), %llu bytes\n",
+                src, dest, ctx.n - ctx.n_dirs, ctx.n_dirs, (unsigned long long) ctx.bytes);
+        if (ctx.n_same > 0)
+            printf("%d arquivo(s) já presentes na imagem ignorados\n", ctx.n_same);
+        fprintf(stderr, "%d file(s), %llu bytes: %.3f ms (%.3f ms planning), %.1f MB/s\n",
+                ctx.n - ctx.n_dirs, (unsigned long long) ctx.bytes, end - start, planned - start,
+                end > start ? ctx.bytes / 1048576.0 / ((end - start) / 1000.0) : 0.0);
+    }
+
+    for (i = 0; i < ctx.n; i++){
+        if (ctx.nodes[i].is_dir)
+            dirtab_destroy(&ctx.nodes[i].dt);
+        free(ctx.nodes[i].src);
+    }
+    free(ctx.nodes);
+    free(ctx.buf);
+    return ret;
+}
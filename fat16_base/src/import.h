@@ -0,0 +1,26 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#include "volume.h"
+
+/* Bulk import of a local directory tree (put -r).
+ * The whole tree is scanned and sized before anything is written. The
+ * clusters of every directory and file are then carved, in one pass, out
+ * of as few free runs as possible: directories first, then the files in
+ * the order they were scanned, so the file data forms one sequential
+ * region. The data is streamed in that order through a large staging
+ * buffer, with small files sharing a write. The directory slots are built
+ * in memory and written last, one write per directory, and the FAT goes
+ * out with the usual flush of its dirty sectors.
+ */
+
+struct hash_index;
+
+/* copy a local directory tree into a new directory at a path of the image
+ * files with the same contents as one in the dedup index (if not NULL) are
+ * left out
+ * returns -1 if the tree could not be imported (nothing is left allocated)
+ */
+int put_tree(struct fat_volume *, const char *, const char *, const struct hash_index *);
+
+#endif
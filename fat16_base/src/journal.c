@@ -0,0 +1,317 @@
+#include "journal.h"
+#include "alloc.h"
+#include "volume.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "FATJRNL1"
+
+/* on disk: the header, then n records of a sector number and its data */
+struct journal_head {
+    char magic[8];
+    uint32_t sect_size;
+    uint32_t n;
+    uint64_t seq;
+    uint64_t sum; /* FNV-1a over the records */
+};
+
+/* FNV-1a over a buffer, continuing from h */
+static uint64_t fnv64(uint64_t h, const uint8_t *p, size_t len){
+    while (len--){
+        h ^= *p++;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+/* get everything written to the image so far onto stable storage */
+static int sync_image(struct fat_volume *vol){
+    if (vol->cache && bcache_flush(vol->cache) != 0)
+        return -1;
+    if (vol->map && msync(vol->map, vol->size, MS_SYNC) != 0)
+        return -1;
+    if (fflush(vol->fp) != 0)
+        return -1;
+    return fdatasync(vol->fd) == 0 ? 0 : -1;
+}
+
+/* the journal file of an image, in a malloc'ed string */
+static char *journal_path(const char *image){
+    size_t len = strlen(image) + sizeof(".journal");
+    char *path = malloc(len);
+
+    if (path)
+        snprintf(path, len, "%s.journal", image);
+    return path;
+}
+
+/* index of the first record at or after a sector (binary search) */
+static uint32_t rec_lower(struct fat_journal *j, uint32_t sector){
+    uint32_t lo = 0, hi = j->n;
+
+    while (lo < hi){
+        uint32_t mid = (lo + hi) / 2;
+        if (j->recs[mid].sector < sector)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* drop every pending record */
+static void rec_clear(struct fat_journal *j){
+    uint32_t i;
+
+    for (i = 0; i < j->n; i++)
+        free(j->recs[i].data);
+    j->n = 0;
+}
+
+/* replay or discard the journal left next to an image, if there is one
+ * a journal is applied only if it is whole (its checksum matches); a torn
+ * one (short, or with a wrong checksum) belongs to a transaction that never
+ * committed, and the image still holds the state before it
+ * returns -1 if the journal could not be read or a complete one applied;
+ * the journal is kept then, for the next open to try again
+ */
+int journal_recover(struct fat_volume *vol, const char *image){
+    struct journal_head head;
+    struct stat st;
+    char *path = journal_path(image);
+    uint8_t *buff = NULL;
+    ssize_t got;
+    uint32_t i;
+    int fd, ret = 0;
+
+    if (!path)
+        return -1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0){
+        free(path);
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    got = pread(fd, &head, sizeof(head), 0);
+    if (got < 0 || fstat(fd, &st) != 0){
+        perror(path);
+        ret = -1;
+    } else if (got == sizeof(head) && memcmp(head.magic, JOURNAL_MAGIC, 8) == 0 &&
+            head.sect_size > 0 && head.n > 0){
+        size_t rec = 4 + head.sect_size;
+        size_t size = (size_t) head.n * rec;
+
+        if ((uint64_t) st.st_size < sizeof(head) + (uint64_t) head.n * rec){
+            fprintf(stderr, "Journal incompleto descartado\n");
+        } else if (!(buff = malloc(size)) ||
+                pread(fd, buff, size, sizeof(head)) != (ssize_t) size){
+            fprintf(stderr, "Erro ao ler o journal %s\n", path);
+            ret = -1;
+        } else if (fnv64(14695981039346656037ull, buff, size) != head.sum){
+            fprintf(stderr, "Journal incompleto descartado\n");
+        } else {
+            for (i = 0; ret == 0 && i < head.n; i++){
+                uint32_t sector;
+                memcpy(&sector, buff + i * rec, 4);
+                ret = vol_write(vol, sector * head.sect_size, buff + i * rec + 4, head.sect_size);
+            }
+            if (ret == 0)
+                ret = sync_image(vol);
+            fprintf(stderr, "Journal: %u setor(es) da transação %llu %s\n", head.n,
+                    (unsigned long long) head.seq, ret == 0 ? "reaplicados" : "não reaplicados");
+        }
+    }
+
+    free(buff);
+    close(fd);
+    if (ret == 0)
+        unlink(path);
+    free(path);
+    return ret;
+}
+
+/* start journaling the metadata writes of a volume
+ * the journal file is created next to the image and stays empty between
+ * transactions
+ */
+int journal_open(struct fat_volume *vol, const char *image){
+    struct fat_journal *j = calloc(1, sizeof(*j));
+
+    if (!j || !(j->path = journal_path(image))){
+        free(j);
+        return -1;
+    }
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (j->fd < 0){
+        perror(j->path);
+        free(j->path);
+        free(j);
+        return -1;
+    }
+    j->sect_size = vol->bpb.bytes_p_sect;
+    vol->journal = j;
+    /* a freed cluster may only be reused once the free is committed */
+    vol->fat.hold = 1;
+    return 0;
+}
+
+/* add a metadata write to the open transaction
+ * the write is split into sectors; a sector seen for the first time is read
+ * from the image before the new bytes are put over it
+ * returns -1 if memory could not be allocated or the image read
+ */
+int journal_write(struct fat_volume *vol, uint32_t offset, const void *buff, uint32_t len){
+    struct fat_journal *j = vol->journal;
+    const uint8_t *src = buff;
+
+    while (len > 0){
+        uint32_t sector = offset / j->sect_size;
+        uint32_t at = offset % j->sect_size;
+        uint32_t chunk = j->sect_size - at < len ? j->sect_size - at : len;
+        uint32_t i = rec_lower(j, sector);
+
+        if (i == j->n || j->recs[i].sector != sector){
+            uint8_t *data = malloc(j->sect_size);
+            if (!data)
+                return -1;
+            if (chunk < j->sect_size && vol_read(vol, sector * j->sect_size, data, j->sect_size) != 0){
+                free(data);
+                return -1;
+            }
+            if (j->n == j->cap){
+                uint32_t cap = j->cap ? j->cap * 2 : 64;
+                struct journal_rec *tmp = realloc(j->recs, cap * sizeof(*tmp));
+                if (!tmp){
+                    free(data);
+                    return -1;
+                }
+                j->recs = tmp;
+                j->cap = cap;
+            }
+            memmove(j->recs + i + 1, j->recs + i, (j->n - i) * sizeof(*j->recs));
+            j->recs[i].sector = sector;
+            j->recs[i].data = data;
+            j->n++;
+        }
+        memcpy(j->recs[i].data + at, src, chunk);
+
+        src += chunk;
+        offset += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* put the pending sectors over len bytes read at an image offset */
+void journal_overlay(struct fat_journal *j, uint32_t offset, void *buff, uint32_t len){
+    uint64_t end = (uint64_t) offset + len;
+    uint32_t i;
+
+    if (!j || j->n == 0 || len == 0)
+        return;
+    for (i = rec_lower(j, offset / j->sect_size); i < j->n; i++){
+        uint64_t start = (uint64_t) j->recs[i].sector * j->sect_size;
+        if (start >= end)
+            break;
+        uint64_t from = start > offset ? start : offset;
+        uint64_t to = start + j->sect_size < end ? start + j->sect_size : end;
+        memcpy((uint8_t *) buff + (from - offset), j->recs[i].data + (from - start), to - from);
+    }
+}
+
+/* whether a range of the image has pending sectors */
+int journal_overlaps(struct fat_journal *j, uint32_t offset, uint32_t len){
+    uint32_t i;
+
+    if (!j || j->n == 0 || len == 0)
+        return 0;
+    i = rec_lower(j, offset / j->sect_size);
+    return i < j->n && (uint64_t) j->recs[i].sector * j->sect_size < (uint64_t) offset + len;
+}
+
+/* make the open transaction durable and apply it to the image
+ * the file data is synced first, so committed metadata never points at
+ * data that isn't there; the transaction then takes one write and one
+ * fsync of the journal, however many operations it holds
+ * returns -1 if the journal or the image could not be written
+ */
+int journal_commit(struct fat_volume *vol){
+    struct fat_journal *j = vol->journal;
+    struct journal_head head;
+    size_t rec, size;
+    uint8_t *buff;
+    uint32_t i;
+
+    if (!j)
+        return 0;
+    if (j->n == 0){
+        fat_alloc_release(&vol->fat);
+        return 0;
+    }
+    if (sync_image(vol) != 0)
+        return -1;
+
+    rec = 4 + j->sect_size;
+    size = sizeof(head) + j->n * rec;
+    if (!(buff = malloc(size)))
+        return -1;
+    for (i = 0; i < j->n; i++){
+        memcpy(buff + sizeof(head) + i * rec, &j->recs[i].sector, 4);
+        memcpy(buff + sizeof(head) + i * rec + 4, j->recs[i].data, j->sect_size);
+    }
+    memcpy(head.magic, JOURNAL_MAGIC, 8);
+    head.sect_size = j->sect_size;
+    head.n = j->n;
+    head.seq = j->seq;
+    head.sum = fnv64(14695981039346656037ull, buff + sizeof(head), size - sizeof(head));
+    memcpy(buff, &head, sizeof(head));
+
+    if (pwrite(j->fd, buff, size, 0) != (ssize_t) size || fdatasync(j->fd) != 0){
+        fprintf(stderr, "Erro ao gravar o journal\n");
+        free(buff);
+        return -1;
+    }
+    free(buff);
+
+    /* committed: the clusters it frees can take new data, and the records
+     * are applied in sector order and dropped */
+    fat_alloc_release(&vol->fat);
+    for (i = 0; i < j->n; i++){
+        if (vol_write(vol, j->recs[i].sector * j->sect_size, j->recs[i].data, j->sect_size) != 0)
+            return -1;
+    }
+    rec_clear(j);
+    j->seq++;
+
+    /* once the image has it, the journal is no longer needed */
+    if (sync_image(vol) != 0)
+        return -1;
+    return ftruncate(j->fd, 0) == 0 ? 0 : -1;
+}
+
+/* commit what is pending and remove the journal
+ * the journal file is kept if the last commit failed, so the next open
+ * can replay it
+ */
+int journal_close(struct fat_volume *vol){
+    struct fat_journal *j = vol->journal;
+    int ret;
+
+    if (!j)
+        return 0;
+    ret = journal_commit(vol);
+    close(j->fd);
+    if (ret == 0)
+        unlink(j->path);
+    rec_clear(j);
+    free(j->recs);
+    free(j->path);
+    free(j);
+    vol->journal = NULL;
+    return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "fat16.h"
+
+/* Write-ahead metadata journal.
+ * With a journal, FAT and directory writes don't go to the image: the
+ * sectors they touch are collected in memory as one transaction, and reads
+ * of the image see them through an overlay. A commit syncs the file data
+ * already written, writes the whole transaction to the sidecar file
+ * <image>.journal with one sequential write and one fsync, and only then
+ * copies the sectors into the image. Clusters the open transaction frees
+ * are held back from the allocator until it commits, so no new data lands
+ * in them while the committed metadata still points there. A journal left
+ * behind by a crash is replayed when the image is opened again if it is
+ * complete, and discarded if it was torn.
+ */
+struct journal_rec {
+    uint32_t sector;
+    uint8_t *data; /* the sector as it will be written */
+};
+
+struct fat_journal {
+    int fd; /* the sidecar file */
+    char *path;
+    uint32_t sect_size;
+    struct journal_rec *recs; /* the open transaction */
+    uint32_t n, cap;
+    uint64_t seq; /* transactions committed */
+};
+
+struct fat_volume;
+
+/* replay or discard the journal left next to an image, if there is one
+ * returns -1 if a complete journal could not be applied
+ */
+int journal_recover(struct fat_volume *, const char *);
+
+/* start journaling the metadata writes of a volume */
+int journal_open(struct fat_volume *, const char *);
+
+/* add a metadata write to the open transaction */
+int journal_write(struct fat_volume *, uint32_t, const void *, uint32_t);
+
+/* put the pending sectors over len bytes read at an image offset */
+void journal_overlay(struct fat_journal *, uint32_t, void *, uint32_t);
+
+/* whether a range of the image has pending sectors */
+int journal_overlaps(struct fat_journal *, uint32_t, uint32_t);
+
+/* make the open transaction durable and apply it to the image */
+int journal_commit(struct fat_volume *);
+
+/* commit what is pending and remove the journal */
+int journal_close(struct fat_volume *);
+
+#endif
@@ -0,0 +1,335 @@
+#include "lfn.h"
+#include <string.h>
+
+#define LFN_ORD_MASK 0x3f
+
+/* characters 8.3 names can't hold; anything below 0x20 can't either */
+static const char *short_invalid = "\"*+,./:;<=>?[\\]|";
+
+/* the 13 characters of a slot, in order */
+static void slot_get(const struct fat_lfn *s, uint16_t *out){
+    memcpy(out, s->name1, sizeof(s->name1));
+    memcpy(out + 5, s->name2, sizeof(s->name2));
+    memcpy(out + 11, s->name3, sizeof(s->name3));
+}
+
+/* store 13 characters in a slot */
+static void slot_put(struct fat_lfn *s, const uint16_t *in){
+    memcpy(s->name1, in, sizeof(s->name1));
+    memcpy(s->name2, in + 5, sizeof(s->name2));
+    memcpy(s->name3, in + 11, sizeof(s->name3));
+}
+
+/* characters used in the last part of a name: up to the terminator */
+static int part_len(const uint16_t *chars){
+    int i;
+
+    for (i = 0; i < LFN_CHARS; i++){
+        if (chars[i] == 0x0000 || chars[i] == 0xFFFF)
+            break;
+    }
+    return i;
+}
+
+/* checksum of a padded 8.3 name, as stored in its long name slots */
+uint8_t lfn_checksum(const unsigned char *name){
+    uint8_t sum = 0;
+    int i;
+
+    for (i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+    return sum;
+}
+
+/* fold a character for case-insensitive matching
+ * ASCII and Latin-1 letters are folded to upper case, like the 8.3 names
+ */
+uint16_t lfn_fold(uint16_t c){
+    if (c >= 'a' && c <= 'z')
+        return c - 0x20;
+    if (c >= 0xE0 && c <= 0xFE && c != 0xF7)
+        return c - 0x20;
+    if (c == 0xFF)
+        return 0x178;
+    return c;
+}
+
+/* convert UTF-8 to UCS-2, at most max characters
+ * characters outside the BMP can't be stored in a long name
+ * returns the length, or -1 if the text is invalid or too long
+ */
+int utf8_to_ucs2(const char *in, uint16_t *out, int max){
+    const unsigned char *p = (const unsigned char *) in;
+    uint32_t c;
+    int n = 0, extra;
+
+    while (*p){
+        if (n == max)
+            return -1;
+        if (*p < 0x80){
+            c = *p++;
+            extra = 0;
+        } else if ((*p & 0xE0) == 0xC0){
+            c = *p++ & 0x1F;
+            extra = 1;
+        } else if ((*p & 0xF0) == 0xE0){
+            c = *p++ & 0x0F;
+            extra = 2;
+        } else {
+            return -1;
+        }
+        while (extra--){
+            if ((*p & 0xC0) != 0x80)
+                return -1;
+            c = (c << 6) | (*p++ & 0x3F);
+        }
+        if (c >= 0xD800 && c <= 0xDFFF)
+            return -1;
+        out[n++] = c;
+    }
+    return n;
+}
+
+/* convert n UCS-2 characters to UTF-8; out must hold LFN_UTF8_MAX bytes */
+char *ucs2_to_utf8(const uint16_t *in, int n, char *out){
+    char *p = out;
+    int i;
+
+    for (i = 0; i < n; i++){
+        uint16_t c = in[i];
+        if (c < 0x80){
+            *p++ = c;
+        } else if (c < 0x800){
+            *p++ = 0xC0 | (c >> 6);
+            *p++ = 0x80 | (c & 0x3F);
+        } else {
+            *p++ = 0xE0 | (c >> 12);
+            *p++ = 0x80 | ((c >> 6) & 0x3F);
+            *p++ = 0x80 | (c & 0x3F);
+        }
+    }
+    *p = '\0';
+    return out;
+}
+
+/* forget any long name collected so far */
+void lfn_acc_reset(struct lfn_acc *acc){
+    acc->len = 0;
+    acc->n_slots = 0;
+    acc->next = 0;
+    acc->complete = 0;
+}
+
+/* add the next slot; anything out of order restarts the collection
+ * a slot with the last part flag always starts a new name
+ */
+void lfn_acc_push(struct lfn_acc *acc, const struct fat_dir *dir){
+    const struct fat_lfn *s = (const struct fat_lfn *) dir;
+    int ord = s->ord & LFN_ORD_MASK;
+    uint16_t chars[LFN_CHARS];
+
+    if (ord == 0 || ord > LFN_MAX_SLOTS){
+        lfn_acc_reset(acc);
+        return;
+    }
+    slot_get(s, chars);
+
+    if (s->ord & LFN_LAST){
+        lfn_acc_reset(acc);
+        acc->n_slots = ord;
+        acc->checksum = s->checksum;
+        acc->len = (ord - 1) * LFN_CHARS + part_len(chars);
+        if (acc->len == 0 || acc->len > LFN_MAX){
+            lfn_acc_reset(acc);
+            return;
+        }
+    } else if (acc->complete || ord != acc->next || s->checksum != acc->checksum){
+        lfn_acc_reset(acc);
+        return;
+    }
+
+    memcpy(acc->name + (ord - 1) * LFN_CHARS, chars, sizeof(chars));
+    acc->next = ord - 1;
+    acc->complete = ord == 1;
+}
+
+/* the length of the collected long name if it is complete and belongs to
+ * the 8.3 entry given, or 0; the collection is reset either way
+ */
+int lfn_acc_finish(struct lfn_acc *acc, const struct fat_dir *dir){
+    int len = 0;
+
+    if (acc->complete && lfn_checksum(dir->name) == acc->checksum)
+        len = acc->len;
+    acc->next = 0;
+    acc->complete = 0;
+    return len;
+}
+
+/* the long name stored before the entry at ents[slot], looking back at most
+ * lead slots; part i of the name must be the i-th slot before the entry
+ * returns the length of the name, or 0 if it has none
+ */
+int lfn_before(const struct fat_dir *ents, uint32_t slot, uint32_t lead, uint16_t *name, int *n_slots){
+    const struct fat_dir *dir = ents + slot;
+    uint8_t sum = lfn_checksum(dir->name);
+    uint16_t chars[LFN_CHARS];
+    uint32_t i;
+
+    /* lead may reach before ents, into slots the caller kept there */
+    for (i = 1; i <= lead && i <= LFN_MAX_SLOTS; i++){
+        const struct fat_lfn *s = (const struct fat_lfn *) (dir - i);
+        if (s->attr != DIR_ATTR_LFN || s->ord == DIR_FREE_ENTRY ||
+                (s->ord & LFN_ORD_MASK) != i || s->checksum != sum)
+            return 0;
+        slot_get(s, chars);
+        memcpy(name + (i - 1) * LFN_CHARS, chars, sizeof(chars));
+        if (s->ord & LFN_LAST){
+            int len = (i - 1) * LFN_CHARS + part_len(chars);
+            if (len > LFN_MAX)
+                return 0;
+            *n_slots = i;
+            return len;
+        }
+    }
+    return 0;
+}
+
+/* the long name of the entry at ents[slot] in UTF-8, or NULL */
+const char *lfn_name(const struct fat_dir *ents, uint32_t slot, uint32_t lead, char *out){
+    uint16_t name[LFN_MAX_SLOTS * LFN_CHARS];
+    int n_slots;
+    int len = lfn_before(ents, slot, lead, name, &n_slots);
+
+    return len > 0 ? ucs2_to_utf8(name, len, out) : NULL;
+}
+
+/* a character that can be part of a 8.3 name */
+static int short_char(uint16_t c){
+    return c > 0x20 && c < 0x7F && !strchr(short_invalid, c);
+}
+
+/* a name that can be stored as a plain 8.3 name (in any case):
+ * 1 to 8 characters, optionally a dot and 1 to 3 more, none of them invalid
+ */
+int lfn_fits_short(const char *name){
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t) (dot - name) : strlen(name);
+    size_t ext = dot ? strlen(dot + 1) : 0;
+    const char *p;
+
+    if (base == 0 || base > 8 || ext > 3 || (dot && ext == 0))
+        return 0;
+    for (p = name; *p; p++){
+        if (p != dot && !short_char((unsigned char) *p))
+            return 0;
+    }
+    return 1;
+}
+
+/* the 8.3 basis of a long name: upper case, no blanks or leading dots,
+ * other invalid characters as '_'; the extension is what follows the last
+ * dot
+ * returns 1 if a numeric tail is needed (something was lost or the name
+ * was too long)
+ */
+int lfn_basis(const uint16_t *name, int len, unsigned char *out){
+    int i, n, start = 0, dot = -1, lossy = 0;
+
+    memset(out, ' ', 11);
+    while (start < len && name[start] == '.'){
+        start++;
+        lossy = 1;
+    }
+    for (i = len - 1; i >= start; i--){
+        if (name[i] == '.'){
+            dot = i;
+            break;
+        }
+    }
+
+    for (i = start, n = 0; i < (dot >= 0 ? dot : len); i++){
+        uint16_t c = lfn_fold(name[i]);
+        if (c == ' ' || c == '.'){
+            lossy = 1;
+            continue;
+        }
+        if (n == 8){
+            lossy = 1;
+            break;
+        }
+        if (!short_char(c)){
+            c = '_';
+            lossy = 1;
+        }
+        out[n++] = c;
+    }
+    if (n == 0){
+        out[n++] = '_';
+        lossy = 1;
+    }
+
+    for (i = dot + 1, n = 8; dot >= 0 && i < len; i++){
+        uint16_t c = lfn_fold(name[i]);
+        if (c == ' '){
+            lossy = 1;
+            continue;
+        }
+        if (n == 11){
+            lossy = 1;
+            break;
+        }
+        if (!short_char(c)){
+            c = '_';
+            lossy = 1;
+        }
+        out[n++] = c;
+    }
+    return lossy;
+}
+
+/* put the numeric tail ~n on a 8.3 basis, shortening the base if needed */
+void lfn_tail(const unsigned char *basis, uint32_t n, unsigned char *out){
+    char tail[12];
+    int len = snprintf(tail, sizeof(tail), "~%u", n);
+    int base = 0;
+
+    while (base < 8 && basis[base] != ' ')
+        base++;
+    if (base > 8 - len)
+        base = 8 - len;
+
+    memset(out, ' ', 8);
+    memcpy(out, basis, base);
+    memcpy(out + base, tail, len);
+    memcpy(out + 8, basis + 8, 3);
+}
+
+/* the slots of a long name for a 8.3 name, in disk order: the last part
+ * first, its unused characters after the terminator set to 0xFFFF
+ * returns the number of slots written to out
+ */
+int lfn_make(const uint16_t *name, int len, const unsigned char *short_name, struct fat_dir *out){
+    int n_slots = (len + LFN_CHARS - 1) / LFN_CHARS;
+    uint8_t sum = lfn_checksum(short_name);
+    uint16_t chars[LFN_CHARS];
+    int part, i;
+
+    for (part = n_slots; part >= 1; part--){
+        struct fat_lfn *s = (struct fat_lfn *) &out[n_slots - part];
+        int first = (part - 1) * LFN_CHARS;
+
+        for (i = 0; i < LFN_CHARS; i++){
+            if (first + i < len)
+                chars[i] = name[first + i];
+            else
+                chars[i] = first + i == len ? 0x0000 : 0xFFFF;
+        }
+        memset(s, 0, sizeof(*s));
+        s->ord = part | (part == n_slots ? LFN_LAST : 0);
+        s->attr = DIR_ATTR_LFN;
+        s->checksum = sum;
+        slot_put(s, chars);
+    }
+    return n_slots;
+}
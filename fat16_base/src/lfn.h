@@ -0,0 +1,81 @@
+#ifndef LFN_H
+#define LFN_H
+
+#include "fat16.h"
+#include <stddef.h>
+
+#define LFN_UTF8_MAX (LFN_MAX * 3 + 1) /* bytes of a long name in UTF-8 */
+
+/* VFAT long names.
+ * Names are kept as UCS-2, the way they are stored in the slots, and
+ * converted from and to UTF-8 at the edges. A long name only counts when
+ * its slots are complete, in order, and carry the checksum of the 8.3
+ * entry right after them; anything else is an orphan and is ignored.
+ */
+
+/* Collects the slots of a long name in disk order (last part first) and
+ * checks them against the 8.3 entry that follows.
+ */
+struct lfn_acc {
+    uint16_t name[LFN_MAX_SLOTS * LFN_CHARS + 1];
+    int len; /* characters, set by the last part */
+    int n_slots; /* slots of the name */
+    int next; /* part expected next: 0 when nothing is being collected */
+    int complete; /* part 1 is in, only the 8.3 entry is missing */
+    uint8_t checksum;
+};
+
+/* checksum of a padded 8.3 name, as stored in its long name slots */
+uint8_t lfn_checksum(const unsigned char *);
+
+/* fold a character for case-insensitive matching */
+uint16_t lfn_fold(uint16_t);
+
+/* convert UTF-8 to UCS-2, at most max characters
+ * returns the length, or -1 if the text is invalid or too long
+ */
+int utf8_to_ucs2(const char *, uint16_t *, int);
+
+/* convert n UCS-2 characters to UTF-8; out must hold LFN_UTF8_MAX bytes */
+char *ucs2_to_utf8(const uint16_t *, int, char *);
+
+/* forget any long name collected so far */
+void lfn_acc_reset(struct lfn_acc *);
+
+/* add the next slot; anything out of order restarts the collection */
+void lfn_acc_push(struct lfn_acc *, const struct fat_dir *);
+
+/* the length of the collected long name if it is complete and belongs to
+ * the 8.3 entry given, or 0; the collection is reset either way
+ */
+int lfn_acc_finish(struct lfn_acc *, const struct fat_dir *);
+
+/* the long name stored before the entry at ents[slot], looking back at most
+ * lead slots, in name; the number of its slots is stored in n_slots
+ * returns the length of the name, or 0 if it has none
+ */
+int lfn_before(const struct fat_dir *, uint32_t, uint32_t, uint16_t *, int *);
+
+/* the long name of the entry at ents[slot] in UTF-8, or NULL; out must hold
+ * LFN_UTF8_MAX bytes
+ */
+const char *lfn_name(const struct fat_dir *, uint32_t, uint32_t, char *);
+
+/* a name that can be stored as a plain 8.3 name (in any case) */
+int lfn_fits_short(const char *);
+
+/* the 8.3 basis of a long name: upper case, no blanks or leading dots,
+ * other invalid characters as '_'; returns 1 if a numeric tail is needed
+ * (something was lost or the name was too long)
+ */
+int lfn_basis(const uint16_t *, int, unsigned char *);
+
+/* put the numeric tail ~n on a 8.3 basis, shortening the base if needed */
+void lfn_tail(const unsigned char *, uint32_t, unsigned char *);
+
+/* the slots of a long name for a 8.3 name, in disk order
+ * returns the number of slots written to out
+ */
+int lfn_make(const uint16_t *, int, const unsigned char *, struct fat_dir *);
+
+#endif
@@ -1,71 +1,160 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-
-#include "fat16.h"
-#include "commands.h"
-#include "output.h"
-
-/* prototypes */
-void usage(char *);
-
-/* Show usage help */
-void usage(char *executable){
-    fprintf(stdout, "Usage:\n");
-    fprintf(stdout, "\t%s -h | --help for help\n", executable);
-    fprintf(stdout, "\t%s ls <fat16-img> - List files from the FAT16 image\n", executable);
-    fprintf(stdout, "\t%s cp <path> <file a copiar> <nome destino> <fat16-img> - Copy files from the image path to local dest.\n", executable);
-    fprintf(stdout, "\t%s mv <path> <dest> <fat16-img> - Move files from the path to the FAT16 path\n", executable);
-    fprintf(stdout, "\t%s rm <path> <file> <fat16-img> - Remove files from the path to the FAT16 path\n", executable);
-    fprintf(stdout, "\n");
-    fprintf(stdout, "\tfat16-img needs to be a valid Fat16.\n\n");
-}
-
-int main(int argc, char **argv){
-    if (argc <= 1){
-        usage(argv[0]);
-        exit(1);
-    }
-
-    if (argc == 2 && (strcmp(argv[1], "-h") == 0 ||
-                strcmp(argv[1], "--help") == 0)){
-        usage(argv[0]);
-        exit(0);
-    }
-    else if (argc >= 3 || argc >= 4){
-        FILE *fp = fopen(argv[argc - 1], "rb+");
-        if (!fp){
-            fprintf(stdout, "Could not open file %s\n", argv[2]);
-            exit(1);
-        }
-
-        struct fat_bpb bpb;
-        rfat(fp, &bpb);
-        char *command = argv[1];
-
-        if (strcmp(command, "ls") == 0){
-            struct fat_dir *dirs = ls(fp, &bpb);
-            show_files(dirs);
-        }
-
-        if (strcmp(command, "cp") == 0){
-            cp(fp, argv[2], argv[3], &bpb);
-            fclose(fp);
-        }
-
-        if (strcmp(command, "mv") == 0){ //move o arquivo do FAT
-            mv(fp, argv[2], &bpb);
-            fclose(fp);
-        }
-        if (strcmp(command, "rm") == 0){
-            rm(fp, argv[2], &bpb);
-            fclose(fp);
-        }
-        if (strcmp(command, "mv2") == 0){//move o arquivo local para dentro do FAT
-            mv2(fp, argv[2], &bpb);
-            fclose(fp);
-        }
-    }
-
-    return 0;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fat16.h"
+#include "volume.h"
+#include "commands.h"
+#include "output.h"
+#include "batch.h"
+#include "mkimage.h"
+#include "bulk.h"
+#include "serve.h"
+#include "mkfs.h"
+#include "support.h"
+#include "aio.h"
+
+/* prototypes */
+void usage(char *);
+
+/* Show usage help */
+void usage(char *executable){
+    fprintf(stdout, "Usage:\n");
+    fprintf(stdout, "\t%s -h | --help for help\n", executable);
+    fprintf(stdout, "\t%s --io=mmap|stdio|cache|direct <command> ... - Choose how the image is accessed (default: mmap; cache: 4 MiB block cache, direct: the cache over O_DIRECT)\n", executable);
+    fprintf(stdout, "\t%s --stats[=text|json] <command> ... - Report the I/O, FAT lookups, cache hits and time per phase on stderr\n", executable);
+    fprintf(stdout, "\t%s --aio[=uring|threads] [--aio-depth=N] [--aio-buffer=size] <command> ... - Copy file data of cp, put and mv with several reads in flight (default: io_uring, or threads without it; 8 buffers of 1M)\n", executable);
+    fprintf(stdout, "\t%s --journal <command> ... - Commit FAT and directory changes through <fat16-img>.journal\n", executable);
+    fprintf(stdout, "\t%s ls [-R] [path] <fat16-img> - List files from the FAT16 image (-R: the whole tree below path)\n", executable);
+    fprintf(stdout, "\t%s cp <path> <file a copiar> <nome destino> <fat16-img> - Copy files from the image path to local dest.\n", executable);
+    fprintf(stdout, "\t%s mv <path> <dest> <fat16-img> - Move files from the path to the FAT16 path\n", executable);
+    fprintf(stdout, "\t%s rm [-z | -p] <path> <fat16-img> - Remove a file and free its clusters (-z zeroes them, -p punches a hole)\n", executable);
+    fprintf(stdout, "\t%s put [-d] <local file | -> <name> <fat16-img> - Stream a local file or stdin into the image (-d: skip it if the image already holds the same contents)\n", executable);
+    fprintf(stdout, "\t%s put -r [-d] <local dir> <path> <fat16-img> - Import a local directory tree as a new directory, laid out contiguously (-d: leave out files the image already holds)\n", executable);
+    fprintf(stdout, "\t%s hash [-j threads] [-c] <fat16-img> - Print a digest of every file (-c: of every cluster of every file)\n", executable);
+    fprintf(stdout, "\t%s extract-all [-j threads] <dir> <fat16-img> - Copy every file of the image into a local directory\n", executable);
+    fprintf(stdout, "\t%s export [-f tar|cpio] <fat16-img> - Write every directory and file of the image to stdout as one archive, read in disk order\n", executable);
+    fprintf(stdout, "\t%s batch [script | -] <fat16-img> - Run a script of commands, one per line, on a single open image\n", executable);
+    fprintf(stdout, "\t%s defrag <fat16-img> - Make every file contiguous and pack the free space at the end\n", executable);
+    fprintf(stdout, "\t%s check [-j N] [--repair] <fat16-img> - Check chains, sizes, lost clusters and FAT copies\n", executable);
+    fprintf(stdout, "\t%s bulk [-j threads] [-l list] ls [-R] | check | extract-all <dir> <fat16-img | pattern> ... - Run one command over many images in one process (extract-all: one directory per image, named after it and numbered by position when names repeat)\n", executable);
+    fprintf(stdout, "\t%s serve <socket> <fat16-img> ... - Keep images mounted and answer ls, cp, put and rm requests on a Unix socket\n", executable);
+    fprintf(stdout, "\t%s request <socket> <image> ls [-R] [path] | cp <path> <local file> | put <local file> <name> | rm [-z | -p] <path> - Send a request to a server\n", executable);
+    fprintf(stdout, "\t%s mkfs [-s size] [-f average file size] [-c sectors/cluster] [-r root entries] [-n fats] <fat16-img> - Create an empty image, with the cluster size that wastes the least space for that file size\n", executable);
+    fprintf(stdout, "\t%s resize <size> <fat16-img> - Grow or shrink an image (clusters past the new end must be free)\n", executable);
+    fprintf(stdout, "\t%s mkimage [-s size] [-c sectors/cluster] [-n files] [-f min:max] [-d uniform|log] [-F fragmentation%%] [-S seed] <fat16-img> - Generate a synthetic image\n", executable);
+    fprintf(stdout, "\n");
+    fprintf(stdout, "\tfat16-img needs to be a valid Fat16.\n\n");
+}
+
+int main(int argc, char **argv){
+    char *executable = argv[0];
+    int backend = VOL_MMAP;
+    int journal = 0;
+    int stats = 0;
+    int aio = -1; /* no async engine */
+    int aio_depth = AIO_DEPTH;
+    uint32_t aio_buffer = AIO_BUFFER;
+
+    /* global options come before the command */
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0 && strcmp(argv[1], "--help") != 0){
+        if (strcmp(argv[1], "--journal") == 0)
+            journal = VOL_JOURNAL;
+        else if (strcmp(argv[1], "--io=mmap") == 0)
+            backend = VOL_MMAP;
+        else if (strcmp(argv[1], "--io=stdio") == 0)
+            backend = VOL_STDIO;
+        else if (strcmp(argv[1], "--io=cache") == 0)
+            backend = VOL_CACHE;
+        else if (strcmp(argv[1], "--io=direct") == 0)
+            backend = VOL_DIRECT;
+        else if (strcmp(argv[1], "--stats") == 0 || strcmp(argv[1], "--stats=text") == 0)
+            stats = STATS_TEXT;
+        else if (strcmp(argv[1], "--stats=json") == 0)
+            stats = STATS_JSON;
+        else if (strcmp(argv[1], "--aio") == 0)
+            aio = AIO_AUTO;
+        else if (strcmp(argv[1], "--aio=uring") == 0)
+            aio = AIO_URING;
+        else if (strcmp(argv[1], "--aio=threads") == 0)
+            aio = AIO_THREADS;
+        else if (strncmp(argv[1], "--aio-depth=", 12) == 0)
+            aio_depth = atoi(argv[1] + 12);
+        else if (strncmp(argv[1], "--aio-buffer=", 13) == 0)
+            aio_buffer = parse_size(argv[1] + 13);
+        else {
+            usage(executable);
+            exit(1);
+        }
+        argv[1] = executable;
+        argv++;
+        argc--;
+    }
+
+    if (argc <= 1){
+        usage(argv[0]);
+        exit(1);
+    }
+
+    if (argc == 2 && (strcmp(argv[1], "-h") == 0 ||
+                strcmp(argv[1], "--help") == 0)){
+        usage(argv[0]);
+        exit(0);
+    }
+    else if (strcmp(argv[1], "mkimage") == 0){
+        /* creates the image, so it can't be opened first */
+        exit(mkimage(argc - 1, argv + 1) == 0 ? 0 : 1);
+    }
+    else if (strcmp(argv[1], "mkfs") == 0){
+        exit(mkfs(argc - 1, argv + 1) == 0 ? 0 : 1);
+    }
+    else if (strcmp(argv[1], "resize") == 0){
+        /* rewrites the layout under the volume, so it opens the image itself */
+        exit(resize(argc - 1, argv + 1) == 0 ? 0 : 1);
+    }
+    else if (strcmp(argv[1], "serve") == 0){
+        /* keeps its images mounted until it is stopped */
+        exit(serve(argc - 1, argv + 1, backend | journal) == 0 ? 0 : 1);
+    }
+    else if (strcmp(argv[1], "request") == 0){
+        exit(serve_request(argc - 1, argv + 1) == 0 ? 0 : 1);
+    }
+    else if (strcmp(argv[1], "bulk") == 0){
+        /* opens each of its images itself */
+        exit(bulk(argc - 1, argv + 1, backend | journal) == 0 ? 0 : 1);
+    }
+    else if (argc >= 3 || argc >= 4){
+        struct fat_volume vol;
+        if (vol_open(&vol, argv[argc - 1], backend | journal | (stats ? VOL_STATS : 0)) != 0){
+            exit(1);
+        }
+        /* tuning the engine asks for it */
+        if (aio < 0 && (aio_depth != AIO_DEPTH || aio_buffer != AIO_BUFFER))
+            aio = AIO_AUTO;
+        if (aio >= 0 && !(vol.aio = aio_create(aio, aio_depth, aio_buffer))){
+            vol_close(&vol);
+            free(vol.stats);
+            exit(1);
+        }
+        char *command = argv[1];
+        int status;
+
+        if (strcmp(command, "batch") == 0){
+            status = batch(&vol, argc > 3 ? argv[2] : "-") == 0 ? 0 : -1;
+        } else {
+            /* the image is the last argument, not part of the command */
+            status = run_command(&vol, argc - 2, argv + 1);
+        }
+
+        /* only the FAT sectors touched by the command are written back */
+        if (vol_close(&vol) != 0)
+            status = -1;
+        /* on stderr, so the report never mixes with what the command prints */
+        stats_print(stderr, stats, command, vol.stats);
+        free(vol.stats);
+        if (status != 0)
+            exit(1);
+    }
+
+    return 0;
+}
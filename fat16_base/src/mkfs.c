@@ -0,0 +1,236 @@
+#include "mkfs.h"
+#include "format.h"
+#include "volume.h"
+#include "support.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define MKFS_CHUNK (4 << 20) /* bytes moved at a time when the data region moves */
+
+static void mkfs_usage(void){
+    fprintf(stderr, "mkfs [-s size] [-f average file size] [-c sectors/cluster] [-r root entries] "
+            "[-n fats] <fat16-img>\n");
+}
+
+/* create an empty FAT16 image, choosing its geometry
+ * only the boot sector and the first sector of each FAT are written; the
+ * rest of the image is a hole, so the size barely matters to the time
+ * returns -1 if no FAT16 geometry fits or the image could not be created
+ */
+int mkfs(int argc, char **argv){
+    struct fat_geometry geo = { 0, 512, 0, 1, 2, 512, 0, 0 };
+    uint32_t size = 64 * 1024 * 1024, avg_file = 64 * 1024;
+    uint32_t per_sect = geo.bytes_p_sect / sizeof(struct fat_dir);
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "s:f:c:r:n:")) != -1){
+        switch (opt){
+        case 's': size = parse_size(optarg); break;
+        case 'f': avg_file = parse_size(optarg); break;
+        case 'c': geo.sector_p_clust = atoi(optarg); break;
+        case 'r': geo.possible_rentries = atoi(optarg); break;
+        case 'n': geo.n_fat = atoi(optarg); break;
+        default:
+            mkfs_usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || geo.n_fat == 0 || geo.possible_rentries == 0){
+        mkfs_usage();
+        return -1;
+    }
+
+    /* the root region ends on a sector boundary: fill the last sector */
+    geo.possible_rentries = (geo.possible_rentries + per_sect - 1) / per_sect * per_sect;
+    geo.total_sects = size / geo.bytes_p_sect;
+    if (format_choose(&geo, avg_file) == 0){
+        fprintf(stderr, "Nenhuma geometria FAT16 cabe em %u bytes%s\n", size,
+                geo.sector_p_clust ? " com esse tamanho de cluster" : "");
+        return -1;
+    }
+
+    double start = now_ms();
+    if (format_image(argv[optind], &geo) != 0)
+        return -1;
+    double end = now_ms();
+
+    uint32_t clusters = format_geometry(&geo);
+    printf("%s: %u clusters de %u bytes, FAT de %u setor(es) x %u, %u entradas na raiz, "
+            "dados a partir do setor %u\n", argv[optind], clusters,
+            geo.sector_p_clust * geo.bytes_p_sect, geo.sect_per_fat, geo.n_fat, geo.possible_rentries,
+            geo.reserved_sect + geo.n_fat * geo.sect_per_fat + geo.possible_rentries / per_sect);
+    fprintf(stderr, "%u bytes: %.3f ms\n", size, end - start);
+    return 0;
+}
+
+/* move len bytes of an image from one offset to another, in the direction
+ * that never overwrites what is still to be moved
+ */
+static int move_bytes(int fd, off_t from, off_t to, off_t len){
+    uint8_t *buffer = malloc(MKFS_CHUNK);
+    off_t done = 0;
+
+    if (!buffer)
+        return -1;
+    while (done < len){
+        size_t n = len - done < MKFS_CHUNK ? len - done : MKFS_CHUNK;
+        /* moving forward, the tail goes first */
+        off_t at = to > from ? len - done - (off_t) n : done;
+        if (pread(fd, buffer, n, from + at) != (ssize_t) n || pwrite(fd, buffer, n, to + at) != (ssize_t) n){
+            free(buffer);
+            return -1;
+        }
+        done += n;
+    }
+    free(buffer);
+    return 0;
+}
+
+/* grow or shrink a FAT16 image to a new size
+ * the cluster size and the root directory stay; only the FAT can change.
+ * Shrinking keeps the FAT as it is, so nothing moves: the clusters past
+ * the new end must be free (defrag packs the free space at the end).
+ * Growing reuses the unused tail of the FAT when it covers the new
+ * clusters; otherwise the root directory and the data up to the last
+ * cluster in use move up, in large sequential copies, to make room.
+ * Cluster numbers never change, so no chain or directory is rewritten.
+ * The image is opened first, so a journal left behind is applied; the
+ * resize itself is not journaled, and one that is cut short while the
+ * data moves leaves the image unusable.
+ * returns -1 if the image could not be resized
+ */
+int resize(int argc, char **argv){
+    struct fat_volume vol;
+    struct fat_geometry geo;
+    struct fat_bpb bpb;
+    uint16_t *entries;
+    uint32_t old_clusters, clusters, last = 0, c;
+
+    if (argc != 3){
+        fprintf(stderr, "resize <size> <fat16-img>\n");
+        return -1;
+    }
+    const char *path = argv[2];
+    uint32_t size = parse_size(argv[1]);
+
+    if (vol_open(&vol, path, VOL_STDIO) != 0)
+        return -1;
+    bpb = vol.bpb;
+    old_clusters = bpb_cluster_count(&bpb);
+    uint32_t old_fat = bpb.sect_per_fat * bpb.bytes_p_sect;
+    entries = malloc(old_fat);
+    if (entries){
+        memcpy(entries, vol.fat.entries, old_fat);
+        /* the highest cluster in use */
+        for (c = 2; c < vol.fat.n_entries; c++){
+            if (entries[c] != 0)
+                last = c;
+        }
+    }
+    vol_close(&vol);
+    if (!entries)
+        return -1;
+
+    memset(&geo, 0, sizeof(geo));
+    geo.total_sects = size / bpb.bytes_p_sect;
+    geo.bytes_p_sect = bpb.bytes_p_sect;
+    geo.sector_p_clust = bpb.sector_p_clust;
+    geo.reserved_sect = bpb.reserved_sect;
+    geo.n_fat = bpb.n_fat;
+    geo.possible_rentries = bpb.possible_rentries;
+    clusters = format_geometry(&geo);
+
+    /* a FAT that is big enough stays where it is; one that grows moves the
+     * data by whole clusters, so clusters that were aligned stay aligned */
+    if (geo.sect_per_fat < bpb.sect_per_fat)
+        geo.sect_per_fat = bpb.sect_per_fat;
+    while (geo.sect_per_fat < 0xFFFF && (geo.sect_per_fat - bpb.sect_per_fat) * geo.n_fat % geo.sector_p_clust)
+        geo.sect_per_fat++;
+    uint32_t meta = bpb_fdata_addr(&bpb) / bpb.bytes_p_sect + (geo.sect_per_fat - bpb.sect_per_fat) * geo.n_fat;
+    if (clusters)
+        clusters = geo.total_sects > meta ? (geo.total_sects - meta) / geo.sector_p_clust : 0;
+    if (clusters == 0 || clusters > FAT16_MAX_CLUSTERS){
+        fprintf(stderr, "Tamanho fora do alcance do FAT16 com clusters de %u bytes\n",
+                bpb.sector_p_clust * bpb.bytes_p_sect);
+        free(entries);
+        return -1;
+    }
+    if (last >= clusters + 2){
+        fprintf(stderr, "O cluster %u está em uso além do novo fim (%u clusters): rode defrag antes\n",
+                last, clusters);
+        free(entries);
+        return -1;
+    }
+    if (clusters < FAT16_MIN_CLUSTERS)
+        fprintf(stderr, "Aviso: %u clusters fora da faixa do FAT16 (%d-%d)\n",
+                clusters, FAT16_MIN_CLUSTERS, FAT16_MAX_CLUSTERS);
+
+    struct stat st;
+    int fd = open(path, O_RDWR);
+    if (fd < 0 || fstat(fd, &st) != 0){
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        free(entries);
+        return -1;
+    }
+
+    double start = now_ms();
+    uint32_t cluster_size = bpb.sector_p_clust * bpb.bytes_p_sect;
+    off_t old_root = bpb_froot_addr(&bpb);
+    off_t shift = (off_t) (geo.sect_per_fat - bpb.sect_per_fat) * bpb.n_fat * bpb.bytes_p_sect;
+    off_t used_end = last >= 2 ? (off_t) bpb_clust_addr(&bpb, last) + cluster_size : bpb_fdata_addr(&bpb);
+    off_t new_size = (off_t) geo.total_sects * bpb.bytes_p_sect;
+    int ret = 0;
+
+    /* grow the file first, so that whatever moves up has somewhere to go */
+    if (new_size > st.st_size && ftruncate(fd, new_size) != 0)
+        ret = -1;
+    if (ret == 0 && shift > 0)
+        ret = move_bytes(fd, old_root, old_root + shift, used_end - old_root);
+
+    /* every FAT copy at its new place; the entries past the old end are free */
+    if (ret == 0 && shift > 0){
+        uint32_t new_fat = geo.sect_per_fat * bpb.bytes_p_sect;
+        uint8_t *fat = calloc(1, new_fat);
+        uint32_t i;
+        if (!fat)
+            ret = -1;
+        else
+            memcpy(fat, entries, old_fat);
+        for (i = 0; ret == 0 && i < bpb.n_fat; i++){
+            off_t offset = (off_t) (bpb.reserved_sect + i * geo.sect_per_fat) * bpb.bytes_p_sect;
+            if (pwrite(fd, fat, new_fat, offset) != (ssize_t) new_fat)
+                ret = -1;
+        }
+        free(fat);
+    }
+
+    if (ret == 0){
+        bpb.sect_per_fat = geo.sect_per_fat;
+        bpb.snumber_sect = geo.total_sects < 0x10000 ? geo.total_sects : 0;
+        bpb.large_n_sects = geo.total_sects < 0x10000 ? 0 : geo.total_sects;
+        if (pwrite(fd, &bpb, sizeof(bpb), 0) != sizeof(bpb))
+            ret = -1;
+    }
+    if (ret == 0 && new_size < st.st_size && ftruncate(fd, new_size) != 0)
+        ret = -1;
+    if (ret == 0 && fsync(fd) != 0)
+        ret = -1;
+    if (ret != 0)
+        perror(path);
+    close(fd);
+    free(entries);
+    if (ret != 0)
+        return -1;
+
+    printf("%s: %u -> %u clusters de %u bytes, FAT de %u setor(es)\n", path, old_clusters, clusters,
+            cluster_size, geo.sect_per_fat);
+    fprintf(stderr, "%llu bytes movidos: %.3f ms\n", shift > 0 ? (unsigned long long) (used_end - old_root) : 0ULL,
+            now_ms() - start);
+    return 0;
+}
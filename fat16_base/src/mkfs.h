@@ -0,0 +1,14 @@
+#ifndef MKFS_H
+#define MKFS_H
+
+/* create an empty FAT16 image, choosing its geometry
+ * argv[0] is the command name and the last argument the image to create
+ */
+int mkfs(int, char **);
+
+/* grow or shrink a FAT16 image to a new size
+ * argv is the command name, the size and the image
+ */
+int resize(int, char **);
+
+#endif
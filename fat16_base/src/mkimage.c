@@ -0,0 +1,196 @@
+#include "mkimage.h"
+#include "format.h"
+#include "volume.h"
+#include "alloc.h"
+#include "commands.h"
+#include "support.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MKIMAGE_CHUNK (1 << 20) /* largest single write of file data */
+
+/* xorshift64*: fast, seedable and good enough for synthetic data */
+static uint64_t next_rand(uint64_t *state){
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/* draw a file size in [min, max], uniformly or log-uniformly */
+static uint32_t draw_size(uint64_t *rng, uint32_t min, uint32_t max, int log_dist){
+    double u = (next_rand(rng) >> 11) * (1.0 / 9007199254740992.0);
+
+    if (max <= min)
+        return min;
+    if (log_dist){
+        double lo = log(min > 0 ? min : 1), hi = log(max);
+        return (uint32_t) exp(lo + u * (hi - lo));
+    }
+    return min + (uint32_t) (u * (max - min));
+}
+
+/* take n clusters as one chain; with frag > 0 every cluster has a frag%
+ * chance of ending the current run, and each run starts at a random place
+ * returns the first cluster, or 0 (with nothing allocated) if there is no room
+ */
+static uint32_t alloc_fragmented(struct fat_cache *fat, uint32_t n, int frag, uint64_t *rng){
+    uint32_t first = 0, tail = 0;
+    uint32_t run, start, got;
+
+    if (frag <= 0)
+        return fat_alloc_chain(fat, n);
+
+    while (n > 0){
+        run = 1;
+        while (run < n && (int) (next_rand(rng) % 100) >= frag)
+            run++;
+
+        fat_alloc_hint(fat, 2 + next_rand(rng) % (fat->n_entries - 2));
+        start = fat_alloc_run(fat, run, &got);
+        if (got == 0){
+            fat_cache_free_chain(fat, first);
+            return 0;
+        }
+        if (tail)
+            fat_cache_set(fat, tail, start);
+        else
+            first = start;
+        tail = start + got - 1;
+        n -= got;
+    }
+    return first;
+}
+
+/* fill the clusters of a chain with size bytes of pseudo-random data */
+static int write_file_data(struct fat_volume *vol, uint32_t first, uint32_t size,
+        uint8_t *buffer, uint64_t *rng){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    struct fat_extent *ext;
+    int i, n_ext = fat_chain_extents(&vol->fat, first, &ext);
+    uint32_t j;
+
+    if (n_ext < 0)
+        return -1;
+
+    for (i = 0; i < n_ext && size > 0; i++){
+        uint32_t offset = bpb_clust_addr(&vol->bpb, ext[i].start);
+        uint32_t left = ext[i].len * cluster_size;
+        if (left > size)
+            left = size;
+        size -= left;
+
+        while (left > 0){
+            uint32_t chunk = left < MKIMAGE_CHUNK ? left : MKIMAGE_CHUNK;
+            for (j = 0; j < chunk; j += 8){
+                uint64_t r = next_rand(rng);
+                memcpy(buffer + j, &r, 8);
+            }
+            if (vol_write(vol, offset, buffer, chunk) != 0){
+                free(ext);
+                return -1;
+            }
+            offset += chunk;
+            left -= chunk;
+        }
+    }
+    free(ext);
+    return 0;
+}
+
+static void mkimage_usage(void){
+    fprintf(stderr, "mkimage [-s size] [-c sectors/cluster] [-n files] [-f min:max] "
+            "[-d uniform|log] [-F fragmentation%%] [-S seed] <fat16-img>\n");
+}
+
+/* generate a synthetic FAT16 image for benchmarks
+ * the image is formatted and then filled with files named F0000000.DAT,
+ * F0000001.DAT ... in the root directory
+ * returns -1 if the image could not be created
+ */
+int mkimage(int argc, char **argv){
+    struct fat_geometry geo = { 0, 512, 4, 1, 2, 512, 0, 0 };
+    uint32_t size = 64 * 1024 * 1024;
+    uint32_t min_size = 4096, max_size = 256 * 1024;
+    int n_files = 100, frag = 0, log_dist = 0;
+    uint64_t rng = 0x9E3779B97F4A7C15ULL;
+    uint64_t bytes = 0;
+    int opt, i;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "s:c:n:f:d:F:S:")) != -1){
+        switch (opt){
+        case 's': size = parse_size(optarg); break;
+        case 'c': geo.sector_p_clust = atoi(optarg); break;
+        case 'n': n_files = atoi(optarg); break;
+        case 'f':
+            min_size = parse_size(optarg);
+            max_size = strchr(optarg, ':') ? parse_size(strchr(optarg, ':') + 1) : min_size;
+            break;
+        case 'd': log_dist = strcmp(optarg, "log") == 0; break;
+        case 'F': frag = atoi(optarg); break;
+        case 'S': rng = strtoull(optarg, NULL, 0) | 1; break;
+        default:
+            mkimage_usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1){
+        mkimage_usage();
+        return -1;
+    }
+
+    const char *path = argv[optind];
+    geo.total_sects = size / geo.bytes_p_sect;
+    if (format_image(path, &geo) != 0)
+        return -1;
+
+    struct fat_volume vol;
+    if (vol_open(&vol, path, VOL_MMAP) != 0)
+        return -1;
+
+    struct fat_dirtab *root = path_root(&vol);
+    uint8_t *buffer = malloc(MKIMAGE_CHUNK);
+    if (!root || !buffer){
+        free(buffer);
+        vol_close(&vol);
+        return -1;
+    }
+
+    uint32_t cluster_size = geo.bytes_p_sect * geo.sector_p_clust;
+    if (n_files > (int) root->idx.n_free){
+        fprintf(stderr, "Aviso: o diretório raiz só tem %u entradas\n", root->idx.n_free);
+        n_files = root->idx.n_free;
+    }
+
+    for (i = 0; i < n_files; i++){
+        struct fat_dir entry = {0};
+        char name[13];
+        uint32_t file_size = draw_size(&rng, min_size, max_size, log_dist);
+        uint32_t n_clusters = (file_size + cluster_size - 1) / cluster_size;
+        uint32_t first = 0;
+
+        if (n_clusters > 0 && !(first = alloc_fragmented(&vol.fat, n_clusters, frag, &rng))){
+            fprintf(stderr, "Imagem cheia após %d arquivo(s)\n", i);
+            break;
+        }
+        if (first && write_file_data(&vol, first, file_size, buffer, &rng) != 0)
+            break;
+
+        entry.attr = DIR_ATTR_ARCHIVE;
+        entry.starting_cluster = first;
+        entry.file_size = file_size;
+        /* i is below the root's entry count, so at most 5 digits */
+        snprintf(name, sizeof(name), "F%07u.DAT", (uint16_t) i);
+        if (write_dir(&vol, root, name, &entry) != 0)
+            break;
+        bytes += file_size;
+    }
+
+    free(buffer);
+    fprintf(stderr, "%s: %u clusters of %u bytes, %d file(s), %llu bytes, %u clusters free\n",
+            path, vol.fat.n_entries - 2, cluster_size, i, (unsigned long long) bytes, vol.fat.n_free);
+    return vol_close(&vol) == 0 && i == n_files ? 0 : -1;
+}
@@ -0,0 +1,9 @@
+#ifndef MKIMAGE_H
+#define MKIMAGE_H
+
+/* generate a synthetic FAT16 image for benchmarks
+ * argv[0] is the command name and the last argument the image to create
+ */
+int mkimage(int, char **);
+
+#endif
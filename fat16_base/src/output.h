@@ -1,10 +1,14 @@
-#ifndef OUTPUT_H
-#define OUTPUT_H
-
-#include "fat16.h"
-
-void show_files(struct fat_dir *);
-
-void verbose(struct fat_bpb *);
-
-#endif
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "fat16.h"
+
+/* print the name of one entry (a dir_scan callback, ctx is the stream) */
+int show_file(void *, struct fat_dir *, const char *);
+
+/* list the files and subdirectories among n directory slots */
+void show_files(FILE *, struct fat_dir *, uint32_t);
+
+void verbose(struct fat_bpb *);
+
+#endif
@@ -0,0 +1,178 @@
+#include "path.h"
+#include "volume.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH_TEXT_MAX 4096
+
+/* split a copy of a path, made in buf, into its components
+ * "." components are skipped and ".." drops the previous one
+ * returns the number of components or -1 if the path is too deep or long
+ */
+static int split_path(const char *path, char *buf, char **comps){
+    char *p, *comp;
+    int n = 0;
+
+    if (strlen(path) >= PATH_TEXT_MAX)
+        return -1;
+    strcpy(buf, path);
+
+    for (p = buf; *p;){
+        while (*p == '/')
+            p++;
+        if (*p == '\0')
+            break;
+        comp = p;
+        p += strcspn(p, "/");
+        if (*p)
+            *p++ = '\0';
+
+        if (strcmp(comp, ".") == 0)
+            continue;
+        if (strcmp(comp, "..") == 0){
+            if (n > 0)
+                n--;
+            continue;
+        }
+        if (n == PATH_MAX_DEPTH)
+            return -1;
+        comps[n++] = comp;
+    }
+    return n;
+}
+
+/* the loaded root directory of the volume */
+struct fat_dirtab *path_root(struct fat_volume *vol){
+    if (!vol->root.ents && dirtab_load(vol, 0, &vol->root) != 0)
+        return NULL;
+    return &vol->root;
+}
+
+/* cache entry for a directory key, or NULL */
+static struct path_cache_entry *cache_get(struct path_cache *pc, unsigned char *key, uint32_t key_len){
+    int i;
+
+    for (i = 0; i < pc->n; i++){
+        if (pc->ent[i].key_len == key_len && memcmp(pc->ent[i].key, key, key_len) == 0){
+            pc->ent[i].used = ++pc->clock;
+            return &pc->ent[i];
+        }
+    }
+    return NULL;
+}
+
+/* a cache entry to load a new directory into, evicting the least recently
+ * used one when the cache is full
+ */
+static struct path_cache_entry *cache_slot(struct path_cache *pc){
+    struct path_cache_entry *lru;
+    int i;
+
+    if (pc->n < PATH_CACHE_SIZE)
+        return &pc->ent[pc->n++];
+
+    lru = &pc->ent[0];
+    for (i = 1; i < pc->n; i++){
+        if (pc->ent[i].used < lru->used)
+            lru = &pc->ent[i];
+    }
+    dirtab_destroy(&lru->dt);
+    return lru;
+}
+
+/* the directory named by the first n components
+ * starts from the deepest directory of the path that is already cached
+ * and can be keyed without looking anything up
+ */
+static struct fat_dirtab *resolve_dir(struct fat_volume *vol, char **comps, int n){
+    struct fat_dirtab *dt = path_root(vol);
+    struct path_cache_entry *ce;
+    unsigned char key[PATH_MAX_DEPTH * 11 + 1];
+    int depth, known, slot;
+
+    if (!dt || n == 0)
+        return dt;
+
+    if (!vol->paths && !(vol->paths = calloc(1, sizeof(struct path_cache))))
+        return NULL;
+
+    for (known = 0; known < n && dir_short_key(comps[known], (char *) key + known * 11); known++)
+        ;
+    for (depth = known; depth > 0; depth--){
+        if ((ce = cache_get(vol->paths, key, depth * 11))){
+            if (vol->stats)
+                vol->stats->dir_hits++;
+            dt = &ce->dt;
+            break;
+        }
+    }
+
+    for (; depth < n; depth++){
+        slot = dirtab_find(dt, comps[depth]);
+        if (slot < 0 || !(dt->ents[slot].attr & DIR_ATTR_DIRECTORY))
+            return NULL;
+
+        /* the canonical key: a long name gets the 8.3 name of its entry */
+        memcpy(key + depth * 11, dt->ents[slot].name, 11);
+        if (depth >= known && (ce = cache_get(vol->paths, key, (depth + 1) * 11))){
+            if (vol->stats)
+                vol->stats->dir_hits++;
+            dt = &ce->dt;
+            continue;
+        }
+        if (vol->stats)
+            vol->stats->dir_misses++;
+
+        uint32_t cluster = dt->ents[slot].starting_cluster;
+        ce = cache_slot(vol->paths);
+        if (dirtab_load(vol, cluster, &ce->dt) != 0){
+            /* leave the slot empty but valid: an unmatched key */
+            ce->key_len = (uint32_t) -1;
+            return NULL;
+        }
+        memcpy(ce->key, key, (depth + 1) * 11);
+        ce->key_len = (depth + 1) * 11;
+        ce->used = ++vol->paths->clock;
+        dt = &ce->dt;
+    }
+    return dt;
+}
+
+/* the loaded directory at a path ("/" or "" for the root), or NULL */
+struct fat_dirtab *path_dir(struct fat_volume *vol, const char *path){
+    char buf[PATH_TEXT_MAX];
+    char *comps[PATH_MAX_DEPTH];
+    int n = split_path(path, buf, comps);
+
+    if (n < 0)
+        return NULL;
+    return resolve_dir(vol, comps, n);
+}
+
+/* slot of the entry at a path, or -1 if there is none */
+int path_lookup(struct fat_volume *vol, const char *path, struct fat_dirtab **dir){
+    char buf[PATH_TEXT_MAX];
+    char *comps[PATH_MAX_DEPTH];
+    int n = split_path(path, buf, comps);
+
+    *dir = NULL;
+    if (n <= 0)
+        return -1;
+
+    *dir = resolve_dir(vol, comps, n - 1);
+    if (!*dir)
+        return -1;
+    return dirtab_find(*dir, comps[n - 1]);
+}
+
+/* drop every cached directory */
+void path_cache_clear(struct fat_volume *vol){
+    int i;
+
+    if (!vol->paths)
+        return;
+    for (i = 0; i < vol->paths->n; i++)
+        dirtab_destroy(&vol->paths->ent[i].dt);
+    free(vol->paths);
+    vol->paths = NULL;
+}
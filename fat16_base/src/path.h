@@ -0,0 +1,48 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include "dir.h"
+
+#define PATH_CACHE_SIZE 32 /* directories kept loaded by the resolver */
+#define PATH_MAX_DEPTH 64
+
+/* Path resolver.
+ * Paths such as /A/B/C.TXT are resolved one component at a time from the
+ * root; components are long or 8.3 names, in any case. Every directory
+ * reached is kept loaded in a small LRU cache keyed by its canonical path
+ * (the 8.3 names of its components), so the next lookup below it starts
+ * from the deepest cached directory instead of walking the whole path
+ * again. Only the leading components that are plain 8.3 names can be
+ * turned into a key up front; the rest is looked up step by step.
+ */
+struct path_cache_entry {
+    unsigned char key[PATH_MAX_DEPTH * 11]; /* padded names of the components */
+    uint32_t key_len;
+    uint64_t used; /* last use, for LRU eviction */
+    struct fat_dirtab dt;
+};
+
+struct path_cache {
+    struct path_cache_entry ent[PATH_CACHE_SIZE];
+    int n;
+    uint64_t clock;
+};
+
+struct fat_volume;
+
+/* the loaded root directory of the volume */
+struct fat_dirtab *path_root(struct fat_volume *);
+
+/* the loaded directory at a path ("/" or "" for the root), or NULL */
+struct fat_dirtab *path_dir(struct fat_volume *, const char *);
+
+/* slot of the entry at a path, or -1 if there is none
+ * the directory that holds (or would hold) the entry is stored in the last
+ * argument, NULL if that directory doesn't exist
+ */
+int path_lookup(struct fat_volume *, const char *, struct fat_dirtab **);
+
+/* drop every cached directory */
+void path_cache_clear(struct fat_volume *);
+
+#endif
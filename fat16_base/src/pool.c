@@ -0,0 +1,50 @@
+#include "pool.h"
+#include <pthread.h>
+#include <stdlib.h>
+
+struct pool {
+    pool_job_fn fn;
+    void *ctx;
+    int n_jobs;
+    int next; /* next job to hand out, taken atomically */
+};
+
+static void *pool_worker(void *arg){
+    struct pool *pool = arg;
+    int job;
+
+    while ((job = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->n_jobs)
+        pool->fn(pool->ctx, job);
+    return NULL;
+}
+
+/* run n jobs on the given number of threads and wait for all of them
+ * the calling thread is one of the workers, so threads - 1 are started
+ */
+int pool_run(int threads, int n_jobs, pool_job_fn fn, void *ctx){
+    struct pool pool = { fn, ctx, n_jobs, 0 };
+    pthread_t *tids;
+    int i, started = 0;
+
+    if (threads > n_jobs)
+        threads = n_jobs;
+    if (threads <= 1){
+        pool_worker(&pool);
+        return 0;
+    }
+
+    tids = malloc(threads * sizeof(pthread_t));
+    if (tids){
+        for (started = 0; started < threads - 1; started++){
+            if (pthread_create(&tids[started], NULL, pool_worker, &pool) != 0)
+                break;
+        }
+    }
+
+    /* whatever was not picked up by a thread runs here */
+    pool_worker(&pool);
+    for (i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return started == threads - 1 ? 0 : -1;
+}
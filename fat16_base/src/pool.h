@@ -0,0 +1,17 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Fixed-size worker pool.
+ * Runs jobs 0..n-1 on a number of threads; each worker takes the next job
+ * index from a shared counter until none is left, so long jobs don't hold
+ * up the others.
+ */
+
+typedef void (*pool_job_fn)(void *ctx, int job);
+
+/* run n jobs on the given number of threads and wait for all of them
+ * returns -1 if some threads could not be started (the jobs still all run)
+ */
+int pool_run(int threads, int n_jobs, pool_job_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,675 @@
+#define _GNU_SOURCE
+#include "serve.h"
+#include "volume.h"
+#include "commands.h"
+#include "dirscan.h"
+#include "output.h"
+#include "support.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SERVE_BACKLOG 64
+#define SERVE_CHUNK (1 << 20) /* bytes moved between a socket and a file at a time */
+
+/* fat16.h packs every structure after it; the locks below need their
+ * natural alignment (the kernel refuses a misaligned futex)
+ */
+#pragma pack(push, 8)
+
+/* a put or rm waiting for the writer thread */
+struct serve_write {
+    int argc;
+    char **argv; /* the command and its arguments */
+    int data_fd; /* what a put stores, -1 for rm */
+    FILE *out; /* what the command prints */
+    char *text;
+    size_t len;
+    int status;
+    int done;
+    struct serve_write *next;
+};
+
+struct serve_vol {
+    struct fat_volume vol;
+    const char *path;
+    int closed;
+    pthread_rwlock_t lock; /* shared by readers, taken alone by the writer */
+    pthread_mutex_t meta; /* path resolution by readers */
+    pthread_mutex_t qlock;
+    pthread_cond_t qcond; /* work for the writer, or stop */
+    pthread_cond_t qdone; /* a batch was applied */
+    struct serve_write *head, *tail;
+    int stop;
+    pthread_t writer;
+};
+
+struct serve_conn {
+    struct serve_ctx *srv;
+    int fd;
+    struct serve_conn *prev, *next;
+};
+
+struct serve_ctx {
+    struct serve_vol *vols;
+    int n;
+    int listen_fd;
+    int stop; /* set by the signal thread */
+    pthread_mutex_t conn_lock;
+    pthread_cond_t conn_done; /* a connection thread left */
+    struct serve_conn *conns; /* connections being answered */
+};
+
+#pragma pack(pop)
+
+/* read exactly len bytes; returns 0, or -1 on error or end of input */
+static int recv_all(int fd, void *buff, size_t len){
+    return read_full(fd, buff, len) == (ssize_t) len ? 0 : -1;
+}
+
+static int send_reply(int fd, int status, const void *data, uint32_t len){
+    struct serve_reply reply = { status, len };
+
+    if (write_all(fd, &reply, sizeof(reply)) != 0)
+        return -1;
+    return len > 0 ? write_all(fd, data, len) : 0;
+}
+
+/* a reply made of a message */
+static int send_text(int fd, int status, const char *text){
+    return send_reply(fd, status, text, strlen(text));
+}
+
+/* copy len bytes from one descriptor to another, through a buffer */
+static int copy_fd(int from, int to, uint64_t len){
+    uint8_t *buffer = malloc(SERVE_CHUNK);
+    int ret = 0;
+
+    if (!buffer)
+        return -1;
+    while (ret == 0 && len > 0){
+        uint32_t chunk = len < SERVE_CHUNK ? len : SERVE_CHUNK;
+        ret = recv_all(from, buffer, chunk) == 0 && write_all(to, buffer, chunk) == 0 ? 0 : -1;
+        len -= chunk;
+    }
+    free(buffer);
+    return ret;
+}
+
+/* read and throw away the data of a request that is refused, to keep the
+ * framing
+ */
+static int drain(int fd, uint64_t len){
+    int null = open("/dev/null", O_WRONLY);
+    int ret = null >= 0 ? copy_fd(fd, null, len) : -1;
+
+    if (null >= 0)
+        close(null);
+    return ret;
+}
+
+/* readers only share the image freely when it is mapped: without a
+ * mapping, reads move the stdio position or go through the block cache,
+ * and take the path mutex too
+ */
+static void io_lock(struct serve_vol *sv){
+    if (!sv->vol.map || sv->vol.cache)
+        pthread_mutex_lock(&sv->meta);
+}
+
+static void io_unlock(struct serve_vol *sv){
+    if (!sv->vol.map || sv->vol.cache)
+        pthread_mutex_unlock(&sv->meta);
+}
+
+/* ls [-R] [path], printed into out; the caller holds the read lock
+ * the path mutex only covers the lookup: the slots of a directory are
+ * copied out and listed after it is released, and a tree is walked one
+ * cluster at a time without the path cache
+ */
+static int read_ls(struct serve_vol *sv, int argc, char **argv, FILE *out){
+    struct fat_volume *vol = &sv->vol;
+    int recursive = argc >= 2 && strcmp(argv[1], "-R") == 0;
+    char *path = argc >= 2 + recursive ? argv[1 + recursive] : "/";
+    struct fat_dirtab *dt;
+    struct fat_dir *ents = NULL;
+    uint32_t cluster = 0, n = 0;
+    int ret = 0;
+
+    if (!recursive && path[strspn(path, "/")] == '\0'){
+        io_lock(sv);
+        ret = dir_scan_root(vol, show_file, out) < 0 ? -1 : 0;
+        io_unlock(sv);
+        return ret;
+    }
+
+    pthread_mutex_lock(&sv->meta);
+    if ((dt = path_dir(vol, path))){
+        cluster = dt->cluster;
+        n = dt->n;
+        if (!recursive && (ents = malloc((n ? n : 1) * sizeof(*ents))))
+            memcpy(ents, dt->ents, n * sizeof(*ents));
+    }
+    pthread_mutex_unlock(&sv->meta);
+
+    if (!dt){
+        fprintf(out, "Diretório '%s' não encontrado\n", path);
+        return -1;
+    }
+    if (recursive){
+        io_lock(sv);
+        ret = ls_recursive(vol, cluster, path, out);
+        io_unlock(sv);
+    } else if (!ents){
+        fprintf(out, "Erro ao alocar memória\n");
+        ret = -1;
+    } else {
+        show_files(out, ents, n);
+    }
+    free(ents);
+    return ret;
+}
+
+/* cp <path>: the file is copied into an anonymous file under the read
+ * lock and sent to the socket after it is released, so a client that
+ * stops reading never keeps the writer, and the readers queued behind it,
+ * waiting; only the lookup and the chain walk hold the path mutex
+ * returns -1 if the connection can't be used any more
+ */
+static int read_cp(struct serve_vol *sv, int argc, char **argv, int fd){
+    struct fat_volume *vol = &sv->vol;
+    struct fat_dirtab *dt;
+    struct fat_extent *ext = NULL;
+    struct fat_dir entry;
+    int slot = -1, n_ext = -1, data_fd = -1, closed;
+    uint32_t left = 0;
+
+    if (argc < 2)
+        return send_text(fd, -1, "Uso: cp <caminho>\n");
+
+    pthread_rwlock_rdlock(&sv->lock);
+    closed = sv->closed;
+    if (!closed){
+        pthread_mutex_lock(&sv->meta);
+        slot = path_lookup(vol, argv[1], &dt);
+        if (slot >= 0 && !(dt->ents[slot].attr & DIR_ATTR_DIRECTORY)){
+            entry = dt->ents[slot];
+            n_ext = entry.file_size > 0 ? fat_chain_extents(&vol->fat, entry.starting_cluster, &ext) : 0;
+        }
+        pthread_mutex_unlock(&sv->meta);
+    }
+    if (n_ext >= 0 && (data_fd = memfd_create("fat-cp", MFD_CLOEXEC)) >= 0){
+        io_lock(sv);
+        left = vol_copy_extents(vol, ext, n_ext, entry.file_size, data_fd);
+        io_unlock(sv);
+    }
+    pthread_rwlock_unlock(&sv->lock);
+    free(ext);
+
+    if (closed)
+        return send_text(fd, -1, "Servidor encerrando\n");
+    if (slot < 0 || n_ext < 0)
+        return send_text(fd, -1, "Arquivo não encontrado\n");
+    if (data_fd < 0 || left > 0 || lseek(data_fd, 0, SEEK_SET) != 0){
+        if (data_fd >= 0)
+            close(data_fd);
+        return send_text(fd, -1, "Erro ao ler o arquivo\n");
+    }
+
+    struct serve_reply reply = { 0, entry.file_size };
+    int ret = write_all(fd, &reply, sizeof(reply));
+    if (ret == 0)
+        ret = copy_fd(data_fd, fd, entry.file_size);
+    close(data_fd);
+    return ret;
+}
+
+/* writer thread: applies the queued writes of a volume in batches
+ * one exclusive section and one vol_sync() cover everything queued while
+ * the previous batch was being applied
+ */
+static void *serve_writer(void *arg){
+    struct serve_vol *sv = arg;
+    struct fat_volume *vol = &sv->vol;
+    struct serve_write *batch, *w;
+
+    for (;;){
+        pthread_mutex_lock(&sv->qlock);
+        while (!sv->head && !sv->stop)
+            pthread_cond_wait(&sv->qcond, &sv->qlock);
+        batch = sv->head;
+        sv->head = sv->tail = NULL;
+        pthread_mutex_unlock(&sv->qlock);
+        if (!batch)
+            break;
+
+        pthread_rwlock_wrlock(&sv->lock);
+        for (w = batch; w; w = w->next){
+            vol->out = w->out;
+            if (strcmp(w->argv[0], "put") == 0)
+                w->status = put_fd(vol, w->data_fd, w->argv[1]);
+            else
+                w->status = run_command(vol, w->argc, w->argv);
+        }
+        vol->out = stdout;
+        if (vol_sync(vol) != 0){
+            for (w = batch; w; w = w->next){
+                fprintf(w->out, "Erro ao gravar a imagem\n");
+                w->status = -1;
+            }
+        }
+        pthread_rwlock_unlock(&sv->lock);
+
+        pthread_mutex_lock(&sv->qlock);
+        for (w = batch; w; w = batch){
+            batch = w->next;
+            w->done = 1;
+        }
+        pthread_cond_broadcast(&sv->qdone);
+        pthread_mutex_unlock(&sv->qlock);
+    }
+    return NULL;
+}
+
+/* queue a put or rm and wait until its batch is flushed
+ * a put's data is taken off the socket first, into an anonymous file, so
+ * a slow client never holds up the batch
+ * returns -1 if the connection can't be used any more
+ */
+static int queue_write(struct serve_vol *sv, int argc, char **argv, uint32_t data_len, int fd){
+    struct serve_write w;
+    int ret;
+
+    memset(&w, 0, sizeof(w));
+    w.argc = argc;
+    w.argv = argv;
+    w.data_fd = -1;
+    if (strcmp(argv[0], "put") == 0){
+        if (argc < 2)
+            return drain(fd, data_len) == 0 ? send_text(fd, -1, "Uso: put <nome>\n") : -1;
+        w.data_fd = memfd_create("fat-put", MFD_CLOEXEC);
+        if (w.data_fd < 0 || copy_fd(fd, w.data_fd, data_len) != 0 || lseek(w.data_fd, 0, SEEK_SET) != 0){
+            if (w.data_fd >= 0)
+                close(w.data_fd);
+            return -1;
+        }
+    }
+    if (!(w.out = open_memstream(&w.text, &w.len))){
+        if (w.data_fd >= 0)
+            close(w.data_fd);
+        return send_text(fd, -1, "Erro ao alocar memória\n");
+    }
+
+    pthread_mutex_lock(&sv->qlock);
+    if (sv->stop){
+        w.status = -1;
+        w.done = 1;
+        fprintf(w.out, "Servidor encerrando\n");
+    } else {
+        if (sv->tail)
+            sv->tail->next = &w;
+        else
+            sv->head = &w;
+        sv->tail = &w;
+        pthread_cond_signal(&sv->qcond);
+    }
+    while (!w.done)
+        pthread_cond_wait(&sv->qdone, &sv->qlock);
+    pthread_mutex_unlock(&sv->qlock);
+
+    fclose(w.out);
+    if (w.data_fd >= 0)
+        close(w.data_fd);
+    ret = send_reply(fd, w.status, w.text, w.len);
+    free(w.text);
+    return ret;
+}
+
+/* the volume a request names, by the path it was served with or its
+ * last component
+ */
+static struct serve_vol *find_vol(struct serve_ctx *srv, const char *name){
+    int i;
+
+    for (i = 0; i < srv->n; i++){
+        const char *base = strrchr(srv->vols[i].path, '/');
+        if (strcmp(srv->vols[i].path, name) == 0 || (base && strcmp(base + 1, name) == 0))
+            return &srv->vols[i];
+    }
+    return NULL;
+}
+
+/* answer one request; returns -1 if the connection must be closed */
+static int handle(struct serve_ctx *srv, int fd, char *args, uint32_t args_len, uint32_t data_len){
+    char *argv[SERVE_MAX_ARGS];
+    int argc = 0, ret;
+    uint32_t i;
+
+    for (i = 0; i < args_len && argc < SERVE_MAX_ARGS; i += strlen(args + i) + 1)
+        argv[argc++] = args + i;
+
+    struct serve_vol *sv = argc >= 2 ? find_vol(srv, argv[0]) : NULL;
+    int writes = argc >= 2 && (strcmp(argv[1], "put") == 0 || strcmp(argv[1], "rm") == 0);
+    int reads = argc >= 2 && (strcmp(argv[1], "ls") == 0 || strcmp(argv[1], "cp") == 0);
+
+    if (!sv || (!writes && !reads)){
+        if (drain(fd, data_len) != 0)
+            return -1;
+        return send_text(fd, -1, !sv ? "Imagem não servida\n" : "Comando inválido\n");
+    }
+    /* only a put carries data */
+    if (strcmp(argv[1], "put") != 0 && data_len > 0 && drain(fd, data_len) != 0)
+        return -1;
+    if (writes)
+        return queue_write(sv, argc - 1, argv + 1, data_len, fd);
+
+    if (strcmp(argv[1], "cp") == 0)
+        return read_cp(sv, argc - 1, argv + 1, fd);
+
+    /* the listing is made in memory and sent once the lock is released */
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    int status = -1;
+
+    pthread_rwlock_rdlock(&sv->lock);
+    if (sv->closed && out)
+        fprintf(out, "Servidor encerrando\n");
+    else if (out)
+        status = read_ls(sv, argc - 1, argv + 1, out);
+    pthread_rwlock_unlock(&sv->lock);
+    if (out)
+        fclose(out);
+    ret = send_reply(fd, status, text, len);
+    free(text);
+    return ret;
+}
+
+/* connection thread: answers requests in order until the client leaves */
+static void *serve_conn(void *arg){
+    struct serve_conn *conn = arg;
+    struct serve_head head;
+    char *args = malloc(SERVE_MAX_ARGS_LEN + 1);
+
+    while (args && recv_all(conn->fd, &head, sizeof(head)) == 0){
+        if (head.args_len > SERVE_MAX_ARGS_LEN || recv_all(conn->fd, args, head.args_len) != 0)
+            break;
+        args[head.args_len] = '\0';
+        if (handle(conn->srv, conn->fd, args, head.args_len, head.data_len) != 0)
+            break;
+    }
+    free(args);
+
+    /* closed under the lock, so serve() never shuts down a reused descriptor */
+    struct serve_ctx *srv = conn->srv;
+    pthread_mutex_lock(&srv->conn_lock);
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        srv->conns = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+    close(conn->fd);
+    free(conn);
+    pthread_cond_signal(&srv->conn_done);
+    pthread_mutex_unlock(&srv->conn_lock);
+    return NULL;
+}
+
+/* signal thread: SIGINT or SIGTERM stop the accept loop */
+static void *serve_signals(void *arg){
+    struct serve_ctx *srv = arg;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigwait(&set, &sig);
+    __atomic_store_n(&srv->stop, 1, __ATOMIC_RELAXED);
+    shutdown(srv->listen_fd, SHUT_RDWR);
+    return NULL;
+}
+
+/* stop a volume's writer once its queue is empty, wait for its readers
+ * and unmount it
+ */
+static int close_vol(struct serve_vol *sv){
+    int ret;
+
+    pthread_mutex_lock(&sv->qlock);
+    sv->stop = 1;
+    pthread_cond_signal(&sv->qcond);
+    pthread_mutex_unlock(&sv->qlock);
+    pthread_join(sv->writer, NULL);
+
+    pthread_rwlock_wrlock(&sv->lock);
+    ret = vol_close(&sv->vol);
+    sv->closed = 1;
+    pthread_rwlock_unlock(&sv->lock);
+    return ret;
+}
+
+/* mount the images and answer requests until SIGINT or SIGTERM */
+int serve(int argc, char **argv, int flags){
+    struct serve_ctx srv;
+    struct sockaddr_un addr;
+    pthread_rwlockattr_t attr;
+    pthread_t sig_thread, thread;
+    struct stat st;
+    sigset_t set;
+    int i, fd, bound, signals = 0, ret = 0;
+
+    if (argc < 3){
+        fprintf(stderr, "Uso: serve <socket> <imagem> ...\n");
+        return -1;
+    }
+    memset(&srv, 0, sizeof(srv));
+    pthread_mutex_init(&srv.conn_lock, NULL);
+    pthread_cond_init(&srv.conn_done, NULL);
+    srv.n = argc - 2;
+    srv.vols = calloc(srv.n, sizeof(struct serve_vol));
+    if (!srv.vols)
+        return -1;
+
+    /* only the signal thread takes these; threads started later inherit the mask */
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    /* a client that left makes a write fail instead of killing the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* readers keep coming; a waiting writer must not starve behind them */
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (i = 0; i < srv.n; i++){
+        struct serve_vol *sv = &srv.vols[i];
+        sv->path = argv[i + 2];
+        int mounted = vol_open(&sv->vol, sv->path, flags) == 0;
+        if (!mounted || !path_root(&sv->vol)){
+            fprintf(stderr, "Erro ao montar '%s'\n", sv->path);
+            if (mounted)
+                vol_close(&sv->vol);
+            while (i-- > 0)
+                close_vol(&srv.vols[i]);
+            return -1;
+        }
+        pthread_rwlock_init(&sv->lock, &attr);
+        pthread_mutex_init(&sv->meta, NULL);
+        pthread_mutex_init(&sv->qlock, NULL);
+        pthread_cond_init(&sv->qcond, NULL);
+        pthread_cond_init(&sv->qdone, NULL);
+        pthread_create(&sv->writer, NULL, serve_writer, sv);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[1]);
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    /* a socket left by an earlier server is replaced, anything else isn't */
+    if (lstat(addr.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(addr.sun_path);
+    bound = srv.listen_fd >= 0 && bind(srv.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    if (!bound || listen(srv.listen_fd, SERVE_BACKLOG) != 0){
+        perror(argv[1]);
+        srv.stop = 1;
+        ret = -1;
+    } else {
+        fprintf(stderr, "%d imagem(ns) servida(s) em %s\n", srv.n, argv[1]);
+        signals = pthread_create(&sig_thread, NULL, serve_signals, &srv) == 0;
+    }
+
+    while (!__atomic_load_n(&srv.stop, __ATOMIC_RELAXED)){
+        fd = accept4(srv.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0){
+            if (!__atomic_load_n(&srv.stop, __ATOMIC_RELAXED) && errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+        struct serve_conn *conn = calloc(1, sizeof(*conn));
+        if (!conn){
+            close(fd);
+            continue;
+        }
+        conn->srv = &srv;
+        conn->fd = fd;
+        pthread_mutex_lock(&srv.conn_lock);
+        if (pthread_create(&thread, NULL, serve_conn, conn) != 0){
+            pthread_mutex_unlock(&srv.conn_lock);
+            free(conn);
+            close(fd);
+            continue;
+        }
+        conn->next = srv.conns;
+        if (srv.conns)
+            srv.conns->prev = conn;
+        srv.conns = conn;
+        pthread_mutex_unlock(&srv.conn_lock);
+        pthread_detach(thread);
+    }
+
+    /* the connections are cut and every thread waited for: they use srv
+     * and the volumes, which go away with this function */
+    if (signals)
+        pthread_join(sig_thread, NULL);
+    pthread_mutex_lock(&srv.conn_lock);
+    for (struct serve_conn *conn = srv.conns; conn; conn = conn->next)
+        shutdown(conn->fd, SHUT_RDWR);
+    while (srv.conns)
+        pthread_cond_wait(&srv.conn_done, &srv.conn_lock);
+    pthread_mutex_unlock(&srv.conn_lock);
+
+    /* what was queued is applied and flushed before the images close */
+    for (i = 0; i < srv.n; i++){
+        struct serve_vol *sv = &srv.vols[i];
+        if (close_vol(sv) != 0)
+            ret = -1;
+        pthread_rwlock_destroy(&sv->lock);
+        pthread_mutex_destroy(&sv->meta);
+        pthread_mutex_destroy(&sv->qlock);
+        pthread_cond_destroy(&sv->qcond);
+        pthread_cond_destroy(&sv->qdone);
+    }
+    free(srv.vols);
+    if (srv.listen_fd >= 0)
+        close(srv.listen_fd);
+    /* the path is only ours once bound */
+    if (bound)
+        unlink(addr.sun_path);
+    pthread_cond_destroy(&srv.conn_done);
+    pthread_mutex_destroy(&srv.conn_lock);
+    return ret;
+}
+
+/* send one request to a server and print or store its reply */
+int serve_request(int argc, char **argv){
+    struct sockaddr_un addr;
+    struct serve_head head = { 0, 0 };
+    struct serve_reply reply;
+    char args[SERVE_MAX_ARGS_LEN];
+    const char *local = NULL;
+    int fd, local_fd = -1, out_fd = STDOUT_FILENO, i, last, ret;
+    struct stat st;
+
+    if (argc < 4){
+        fprintf(stderr, "Uso: request <socket> <imagem> <comando> ...\n");
+        return -1;
+    }
+    /* cp <path> <local file> and put <local file> <name>: the local file
+     * stays on this side */
+    last = argc;
+    if (strcmp(argv[3], "cp") == 0 && argc >= 6){
+        local = argv[5];
+        last = 5;
+    } else if (strcmp(argv[3], "put") == 0 && argc >= 6){
+        local = argv[4];
+        if ((local_fd = open(local, O_RDONLY)) < 0 || fstat(local_fd, &st) != 0 || st.st_size > UINT32_MAX){
+            fprintf(stderr, "Erro ao abrir o arquivo externo '%s'\n", local);
+            return -1;
+        }
+        head.data_len = st.st_size;
+    }
+    for (i = 2; i < last; i++){
+        size_t len = strlen(argv[i]) + 1;
+        if (strcmp(argv[3], "put") == 0 && i == 4)
+            continue;
+        if (head.args_len + len > sizeof(args)){
+            fprintf(stderr, "Argumentos longos demais\n");
+            return -1;
+        }
+        memcpy(args + head.args_len, argv[i], len);
+        head.args_len += len;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", argv[1]);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0){
+        perror(argv[1]);
+        return -1;
+    }
+
+    ret = write_all(fd, &head, sizeof(head)) == 0 && write_all(fd, args, head.args_len) == 0 ? 0 : -1;
+    for (off_t off = 0; ret == 0 && off < head.data_len; ){
+        ssize_t n = sendfile(fd, local_fd, &off, head.data_len - off);
+        if (n <= 0)
+            ret = -1;
+    }
+    if (local_fd >= 0)
+        close(local_fd);
+    if (ret != 0 || recv_all(fd, &reply, sizeof(reply)) != 0){
+        fprintf(stderr, "Conexão com o servidor perdida\n");
+        close(fd);
+        return -1;
+    }
+
+    /* a cp that worked goes to the local file; anything else is text */
+    if (strcmp(argv[3], "cp") == 0 && local && reply.status == 0){
+        out_fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0){
+            perror(local);
+            close(fd);
+            return -1;
+        }
+    }
+    ret = copy_fd(fd, out_fd, reply.data_len);
+    if (out_fd != STDOUT_FILENO)
+        close(out_fd);
+    close(fd);
+    if (ret != 0){
+        fprintf(stderr, "Resposta incompleta do servidor\n");
+        return -1;
+    }
+    return reply.status;
+}
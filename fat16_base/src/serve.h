@@ -0,0 +1,59 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdint.h>
+
+/* Server mode.
+ * Keeps images mounted (BPB, FAT, loaded directories and their indexes)
+ * and answers ls, cp, put and rm requests on a Unix domain socket, so a
+ * request costs a lookup instead of a process start and an image parse.
+ *
+ * Every message is a frame: a header, then args_len bytes of arguments
+ * (NUL-terminated strings: the image, the command, its arguments), then
+ * data_len bytes of data (the contents of a put). A reply is a header with
+ * the status and the length of what follows: the text the command printed,
+ * or the contents of the file for cp. Integers are in host order; both
+ * ends are on the same machine.
+ *
+ * Each volume has a readers-writer lock. ls and cp share it and only
+ * serialize on a mutex while they resolve paths (the path cache changes as
+ * directories are loaded), or while they read an image that isn't mapped
+ * (the stdio position and the block cache are shared). What they answer
+ * is gathered under the lock, into memory or an anonymous file for cp,
+ * and sent after it is released, so a slow client holds up nobody. put
+ * and rm are queued to the volume's writer thread, which applies
+ * everything queued in one exclusive section and flushes the batch with a
+ * single vol_sync() before answering.
+ */
+
+#define SERVE_MAX_ARGS 16
+#define SERVE_MAX_ARGS_LEN 65536
+
+struct serve_head {
+    uint32_t args_len;
+    uint32_t data_len;
+};
+
+struct serve_reply {
+    int32_t status; /* 0 or -1, as returned by the command */
+    uint32_t data_len;
+};
+
+/* mount the images and answer requests until SIGINT or SIGTERM
+ * argv is "serve", the socket path and the images; flags go to vol_open()
+ * only a socket is replaced at the path; on a signal the open connections
+ * are cut and waited for, and what was queued is flushed before the images
+ * close
+ * returns -1 if an image could not be mounted or the socket created
+ */
+int serve(int, char **, int);
+
+/* send one request to a server and print or store its reply
+ * argv is "request", the socket path, the image and the command: ls [-R]
+ * [path], cp <path> <local file>, put <local file> <name> or rm [-z|-p]
+ * <path>
+ * returns the status of the request
+ */
+int serve_request(int, char **);
+
+#endif
@@ -0,0 +1,85 @@
+#include "stats.h"
+#include <time.h>
+
+static const char *phase_name[STATS_PHASES] = {
+    "mount", "dir_load", "chain_walk", "data_copy", "flush"
+};
+
+/* a timestamp to start a phase with, 0 when counting is off */
+uint64_t stats_clock(struct fat_stats *st){
+    struct timespec ts;
+
+    if (!st)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* add the time since start to a phase */
+void stats_phase(struct fat_stats *st, int phase, uint64_t start){
+    if (!st)
+        return;
+    __atomic_fetch_add(&st->phase_ns[phase], stats_clock(st) - start, __ATOMIC_RELAXED);
+}
+
+/* count one access of len bytes at an image offset
+ * write is 1 for a write and 0 for a read
+ */
+void stats_io(struct fat_stats *st, int write, uint64_t offset, uint64_t len){
+    if (!st)
+        return;
+    if (__atomic_exchange_n(&st->pos, offset + len, __ATOMIC_RELAXED) != offset)
+        __atomic_fetch_add(&st->seeks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &st->writes : &st->reads, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(write ? &st->bytes_written : &st->bytes_read, len, __ATOMIC_RELAXED);
+}
+
+/* count n FAT entries followed */
+void stats_lookups(struct fat_stats *st, uint64_t n){
+    if (st)
+        __atomic_fetch_add(&st->fat_lookups, n, __ATOMIC_RELAXED);
+}
+
+/* print the counters of a command as text or JSON
+ * JSON is a single line, so a dashboard can collect one object per run
+ */
+void stats_print(FILE *out, int format, const char *command, struct fat_stats *st){
+    int i;
+
+    if (!st)
+        return;
+    if (format == STATS_JSON){
+        fprintf(out, "{\"command\":\"%s\",\"seeks\":%llu,\"reads\":%llu,\"writes\":%llu,"
+                "\"bytes_read\":%llu,\"bytes_written\":%llu,\"fat_lookups\":%llu,"
+                "\"dir_cache\":{\"hits\":%llu,\"misses\":%llu}", command,
+                (unsigned long long) st->seeks, (unsigned long long) st->reads,
+                (unsigned long long) st->writes, (unsigned long long) st->bytes_read,
+                (unsigned long long) st->bytes_written, (unsigned long long) st->fat_lookups,
+                (unsigned long long) st->dir_hits, (unsigned long long) st->dir_misses);
+        if (st->has_cache)
+            fprintf(out, ",\"block_cache\":{\"hits\":%llu,\"misses\":%llu,\"readahead\":%llu,"
+                    "\"reads\":%llu,\"writes\":%llu}",
+                    (unsigned long long) st->cache.hits, (unsigned long long) st->cache.misses,
+                    (unsigned long long) st->cache.readahead, (unsigned long long) st->cache.reads,
+                    (unsigned long long) st->cache.writes);
+        fprintf(out, ",\"phases_ms\":{");
+        for (i = 0; i < STATS_PHASES; i++)
+            fprintf(out, "%s\"%s\":%.3f", i ? "," : "", phase_name[i], st->phase_ns[i] / 1e6);
+        fprintf(out, "}}\n");
+        return;
+    }
+
+    fprintf(out, "%s: %llu read(s), %llu byte(s); %llu write(s), %llu byte(s); %llu seek(s)\n",
+            command, (unsigned long long) st->reads, (unsigned long long) st->bytes_read,
+            (unsigned long long) st->writes, (unsigned long long) st->bytes_written,
+            (unsigned long long) st->seeks);
+    fprintf(out, "FAT lookups: %llu; directory cache: %llu hit(s), %llu miss(es)\n",
+            (unsigned long long) st->fat_lookups, (unsigned long long) st->dir_hits,
+            (unsigned long long) st->dir_misses);
+    if (st->has_cache)
+        fprintf(out, "block cache: %llu hit(s), %llu miss(es), %llu read ahead\n",
+                (unsigned long long) st->cache.hits, (unsigned long long) st->cache.misses,
+                (unsigned long long) st->cache.readahead);
+    for (i = 0; i < STATS_PHASES; i++)
+        fprintf(out, "%-10s %10.3f ms\n", phase_name[i], st->phase_ns[i] / 1e6);
+}
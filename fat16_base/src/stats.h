@@ -0,0 +1,54 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "fat16.h"
+#include "bcache.h"
+
+#define STATS_MOUNT 0 /* vol_open: BPB, journal recovery, FAT load */
+#define STATS_DIR_LOAD 1 /* loading and indexing directories */
+#define STATS_CHAIN_WALK 2 /* resolving cluster chains into extents */
+#define STATS_DATA_COPY 3 /* moving file data in or out of the image */
+#define STATS_FLUSH 4 /* writing back the FAT, the journal and the cache */
+#define STATS_PHASES 5
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+/* Instrumentation counters of a volume.
+ * Only allocated with --stats: every hook is a NULL check otherwise, and
+ * the clock is never read. I/O is counted where it reaches the image
+ * (vol_read, vol_write and friends); a seek is an access that doesn't
+ * start where the previous one ended. Phases are wall-clock time summed
+ * over every call, so they can nest (a directory load walks its chain)
+ * and, with worker threads, add up to more than the elapsed time.
+ * The counters are updated atomically, as workers share the volume.
+ */
+struct fat_stats {
+    uint64_t seeks, reads, writes;
+    uint64_t bytes_read, bytes_written;
+    uint64_t fat_lookups; /* FAT entries followed */
+    uint64_t dir_hits, dir_misses; /* directories found in the path cache or loaded */
+    uint64_t pos; /* where the last access ended */
+    uint64_t phase_ns[STATS_PHASES];
+    struct bcache_stats cache; /* the block cache's, taken when it is released */
+    int has_cache;
+};
+
+/* a timestamp to start a phase with, 0 when counting is off */
+uint64_t stats_clock(struct fat_stats *);
+
+/* add the time since start to a phase */
+void stats_phase(struct fat_stats *, int, uint64_t);
+
+/* count one access of len bytes at an image offset */
+void stats_io(struct fat_stats *, int, uint64_t, uint64_t);
+
+/* count n FAT entries followed */
+void stats_lookups(struct fat_stats *, uint64_t);
+
+/* print the counters of a command, and those of the block cache if it was
+ * used, as text or JSON (STATS_TEXT or STATS_JSON)
+ */
+void stats_print(FILE *, int, const char *, struct fat_stats *);
+
+#endif
@@ -1,38 +1,138 @@
-#include "support.h"
-#include <stdio.h>
-#include <string.h>
-
-/* Manipulate the path to lead com name, extensions and special characters */
-char* padding(char *filename){
-    char output[11];
-    char* strptr = filename;
-    char* dot;
-    dot = strchr(filename, '.');
-
-    int i;
-    for(i=0; strptr != dot; strptr++, i++){
-    	if(i==8)
-    		break;
-    	output[i] = *strptr;
-    }
-
-    int trail = 8 - i;
-    for(; trail > 0; trail--, i++){
-    	output[i] = ' ';
-    }
-
-    strptr = dot;
-    strptr++;
-    for(i=8; i < 11; strptr++, i++){
-    	output[i] = *strptr;
-    }
-
-    output[11] = '\0';
-    for(i = 0; output[i] != '\0'; i++){
-    	output[i] = toupper(output[i]);
-    }
-    
-    char* out = output;
-    return out;
-
-}
\ No newline at end of file
+#include "support.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* Manipulate the path to lead com name, extensions and special characters
+ * the 11-byte 8.3 name (plus a terminator) is written to output, which must
+ * hold 12 bytes; directories in the path are ignored and a name that is
+ * already padded (11 characters, no dot) is kept as it is
+ */
+char* padding(const char *filename, char *output){
+    const char* strptr;
+    const char* dot;
+    const char* slash = strrchr(filename, '/');
+
+    if (slash)
+        filename = slash + 1;
+    dot = strrchr(filename, '.');
+
+    if (!dot && strlen(filename) == 11){
+        memcpy(output, filename, 11);
+        output[11] = '\0';
+        return output;
+    }
+
+    int i;
+    for(i=0, strptr = filename; *strptr && strptr != dot; strptr++, i++){
+    	if(i==8)
+    		break;
+    	output[i] = *strptr;
+    }
+
+    int trail = 8 - i;
+    for(; trail > 0; trail--, i++){
+    	output[i] = ' ';
+    }
+
+    strptr = dot ? dot + 1 : "";
+    for(i=8; i < 11; i++){
+    	output[i] = *strptr ? *strptr++ : ' ';
+    }
+
+    output[11] = '\0';
+    for(i = 0; output[i] != '\0'; i++){
+    	output[i] = toupper((unsigned char) output[i]);
+    }
+
+    return output;
+
+}
+
+/* last component of a path */
+const char* path_basename(const char *path){
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+/* turn a padded 8.3 name into "NAME.EXT", dropping the padding blanks
+ * output must hold 13 bytes
+ */
+char* unpadding(const unsigned char *name, char *output){
+    int i, len = 0;
+
+    for (i = 0; i < 8 && name[i] != ' '; i++)
+        output[len++] = name[i];
+    if (name[8] != ' '){
+        output[len++] = '.';
+        for (i = 8; i < 11 && name[i] != ' '; i++)
+            output[len++] = name[i];
+    }
+    output[len] = '\0';
+    return output;
+}
+
+/* monotonic clock in milliseconds, for timings */
+double now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* size with an optional K, M or G suffix, capped at 4 GiB - 1 */
+uint32_t parse_size(const char *arg){
+    char *end;
+    double v = strtod(arg, &end);
+
+    if (*end == 'k' || *end == 'K')
+        v *= 1024;
+    else if (*end == 'm' || *end == 'M')
+        v *= 1024 * 1024;
+    else if (*end == 'g' || *end == 'G')
+        v *= 1024.0 * 1024 * 1024;
+    return v > UINT32_MAX ? UINT32_MAX : (uint32_t) v;
+}
+
+/* write len bytes to a descriptor, resuming after short writes and signals
+ * returns -1 if the descriptor failed
+ */
+int write_all(int fd, const void *buff, size_t len){
+    const uint8_t *p = buff;
+    ssize_t n;
+
+    while (len > 0){
+        n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* read len bytes from a descriptor, stopping early only at end of input
+ * returns the number of bytes read, or -1 on error
+ */
+ssize_t read_full(int fd, void *buff, size_t len){
+    uint8_t *p = buff;
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len){
+        n = read(fd, p + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        got += n;
+    }
+    return got;
+}
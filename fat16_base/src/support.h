@@ -1,7 +1,32 @@
-#ifndef SUPPORT_H
-#define SUPPORT_H
-
-
-char* padding(char *filename);
-
+#ifndef SUPPORT_H
+#define SUPPORT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+
+char* padding(const char *filename, char *output);
+
+/* last component of a path */
+const char* path_basename(const char *path);
+
+/* turn a padded 8.3 name into "NAME.EXT"; output must hold 13 bytes */
+char* unpadding(const unsigned char *name, char *output);
+
+/* monotonic clock in milliseconds, for timings */
+double now_ms(void);
+
+/* size with an optional K, M or G suffix, capped at 4 GiB - 1 */
+uint32_t parse_size(const char *);
+
+/* write len bytes to a descriptor, resuming after short writes and signals
+ * returns -1 if the descriptor failed
+ */
+int write_all(int, const void *, size_t);
+
+/* read len bytes from a descriptor, stopping early only at end of input
+ * returns the number of bytes read, or -1 on error
+ */
+ssize_t read_full(int, void *, size_t);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+#include "volume.h"
+#include "support.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+
+#define COPY_CHUNK (1 << 20) /* bounce buffer used when no zero-copy path works */
+
+/* put a block cache over the image, on a descriptor of its own opened with
+ * O_DIRECT if asked to; without O_DIRECT (tmpfs, some network file systems)
+ * the cache uses the image's descriptor
+ * returns -1 if the cache could not be allocated
+ */
+static int cache_open(struct fat_volume *vol, const char *path, int direct){
+    int fd = vol->fd;
+
+    if (direct){
+        fd = open(path, O_RDWR | O_DIRECT);
+        if (fd < 0){
+            fprintf(stderr, "O_DIRECT indisponível para %s, usando o cache sem ele\n", path);
+            fd = vol->fd;
+            direct = 0;
+        }
+    }
+    vol->cache = malloc(sizeof(*vol->cache));
+    if (!vol->cache || bcache_init(vol->cache, fd, vol->size, BCACHE_BLOCKS, direct) != 0){
+        free(vol->cache);
+        vol->cache = NULL;
+        if (fd != vol->fd)
+            close(fd);
+        return -1;
+    }
+    vol->backend = direct ? VOL_DIRECT : VOL_CACHE;
+    return 0;
+}
+
+/* open the image, replay its journal, read its BPB and FAT and map it or
+ * put the block cache over it if asked to; when the image can't be mapped
+ * the stdio backend is used instead
+ * returns -1 if the image could not be opened, its journal not replayed or
+ * its FAT not loaded
+ */
+int vol_open(struct fat_volume *vol, const char *path, int flags){
+    struct stat st;
+
+    memset(vol, 0, sizeof(*vol));
+    vol->fp = fopen(path, "rb+");
+    if (!vol->fp){
+        fprintf(stderr, "Could not open file %s\n", path);
+        return -1;
+    }
+    vol->fd = fileno(vol->fp);
+    vol->out = stdout;
+    if ((flags & VOL_STATS) && !(vol->stats = calloc(1, sizeof(*vol->stats)))){
+        fclose(vol->fp);
+        return -1;
+    }
+    uint64_t start = stats_clock(vol->stats);
+    vol->backend = VOL_STDIO;
+
+    if (fstat(vol->fd, &st) == 0)
+        vol->size = st.st_size;
+
+    if ((flags & VOL_BACKEND) == VOL_MMAP && vol->size > 0){
+        void *map = mmap(NULL, vol->size, PROT_READ | PROT_WRITE, MAP_SHARED, vol->fd, 0);
+        if (map != MAP_FAILED){
+            vol->map = map;
+            vol->backend = VOL_MMAP;
+        }
+    } else if ((flags & VOL_BACKEND) == VOL_CACHE || (flags & VOL_BACKEND) == VOL_DIRECT){
+        if (cache_open(vol, path, (flags & VOL_BACKEND) == VOL_DIRECT) != 0){
+            vol_close(vol);
+            return -1;
+        }
+    }
+
+    /* a journal left by a crash is replayed (or discarded) before anything
+     * is read from the image */
+    if (journal_recover(vol, path) != 0 ||
+            vol_read(vol, 0x0, &vol->bpb, sizeof(vol->bpb)) != 0 ||
+            fat_cache_load(vol) != 0 ||
+            ((flags & VOL_JOURNAL) && journal_open(vol, path) != 0)){
+        vol_close(vol);
+        free(vol->stats);
+        vol->stats = NULL;
+        return -1;
+    }
+    vol->fat.stats = vol->stats;
+    stats_phase(vol->stats, STATS_MOUNT, start);
+    return 0;
+}
+
+/* write back the FAT and force everything to stable storage
+ * returns -1 if the FAT could not be written or the image synced
+ */
+int vol_sync(struct fat_volume *vol){
+    uint64_t start = stats_clock(vol->stats);
+    int ret = 0;
+
+    if (fat_cache_flush(vol) != 0)
+        ret = -1;
+    else if (vol->journal)
+        ret = journal_commit(vol);
+    else if (vol->cache && bcache_flush(vol->cache) != 0)
+        ret = -1;
+    else if (vol->map && msync(vol->map, vol->size, MS_SYNC) != 0)
+        ret = -1;
+    else if (fsync(vol->fd) != 0)
+        ret = -1;
+    stats_phase(vol->stats, STATS_FLUSH, start);
+    return ret;
+}
+
+/* write back the FAT and release everything held by the volume
+ * with a journal, what is pending is committed and the journal removed;
+ * with the block cache, its dirty blocks are written back
+ * returns -1 if the FAT or the cached blocks could not be written
+ */
+int vol_close(struct fat_volume *vol){
+    uint64_t start = stats_clock(vol->stats);
+    int ret = 0;
+
+    if (vol->fat.entries){
+        ret = fat_cache_flush(vol);
+        fat_cache_destroy(&vol->fat);
+    }
+    if (journal_close(vol) != 0)
+        ret = -1;
+    if (vol->cache){
+        if (bcache_destroy(vol->cache) != 0)
+            ret = -1;
+        if (vol->cache->fd != vol->fd)
+            close(vol->cache->fd);
+        if (vol->stats){
+            vol->stats->cache = vol->cache->st;
+            vol->stats->has_cache = 1;
+        }
+        free(vol->cache);
+        vol->cache = NULL;
+    }
+    path_cache_clear(vol);
+    dirtab_destroy(&vol->root);
+    aio_destroy(vol->aio);
+    vol->aio = NULL;
+    if (vol->map){
+        munmap(vol->map, vol->size);
+        vol->map = NULL;
+    }
+    if (vol->fp){
+        fclose(vol->fp);
+        vol->fp = NULL;
+    }
+    stats_phase(vol->stats, STATS_FLUSH, start);
+    return ret;
+}
+
+/* pointer to len bytes at an image offset */
+void *vol_ptr(struct fat_volume *vol, uint32_t offset, uint32_t len){
+    if (!vol->map || (size_t) offset + len > vol->size)
+        return NULL;
+    if (journal_overlaps(vol->journal, offset, len))
+        return NULL;
+    return vol->map + offset;
+}
+
+/* read len bytes at an image offset
+ * mapped ranges are copied from memory; the rest goes through the block
+ * cache if there is one and the stdio path otherwise
+ * journaled writes not applied yet are put over what was read
+ * returns -1 if seeking or reading failed and 0 if success
+ */
+int vol_read(struct fat_volume *vol, uint32_t offset, void *buff, uint32_t len){
+    void *src = vol_ptr(vol, offset, len);
+
+    stats_io(vol->stats, 0, offset, len);
+    if (src){
+        memcpy(buff, src, len);
+        return 0;
+    }
+    if (vol->cache){
+        if (bcache_read(vol->cache, offset, buff, len) != 0){
+            fprintf(stderr, "Error reading file\n");
+            return -1;
+        }
+    } else if (vol->map){
+        /* past the end of the mapping: don't mix stdio buffers with the map */
+        if (pread(vol->fd, buff, len, offset) != (ssize_t) len){
+            fprintf(stderr, "Error reading file\n");
+            return -1;
+        }
+    } else if (read_bytes(vol->fp, offset, buff, len) != 0){
+        return -1;
+    }
+    journal_overlay(vol->journal, offset, buff, len);
+    return 0;
+}
+
+/* write len bytes at an image offset
+ * returns -1 if seeking or writing failed and 0 if success
+ */
+int vol_write(struct fat_volume *vol, uint32_t offset, const void *buff, uint32_t len){
+    void *dst = vol_ptr(vol, offset, len);
+
+    stats_io(vol->stats, 1, offset, len);
+    if (dst){
+        memcpy(dst, buff, len);
+        return 0;
+    }
+    if (vol->cache){
+        if (bcache_write(vol->cache, offset, buff, len) != 0){
+            fprintf(stderr, "Error writing file\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (vol->map){
+        if (pwrite(vol->fd, buff, len, offset) != (ssize_t) len){
+            fprintf(stderr, "Error writing file\n");
+            return -1;
+        }
+        return 0;
+    }
+    if (fseek(vol->fp, offset, SEEK_SET) != 0){
+        fprintf(stderr, "Error when seeking to %u\n", offset);
+        return -1;
+    }
+    if (fwrite(buff, 1, len, vol->fp) != len){
+        fprintf(stderr, "Error writing file\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* write len bytes of metadata at an image offset, through the journal if
+ * there is one
+ */
+int vol_write_meta(struct fat_volume *vol, uint32_t offset, const void *buff, uint32_t len){
+    if (vol->journal)
+        return journal_write(vol, offset, buff, len);
+    return vol_write(vol, offset, buff, len);
+}
+
+/* zero len bytes at an image offset
+ * with punch the range is deallocated with a hole (the image stays the same
+ * size and reads back as zeros); when the file system can't punch holes, or
+ * without punch, it is overwritten with zeros a chunk at a time
+ * returns -1 if writing failed and 0 if success
+ */
+int vol_zero(struct fat_volume *vol, uint32_t offset, uint32_t len, int punch){
+    uint8_t *dst = vol_ptr(vol, offset, len);
+
+    if (punch){
+        /* pending stdio writes would land on top of the hole */
+        if (!vol->map)
+            fflush(vol->fp);
+        if (vol->cache && bcache_invalidate(vol->cache, offset, len) != 0)
+            return -1;
+        if (fallocate(vol->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0)
+            return 0;
+    }
+    if (dst){
+        memset(dst, 0, len);
+        return 0;
+    }
+
+    uint8_t *zeros = calloc(1, len < COPY_CHUNK ? len : COPY_CHUNK);
+    if (!zeros)
+        return -1;
+    while (len > 0){
+        uint32_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        if (vol_write(vol, offset, zeros, chunk) != 0){
+            free(zeros);
+            return -1;
+        }
+        offset += chunk;
+        len -= chunk;
+    }
+    free(zeros);
+    return 0;
+}
+
+/* copy len bytes at an image offset to a file descriptor
+ * mapped ranges are written straight from the mapping; otherwise the kernel
+ * moves the data (copy_file_range to regular files, sendfile to anything
+ * else) and a bounce buffer is only used when neither is supported, or when
+ * the block cache may hold blocks the image doesn't have yet
+ * returns -1 if reading or writing failed and 0 if success
+ */
+int vol_copy_out(struct fat_volume *vol, uint32_t offset, uint32_t len, int fd){
+    uint8_t *src = vol_ptr(vol, offset, len);
+    struct stat st;
+    loff_t off = offset;
+    ssize_t n = 0;
+
+    /* through the block cache the bounce buffer below counts it */
+    if (!vol->cache)
+        stats_io(vol->stats, 0, offset, len);
+    if (src)
+        return write_all(fd, src, len);
+
+    /* the descriptor must see what was written through stdio */
+    if (!vol->map)
+        fflush(vol->fp);
+
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    while (!vol->cache && len > 0){
+        if (regular)
+            n = copy_file_range(vol->fd, &off, fd, NULL, len, 0);
+        else
+            n = sendfile(fd, vol->fd, &off, len);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    if (len == 0)
+        return 0;
+    if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+        return -1;
+
+    uint8_t *buffer = malloc(len < COPY_CHUNK ? len : COPY_CHUNK);
+    if (!buffer)
+        return -1;
+    while (len > 0){
+        uint32_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+        if ((vol->cache ? vol_read(vol, off, buffer, chunk) != 0 :
+                    pread(vol->fd, buffer, chunk, off) != (ssize_t) chunk) ||
+                write_all(fd, buffer, chunk) != 0){
+            free(buffer);
+            return -1;
+        }
+        off += chunk;
+        len -= chunk;
+    }
+    free(buffer);
+    return 0;
+}
+
+/* move the first size bytes of a file, given by its extents, between the
+ * image and a local file through the async engine: out of the image when
+ * in is 0, into it otherwise; the local file is read or written from its
+ * current position, which is moved past the data as read() or write() would
+ * only regular files are taken, and only when the image itself is current:
+ * no block cache and no journaled writes pending over the data
+ * returns 0 if everything was copied, 1 if the engine can't be used (nothing
+ * was copied) and -1 if a read or write failed
+ */
+static int copy_async(struct fat_volume *vol, struct fat_extent *ext, int n_ext,
+        uint32_t size, int fd, int in){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    struct aio_range *ranges;
+    struct stat st;
+    off_t pos;
+    int i, n = 0, ret;
+
+    if (!vol->aio || vol->cache || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return 1;
+    if ((pos = lseek(fd, 0, SEEK_CUR)) < 0 || !(ranges = malloc(n_ext * sizeof(*ranges))))
+        return 1;
+
+    for (i = 0; i < n_ext && size > 0; i++){
+        uint32_t addr = bpb_clust_addr(&vol->bpb, ext[i].start);
+        uint32_t len = ext[i].len * cluster_size;
+
+        if (len > size)
+            len = size;
+        if (journal_overlaps(vol->journal, addr, len)){
+            free(ranges);
+            return 1;
+        }
+        ranges[n].src = in ? (uint64_t) pos : addr;
+        ranges[n].dst = in ? addr : (uint64_t) pos;
+        ranges[n].len = len;
+        pos += len;
+        size -= len;
+        n++;
+    }
+    /* a chain shorter than the size is left to the plain copy to report */
+    if (size > 0){
+        free(ranges);
+        return 1;
+    }
+
+    /* the descriptor must see what was written through stdio, and stdio
+     * must not keep buffered data the engine is about to overwrite
+     */
+    if (!vol->map)
+        fflush(vol->fp);
+    ret = aio_copy(vol->aio, in ? fd : vol->fd, in ? vol->fd : fd, ranges, n);
+    if (ret == 0){
+        for (i = 0; i < n; i++)
+            stats_io(vol->stats, in, in ? ranges[i].dst : ranges[i].src, ranges[i].len);
+        lseek(fd, pos, SEEK_SET);
+    } else if (ret < 0){
+        perror("Erro na cópia assíncrona");
+    }
+    free(ranges);
+    return ret;
+}
+
+/* copy the first size bytes of a file, given by its extents, to a descriptor
+ * with an async engine the extents are copied through it, keeping several
+ * reads in flight; otherwise each extent is moved with a single vol_copy_out()
+ * returns the number of bytes that could not be copied
+ */
+uint32_t vol_copy_extents(struct fat_volume *vol, struct fat_extent *ext, int n_ext,
+        uint32_t size, int fd){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint32_t extent_size, bytes_to_copy;
+    uint64_t start = stats_clock(vol->stats);
+    int i, ret;
+
+    ret = copy_async(vol, ext, n_ext, size, fd, 0);
+    if (ret <= 0){
+        stats_phase(vol->stats, STATS_DATA_COPY, start);
+        return ret == 0 ? 0 : size;
+    }
+
+    for (i = 0; i < n_ext && size > 0; i++){
+        extent_size = ext[i].len * cluster_size;
+        bytes_to_copy = size > extent_size ? extent_size : size;
+
+        if (vol_copy_out(vol, bpb_clust_addr(&vol->bpb, ext[i].start), bytes_to_copy, fd) != 0)
+            break;
+        size -= bytes_to_copy;
+    }
+    stats_phase(vol->stats, STATS_DATA_COPY, start);
+    return size;
+}
+
+/* fill the first size bytes of a file, given by its extents, from a descriptor
+ * through the async engine when there is one, and otherwise a chunk of an
+ * extent at a time through a bounce buffer
+ * returns the number of bytes that could not be copied
+ */
+uint32_t vol_copy_in(struct fat_volume *vol, struct fat_extent *ext, int n_ext,
+        uint32_t size, int fd){
+    uint32_t cluster_size = vol->bpb.bytes_p_sect * vol->bpb.sector_p_clust;
+    uint64_t start = stats_clock(vol->stats);
+    uint8_t *buffer;
+    int i, ret;
+
+    ret = copy_async(vol, ext, n_ext, size, fd, 1);
+    if (ret <= 0){
+        stats_phase(vol->stats, STATS_DATA_COPY, start);
+        return ret == 0 ? 0 : size;
+    }
+
+    buffer = malloc(size < COPY_CHUNK ? size : COPY_CHUNK);
+    if (!buffer)
+        return size;
+    for (i = 0; i < n_ext && size > 0; i++){
+        uint32_t offset = bpb_clust_addr(&vol->bpb, ext[i].start);
+        uint32_t len = ext[i].len * cluster_size;
+
+        if (len > size)
+            len = size;
+        while (len > 0){
+            uint32_t chunk = len < COPY_CHUNK ? len : COPY_CHUNK;
+            if (read_full(fd, buffer, chunk) != (ssize_t) chunk ||
+                    vol_write(vol, offset, buffer, chunk) != 0)
+                goto out;
+            offset += chunk;
+            len -= chunk;
+            size -= chunk;
+        }
+    }
+out:
+    free(buffer);
+    stats_phase(vol->stats, STATS_DATA_COPY, start);
+    return size;
+}
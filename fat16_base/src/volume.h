@@ -0,0 +1,95 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include <stddef.h>
+#include "fat16.h"
+#include "fatcache.h"
+#include "dir.h"
+#include "path.h"
+#include "journal.h"
+#include "bcache.h"
+#include "stats.h"
+#include "aio.h"
+
+#define VOL_STDIO 0 /* fseek/fread/fwrite on the image */
+#define VOL_MMAP 1 /* image mapped in memory, stdio when it can't be mapped */
+#define VOL_CACHE 2 /* pread/pwrite through the block cache */
+#define VOL_DIRECT 3 /* the block cache over O_DIRECT, VOL_CACHE when unsupported */
+#define VOL_BACKEND 0x0f /* the backend bits of the flags */
+#define VOL_JOURNAL 0x10 /* or'ed with the backend: journal the metadata writes */
+#define VOL_STATS 0x20 /* or'ed with the backend: count the I/O and time the phases */
+
+/* A mounted FAT16 image.
+ * Holds the open image, its BPB and the cached FAT. With the mmap backend
+ * the whole image is also mapped, so the root directory, the FAT and the
+ * cluster data can be reached by pointer through vol_ptr(). With the cache
+ * backends every read and write goes through a block cache instead.
+ */
+struct fat_volume {
+    FILE *fp; /* image opened for reading and writing */
+    int fd; /* descriptor of fp */
+    uint8_t *map; /* mapping of the whole image, NULL on the stdio backend */
+    size_t size; /* image size in bytes */
+    int backend; /* VOL_STDIO, VOL_MMAP, VOL_CACHE or VOL_DIRECT, after any fallback */
+    struct fat_bpb bpb;
+    struct fat_cache fat;
+    struct fat_dirtab root; /* root directory, loaded on first use */
+    struct path_cache *paths; /* subdirectories loaded by the path resolver */
+    struct fat_journal *journal; /* open transaction, NULL without a journal */
+    struct bcache *cache; /* block cache, NULL unless a cache backend is used */
+    FILE *out; /* where commands print their results, stdout unless redirected */
+    struct fat_stats *stats; /* NULL without VOL_STATS; kept by vol_close() for the report */
+    struct aio_engine *aio; /* moves file data between the image and local files, NULL if not set */
+};
+
+/* open the image, replay its journal, read its BPB and FAT and map it if
+ * asked to; flags is the backend, with VOL_JOURNAL to journal the metadata
+ * and VOL_STATS to count what the commands do
+ */
+int vol_open(struct fat_volume *, const char *, int);
+
+/* write back the FAT and force everything to stable storage
+ * with a journal, this commits the metadata written since the last sync
+ */
+int vol_sync(struct fat_volume *);
+
+/* write back the FAT and release everything held by the volume but its
+ * counters, which the caller frees once it has reported them
+ */
+int vol_close(struct fat_volume *);
+
+/* read len bytes at an image offset */
+int vol_read(struct fat_volume *, uint32_t, void *, uint32_t);
+
+/* write len bytes at an image offset */
+int vol_write(struct fat_volume *, uint32_t, const void *, uint32_t);
+
+/* write len bytes of metadata (FAT or directory slots) at an image offset,
+ * through the journal if there is one
+ */
+int vol_write_meta(struct fat_volume *, uint32_t, const void *, uint32_t);
+
+/* zero len bytes at an image offset, punching a hole if asked to */
+int vol_zero(struct fat_volume *, uint32_t, uint32_t, int);
+
+/* copy len bytes at an image offset to a file descriptor */
+int vol_copy_out(struct fat_volume *, uint32_t, uint32_t, int);
+
+/* copy the first size bytes of a file, given by its extents, to a descriptor
+ * returns the number of bytes that could not be copied
+ */
+uint32_t vol_copy_extents(struct fat_volume *, struct fat_extent *, int, uint32_t, int);
+
+/* fill the first size bytes of a file, given by its extents, from a
+ * descriptor, starting at its current position
+ * returns the number of bytes that could not be copied
+ */
+uint32_t vol_copy_in(struct fat_volume *, struct fat_extent *, int, uint32_t, int);
+
+/* pointer to len bytes at an image offset
+ * returns NULL on the stdio backend, if the range is not mapped or if it
+ * has journaled writes still pending
+ */
+void *vol_ptr(struct fat_volume *, uint32_t, uint32_t);
+
+#endif